@@ -8,3 +8,4 @@ COMPONENT(Gravity, GravityParams)
 COMPONENT(Scale, float)
 COMPONENT(Deactivatable, ActiveState)
 COMPONENT(DestroyTimer, uint16_t)
+COMPONENT(Inactive, InactiveTag)
@@ -3,12 +3,19 @@
 
 #include <types.h>
 #include <platform_gfx.h>
+#include <mem.h>
+#include <multiarraylist.h>
 
 #define MAX_ARCHETYPES 256
 
-// TODO dynamically allocate entity memory
+// Upper limit on the number of entity slots, the entity table itself grows in chunks as entities are created
 #define MAX_ENTITIES 65536
 
+static_assert(MAX_ENTITIES <= 0x10000, "Entity handles only have room for a 16-bit slot index");
+
+// Maximum number of behavior callbacks that can have a batch function registered at once
+#define MAX_BATCH_BEHAVIORS 32
+
 #define COMPONENT(Name, Type) Component_##Name,
 
 enum Components
@@ -19,6 +26,8 @@ NUM_COMPONENT_TYPES
 
 #undef COMPONENT
 
+static_assert(NUM_COMPONENT_TYPES == multiarraylist_num_component_types, "Block change versions don't cover every component");
+
 #define COMPONENT(Name, Type) Bit_##Name = 1 << Component_##Name,
 
 enum ComponentBits
@@ -44,6 +53,45 @@ typedef struct Entity_t {
     size_t archetypeArrayIndex;
 } Entity;
 
+// Generation-checked reference to an entity, made of the entity's slot index in the low 16 bits and the slot's
+// generation in the high 16 bits. Unlike an Entity*, a handle stops resolving once its entity is deleted, even
+// if the slot has since been reused by another entity. A handle of zero never refers to an entity.
+typedef uint32_t EntityHandle;
+
+constexpr EntityHandle null_entity_handle = 0;
+
+// One memory pool block worth of the entity table
+// Chunks are allocated as the number of entity slots grows and never move, so Entity pointers stay valid
+struct EntityChunk {
+    // Slot index of the first entity in this chunk
+    uint32_t firstIndex;
+    // Generation of each slot in this chunk, bumped whenever the slot is handed to a new entity
+    uint16_t generations[(mem_block_size - sizeof(uint32_t)) / (sizeof(Entity) + sizeof(uint16_t))];
+    Entity entities[(mem_block_size - sizeof(uint32_t)) / (sizeof(Entity) + sizeof(uint16_t))];
+};
+
+constexpr size_t entities_per_chunk = sizeof(EntityChunk::entities) / sizeof(Entity);
+constexpr size_t max_entity_chunks = (MAX_ENTITIES + entities_per_chunk - 1) / entities_per_chunk;
+
+static_assert(sizeof(EntityChunk) <= mem_block_size, "Entity chunk does not fit in a memory pool block");
+
+// Chunks of the entity table indexed by slot index / entities_per_chunk, or nullptr for chunks that aren't allocated
+extern EntityChunk *entityChunks[max_entity_chunks];
+
+// Gets the chunk containing the given entity
+// Memory pool blocks are aligned to their size, so this is just a mask of the entity's address
+inline EntityChunk *getEntityChunk(Entity *e)
+{
+    return reinterpret_cast<EntityChunk*>(reinterpret_cast<uintptr_t>(e) & ~(mem_block_size - 1));
+}
+
+// Gets the slot index of the given entity in the entity table
+inline uint32_t getEntityIndex(Entity *e)
+{
+    EntityChunk *chunk = getEntityChunk(e);
+    return chunk->firstIndex + (e - &chunk->entities[0]);
+}
+
 // Callback provided to the ecs to be called for every array of a given component selection when iterating
 typedef void (*EntityArrayCallback)(size_t count, void *arg, void **componentArrays);
 
@@ -62,13 +110,32 @@ struct BehaviorState
     std::array<uint8_t, 16> data;
 };
 
+// Callback for a run of consecutive entities in one block that share a behavior callback, see registerBatchBehavior
+// componentArrays holds the entity pointer array followed by every component array in the archetype (in the same
+// order as EntityArrayCallbackAll), each starting at the first entity of the run.
+// behaviors points at the run's behavior states, for each entity's data.
+typedef void (*EntityBehaviorBatchCallback)(size_t count, void **componentArrays, archetype_t archetype, BehaviorState *behaviors);
+
 struct ActiveState {
     uint8_t delete_on_deactivate : 1;
+    // Whether the entity is deactivated, this is authoritative and the Inactive tag only lets queries skip whole archetypes
+    // activateEntities and deactivateEntities keep the two in sync, but anything else that sets it (level data, prefabs,
+    // queued component sets, behaviors) leaves the entity where it is, so systems over deactivatable entities check it too
     uint8_t deactivated : 1;
 };
 
+// Tag for deactivated entities, which moves them into their own archetypes so that queries can reject them
+// It has no data, so it doesn't take up any space in the entities' blocks
+struct InactiveTag {};
+
 #include <bit>
 #include <memory>
+#include <span>
+#include <type_traits>
+
+// Size of a component's data in a block, which is 0 for tags
+template <typename T>
+constexpr size_t component_storage_size = std::is_empty_v<T> ? 0 : sizeof(T);
 
 template <unsigned int ComponentBit, typename ComponentType>
 constexpr ComponentType* get_component(void **components, archetype_t archetype)
@@ -87,40 +154,592 @@ constexpr Entity* get_entity(void **components)
     return *static_cast<Entity**>(components[0]);
 }
 
+// Creates a handle to the given (live) entity
+inline EntityHandle getEntityHandle(Entity *e)
+{
+    EntityChunk *chunk = getEntityChunk(e);
+    size_t offset = e - &chunk->entities[0];
+    return (static_cast<uint32_t>(chunk->generations[offset]) << 16) | (chunk->firstIndex + offset);
+}
+
+// Returns the entity the given handle refers to, or nullptr if that entity has been deleted
+inline Entity *resolveEntityHandle(EntityHandle handle)
+{
+    uint32_t index = handle & 0xFFFF;
+    EntityChunk *chunk = entityChunks[index / entities_per_chunk];
+    if (chunk == nullptr)
+    {
+        return nullptr;
+    }
+    size_t offset = index % entities_per_chunk;
+    Entity *e = &chunk->entities[offset];
+    if ((handle >> 16) != chunk->generations[offset] || e->archetype == 0)
+    {
+        return nullptr;
+    }
+    return e;
+}
+
+// Checks if the entity the given handle refers to still exists
+inline bool isEntityHandleValid(EntityHandle handle)
+{
+    return resolveEntityHandle(handle) != nullptr;
+}
+
+// Cached component layout of one archetype matched by an EntityQuery
+struct EntityQueryMatch {
+    // The arraylist holding the archetype's entities
+    MultiArrayList *arr;
+    // The archetype itself
+    archetype_t archetype;
+    // Number of components in the archetype
+    uint16_t numComponents;
+    // Offsets into each block of the arrays for the queried components, in component order
+    uint16_t componentOffsets[NUM_COMPONENT_TYPES];
+    // Offsets into each block of the arrays for every component in the archetype, in component order
+    uint16_t allComponentOffsets[NUM_COMPONENT_TYPES];
+    // Sizes of every component in the archetype, in component order
+    size_t allComponentSizes[NUM_COMPONENT_TYPES];
+};
+
+// A persistent selection of every archetype that has all the components in componentMask and none in rejectMask
+// The matching archetypes and their component offsets are worked out once and then only updated when new archetypes
+// are registered, so iterating over a query doesn't need to decode masks or allocate anything.
+// Queries are meant to be declared as globals: the constructor is constexpr so they're valid without static constructors running.
+class EntityQuery {
+public:
+    constexpr EntityQuery(archetype_t componentMask, archetype_t rejectMask) :
+        componentMask_(componentMask), rejectMask_(rejectMask), numArchetypesChecked_(0), registryResets_(0),
+        matches_(nullptr), numMatches_(0), capacity_(0) {}
+    EntityQuery(const EntityQuery&) = delete;
+    EntityQuery& operator=(const EntityQuery&) = delete;
+    ~EntityQuery();
+
+    // Brings the cached matches up to date with the archetype registry
+    void update();
+
+    archetype_t componentMask() const { return componentMask_; }
+    archetype_t rejectMask() const { return rejectMask_; }
+
+    const EntityQueryMatch *begin() const { return matches_; }
+    const EntityQueryMatch *end() const { return matches_ + numMatches_; }
+private:
+    void addMatch(MultiArrayList *arr);
+
+    archetype_t componentMask_;
+    archetype_t rejectMask_;
+    // Number of registered archetypes already checked against the masks
+    int numArchetypesChecked_;
+    // Value of the registry reset counter when the matches were built, used to detect deleteAllEntities clearing the registry
+    uint32_t registryResets_;
+    EntityQueryMatch *matches_;
+    uint16_t numMatches_;
+    uint16_t capacity_;
+};
 
 // Creates a single entity, try to avoid using as creating entities in batches is more efficient
 Entity *createEntity(archetype_t archetype);
 // Deletes a single entity
 void deleteEntity(Entity *e);
+// Deletes a number of entities at once, grouping them by archetype so each archetype's arrays are compacted in one pass
+// Duplicate entries are allowed and only deleted once
+void deleteEntities(Entity **entities, int count);
+// Adds the given components to an entity by moving its existing component data into the new archetype's arraylist
+// The entity keeps its pointer and handle, and the newly added components are zeroed
+// Entities get moved between arraylists, so don't call these while iterating over the archetypes involved
+void addComponents(Entity *e, archetype_t components);
+// Removes the given components from an entity the same way, the entity must keep at least one component
+void removeComponents(Entity *e, archetype_t components);
+// Batched forms of the above, entities that share an archetype are moved together
+void addComponents(Entity **entities, int count, archetype_t components);
+void removeComponents(Entity **entities, int count, archetype_t components);
+// Deactivates entities by giving them the Inactive tag, so that queries rejecting it (e.g. EntityQuery{Bit_Velocity, Bit_Inactive})
+// skip them as whole archetypes instead of checking a flag per entity. Only entities with the Deactivatable component are
+// affected, and ones with delete_on_deactivate set get deleted instead. Entities are moved the same way as with addComponents.
+void deactivateEntities(Entity **entities, int count);
+// Moves deactivated entities back into their active archetypes
+void activateEntities(Entity **entities, int count);
+void deactivateEntity(Entity *e);
+void activateEntity(Entity *e);
+// Moves every entity of the given archetype that has its deactivated flag set into its inactive archetype, for entities
+// that were created with the flag already set (e.g. from level data) instead of going through deactivateEntities
+void syncArchetypeActiveStates(archetype_t archetype);
 // Creates a number of entities
 void createEntities(archetype_t archetype, int count);
 // Creates a number of entities, and calls the provided callback for each block of allocated entities
 void createEntitiesCallback(archetype_t archetype, void *arg, int count, EntityArrayCallback callback);
+// Gets the number of elements in each of an archetype's blocks and the number of pool chunks a block is made of
+void getArchetypeBlockLayout(archetype_t archetype, size_t *elementCountOut, size_t *blockChunksOut);
+// Creates an entity for every element of the given blocks, which become the archetype's arraylist as they are
+// The blocks must match the archetype's block layout, be allocated with allocChunks and have every block but the last full
+// Returns false and leaves the blocks alone if the archetype already has entities
+bool adoptEntityBlocks(archetype_t archetype, MultiArrayListBlock **blocks, int numBlocks);
 
 // Calls the given callback for each array that fits the given archetype and does not fit the reject archetype
-void iterateOverEntities(EntityArrayCallback callback, void *arg, archetype_t componentMask, archetype_t rejectMask);
+// Every component passed to the callback counts as written and gets stamped with the current change version in each block,
+// except for the ones in readOnlyMask
+void iterateOverEntities(EntityArrayCallback callback, void *arg, archetype_t componentMask, archetype_t rejectMask, archetype_t readOnlyMask = 0);
 // Same as above, but this time an array of ALL components is passed (not just the masked ones), as well as an array of component sizes
-void iterateOverEntitiesAllComponents(EntityArrayCallbackAll callback, void *arg, archetype_t componentMask, archetype_t rejectMask);
+void iterateOverEntitiesAllComponents(EntityArrayCallbackAll callback, void *arg, archetype_t componentMask, archetype_t rejectMask, archetype_t readOnlyMask = 0);
+// Versions of the above that iterate over the archetypes cached by a query instead of checking every archetype
+void iterateOverEntities(EntityArrayCallback callback, void *arg, EntityQuery& query, archetype_t readOnlyMask = 0);
+void iterateOverEntitiesAllComponents(EntityArrayCallbackAll callback, void *arg, EntityQuery& query, archetype_t readOnlyMask = 0);
 // Used to delete an entity during entity iteration
 // Queued entities will all get deleted after the current iteration is over
 void queue_entity_deletion(Entity*);
 // Used to create entities during entity iteration
 // Queued entities will all get created after the current iteration is over
 void queue_entity_creation(archetype_t archetype, void* arg, int count, EntityArrayCallback callback);
+// Used to set one of an entity's components during entity iteration, the value is copied when this is called
+// Skipped if the entity has been deleted or lost the component by the time the queue is processed
+void queue_component_set(Entity *e, int componentType, const void *value);
+// Used to activate or deactivate an entity during entity iteration, if it's queued more than once the last one wins
+void queue_entity_activation(Entity *e, bool active);
+// Drops everything queued without carrying it out
+void clear_entity_queues();
+// Carries out everything queued since the last call, the iteration functions (including ecs::each) call this once they're done
+// and runSystems calls it once every system has run
+// Component sets are applied first, then every queued deletion at once, then every activation and deactivation at once,
+// then the queued creations in order.
+// Anything the creation callbacks queue is carried out before this returns.
+void process_entity_queues();
+// Calls func for every registered archetype that has all the components in componentMask and none in rejectMask,
+// passing it a temporary match describing the archetype's layout (only the fields covering all components are filled in)
+void forEachMatchingArchetype(archetype_t componentMask, archetype_t rejectMask, void (*func)(const EntityQueryMatch& match, void *arg), void *arg);
+// Same as the query version of iterateOverEntities, but skips blocks where none of the components in changedMask were written
+// after the given change version
+void iterateOverEntitiesChangedSince(EntityArrayCallback callback, void *arg, EntityQuery& query, archetype_t changedMask, uint32_t version, archetype_t readOnlyMask = 0);
+// Gets the current change version and advances it, so every write from then on is stamped with a newer version
+// A reader keeps the returned version and passes it as the version to check against the next time it runs,
+// which then matches exactly the blocks written in between
+uint32_t takeChangeVersion(void);
+// Stamps the given components in every block of the query with the current change version
+void markQueryChanged(EntityQuery& query, archetype_t components);
+// Stamps the given components of the block holding an entity with the current change version
+void markEntityChanged(Entity *e, archetype_t components);
+// Moves entities around within each archetype matched by the query so that entities with equal values of the given
+// component end up next to each other, e.g. grouping by Model lets consecutive draws share material state.
+// Only does roughly budget comparisons per call, picking up where it left off the next time, so it's meant to be called
+// once per frame. Once an archetype is fully grouped it's skipped until the component is written in one of its blocks.
+// Every block an entity gets moved in counts as having all of its components written.
+void groupEntities(EntityQuery& query, int componentType, int budget);
 // Registers a new archetype
 void registerArchetype(archetype_t archetype);
 // Outputs the component pointers for the given entity into the provided pointer array
-void getEntityComponents(Entity *entity, void **componentArrayOut);
+// Every component except the ones in readOnlyMask counts as written, the same way as with iterateOverEntities. Writes made
+// through the pointers after something else has read the components (e.g. in a later frame) have to be stamped with markEntityChanged.
+void getEntityComponents(Entity *entity, void **componentArrayOut, archetype_t readOnlyMask = 0);
 
 // Finds the entity that has the given archetype and the given archetype array index
 Entity *findEntity(archetype_t archetype, size_t archetypeArrayIndex);
 // Deletes all entities (duh)
 void deleteAllEntities(void);
+// Gets the number of times the whole world has been replaced by deleteAllEntities or ecs::restore, so that anything
+// keeping track of entities on its own (e.g. SpatialIndex) can tell when to start over
+uint32_t getWorldResets(void);
 // Iterates over every behavior entity and processes their behavior
+// Entities are dispatched in runs of consecutive entities with the same callback, which go through the callback's
+// batch function if it has one and through the callback once per entity if it doesn't
+// Every component but Model counts as written, so that grouping by Model can settle. Behaviors that swap their entity's
+// model have to stamp it with markEntityChanged.
 void iterateBehaviorEntities(void);
+// Registers a batch function that processes whole runs of entities whose behavior uses the given callback
+// The per-entity callback is still what identifies the behavior, so it's what gets stored in BehaviorState
+// Returns false if there's no room for another batch function
+bool registerBatchBehavior(EntityBehaviorCallback callback, EntityBehaviorBatchCallback batch);
+// Unregisters every batch function, so every behavior goes back to its per-entity callback
+void clearBatchBehaviors(void);
 // Iterates over every entity with a destroy timer, ticks it, and deletes the entity if the timer reached zero
+// Timers are counted down in their components rather than kept in a timing wheel, so the component always holds the
+// ticks left and any write to it (even of the value it already had) restarts the timer
 void tickDestroyTimers(void);
 
 extern const size_t g_componentSizes[];
 
+// Memory used by a single archetype's component storage
+struct ArchetypeMemoryInfo {
+    archetype_t archetype;
+    uint32_t numEntities;
+    // Number of entities each block holds
+    uint16_t elementCount;
+    // Size of each block in bytes
+    uint16_t blockSize;
+    // Number of blocks allocated, including a spare block if there is one
+    uint16_t numBlocks;
+    uint32_t bytesAllocated;
+    // Bytes at the end of every block that can't hold another entity, including those lost to rounding the entity count down
+    uint32_t bytesPadding;
+    // Bytes in allocated slots that don't have an entity in them
+    uint32_t bytesUnused;
+};
+
+// Fills in the memory info of up to maxCount registered archetypes, returns the number filled in
+int getArchetypeMemoryInfo(ArchetypeMemoryInfo *infoOut, int maxCount);
+// Prints the memory used and wasted by every registered archetype
+void printArchetypeMemoryReport(void);
+
+namespace ecs {
+
+// Occupancy of a single archetype's storage, see stats
+struct ArchetypeStats {
+    archetype_t archetype;
+    uint32_t numEntities;
+    // Number of blocks allocated, including a spare block if there is one
+    uint16_t numBlocks;
+    // Number of entities each block holds
+    uint16_t elementCount;
+    // Bytes each entity takes up in a block, including its entity pointer
+    uint16_t bytesPerRow;
+    // Fraction of the allocated slots that hold an entity
+    float fillRatio;
+    // Bytes of the archetype's blocks that don't hold an entity, including the padding at the end of every block
+    uint32_t bytesWasted;
+};
+
+// Totals for the whole ECS, see stats
+struct Stats {
+    int numArchetypes;
+    // Number of archetypes that have at least one entity
+    int numOccupiedArchetypes;
+    uint32_t numEntities;
+    // Totals of the archetype stats
+    uint32_t numBlocks;
+    uint32_t bytesAllocated;
+    uint32_t bytesWasted;
+    // Slots in the entity table up to the last entity, and how many of them are gaps left by deleted entities
+    uint32_t entitySlots;
+    uint32_t entityGaps;
+    // Bytes allocated for the entity table
+    uint32_t entityTableBytes;
+    // Number of entities queued for creation and deletion, and of every other queued command
+    uint32_t queuedCreations;
+    uint32_t queuedDeletions;
+    uint32_t queuedOther;
+    // Bytes of queued commands, and bytes allocated for the command buffer
+    uint32_t commandBytes;
+    uint32_t commandBufferBytes;
+};
+
+// Gathers the ECS's current memory use and occupancy, for the profiler overlay and for dumping from host runs
+// The stats of up to maxArchetypes registered archetypes are written to archetypesOut in registration order, the totals
+// always cover every archetype. It walks every archetype and the command buffer, so it's meant for debug displays.
+Stats stats(ArchetypeStats *archetypesOut = nullptr, int maxArchetypes = 0);
+
+} // namespace ecs
+
+// The type stored for each component, looked up by its index
+template <int ComponentIndex>
+struct component_traits;
+
+#define COMPONENT(Name, Type) template <> struct component_traits<Component_##Name> { using type = Type; };
+#include "components.inc.h"
+#undef COMPONENT
+
+// Typed iteration API
+// Each component gets a tag type (e.g. ecs::Position) that knows its bit and storage type, which lets systems
+// name the components they want as template arguments and get typed data instead of decoding a void** array:
+//   ecs::each<ecs::Position, const ecs::Velocity>(velocityQuery, [](Vec3& pos, const Vec3& vel) { ... });
+// The body is a template argument rather than a function pointer, so it gets inlined into the per-block loop.
+// Entities can be queued for creation and deletion from the body the same way as with the callback API.
+namespace ecs {
+
+#define COMPONENT(Name, Type) \
+    struct Name { \
+        using type = component_traits<Component_##Name>::type; \
+        static constexpr archetype_t bit = Bit_##Name; \
+    };
+#include "components.inc.h"
+#undef COMPONENT
+
+template <typename... Cs>
+constexpr archetype_t mask_of = (Cs::bit | ... | 0);
+
+// Components named with a const tag (e.g. const ecs::Velocity) are only read, every other component named is
+// treated as written and gets its blocks stamped with the current change version
+template <typename... Cs>
+constexpr archetype_t written_mask_of = ((std::is_const_v<Cs> ? 0 : Cs::bit) | ... | 0);
+
+// The type of a component as seen by the body, const for read-only components
+template <typename C>
+using component_t = std::conditional_t<std::is_const_v<C>, const typename C::type, typename C::type>;
+
+// Restricts iteration to blocks where any of the given components were written after the given change version
+// An empty component mask matches every block
+struct ChangeFilter {
+    archetype_t components;
+    uint32_t since;
+};
+
+// Gets the array of the given component in a block of the given archetype
+template <typename C>
+FORCEINLINE component_t<C>* block_array(const EntityQueryMatch& match, MultiArrayListBlock *block)
+{
+    size_t offset = match.allComponentOffsets[std::popcount(match.archetype & (C::bit - 1))];
+    return reinterpret_cast<component_t<C>*>(reinterpret_cast<uintptr_t>(block) + offset);
+}
+
+// Calls body with a span for each of the given components, once for every block in the matched archetype that passes the filter
+template <typename... Cs, typename Func>
+FORCEINLINE void each_span_in_match(const EntityQueryMatch& match, const ChangeFilter& filter, Func& body)
+{
+    for (MultiArrayListBlock *block = match.arr->start; block != nullptr; block = block->next)
+    {
+        if (filter.components != 0 && !multiarraylist_changed_since(block, filter.components, filter.since))
+        {
+            continue;
+        }
+        multiarraylist_mark_changed(block, written_mask_of<Cs...>);
+        body(std::span<component_t<Cs>>(block_array<Cs>(match, block), block->numElements)...);
+    }
+}
+
+// Calls body with a span for each of the given components, once for every block of every archetype in the query
+// that passes the filter. The query must include all of the given components
+template <typename... Cs, typename Func>
+void each_span(EntityQuery& query, const ChangeFilter& filter, Func&& body)
+{
+    static_assert(sizeof...(Cs) > 0, "At least one component must be iterated over");
+    query.update();
+    for (const EntityQueryMatch& match : query)
+    {
+        each_span_in_match<Cs...>(match, filter, body);
+    }
+    process_entity_queues();
+}
+
+// Same as above without filtering out unchanged blocks
+template <typename... Cs, typename Func>
+void each_span(EntityQuery& query, Func&& body)
+{
+    each_span<Cs...>(query, ChangeFilter{0, 0}, body);
+}
+
+// Same as above, but checks every registered archetype against the given components and reject mask instead of using a cached query
+template <typename... Cs, typename Func>
+void each_span(archetype_t rejectMask, Func&& body)
+{
+    static_assert(sizeof...(Cs) > 0, "At least one component must be iterated over");
+    using FuncType = std::remove_reference_t<Func>;
+    forEachMatchingArchetype(mask_of<Cs...>, rejectMask,
+        [](const EntityQueryMatch& match, void *arg)
+        {
+            each_span_in_match<Cs...>(match, ChangeFilter{0, 0}, *static_cast<FuncType*>(arg));
+        }, &body);
+    process_entity_queues();
+}
+
+// Every span passed for a block has the same length, so any of them gives the entity count
+template <typename First, typename... Rest>
+FORCEINLINE size_t first_span_size(const First& first, const Rest&...)
+{
+    return first.size();
+}
+
+// Calls body with a reference to each of the given components of every entity in the query's blocks that pass the filter
+template <typename... Cs, typename Func>
+void each(EntityQuery& query, const ChangeFilter& filter, Func&& body)
+{
+    each_span<Cs...>(query, filter, [&body](std::span<component_t<Cs>>... spans)
+        {
+            size_t count = first_span_size(spans...);
+            for (size_t i = 0; i < count; i++)
+            {
+                body(spans[i]...);
+            }
+        });
+}
+
+// Calls body with a reference to each of the given components of every entity in the query
+template <typename... Cs, typename Func>
+void each(EntityQuery& query, Func&& body)
+{
+    each<Cs...>(query, ChangeFilter{0, 0}, body);
+}
+
+// Calls body with a reference to each of the given components of every entity that has them and none of the components in rejectMask
+template <typename... Cs, typename Func>
+void each(archetype_t rejectMask, Func&& body)
+{
+    each_span<Cs...>(rejectMask, [&body](std::span<component_t<Cs>>... spans)
+        {
+            size_t count = first_span_size(spans...);
+            for (size_t i = 0; i < count; i++)
+            {
+                body(spans[i]...);
+            }
+        });
+}
+
+// Every component in a prefab's row starts on an 8 byte boundary so that references into it are aligned
+constexpr size_t prefab_component_alignment = 8;
+
+// Room for one of every component type, each rounded up to the alignment
+// Not every component type is complete in this header, so ecs.cpp checks that this is big enough
+constexpr size_t prefab_max_row_size = 160;
+
+// A pre-initialized set of component values for an archetype, which spawnPrefab copies into every entity it creates
+// The constructor is constexpr and zeroes every value, so prefabs can be declared as globals and filled in at load time:
+//   ecs::Prefab bulletPrefab{Bit_Position | Bit_Velocity | Bit_Model | Bit_DestroyTimer};
+//   bulletPrefab.get<ecs::DestroyTimer>() = 90;
+class Prefab {
+public:
+    constexpr Prefab(archetype_t archetype) : archetype_(archetype), row_{} {}
+
+    archetype_t archetype() const { return archetype_; }
+
+    // Gets the default value of a component, which must be in the prefab's archetype
+    template <typename C>
+    typename C::type& get()
+    {
+        return *reinterpret_cast<typename C::type*>(&row_[rowOffsetByPosition(std::popcount(archetype_ & (C::bit - 1)))]);
+    }
+
+    // Gets the default value of the component at the given position in the archetype (in component order)
+    const uint8_t *componentData(int archetypeComponentIndex) const
+    {
+        return &row_[rowOffsetByPosition(archetypeComponentIndex)];
+    }
+private:
+    // Gets the offset in the row of the component at the given position in the archetype
+    size_t rowOffsetByPosition(int archetypeComponentIndex) const
+    {
+        size_t offset = 0;
+        archetype_t componentBits = archetype_;
+        while (archetypeComponentIndex > 0)
+        {
+            offset += ROUND_UP(g_componentSizes[std::countr_zero(componentBits)], prefab_component_alignment);
+            componentBits &= componentBits - 1;
+            archetypeComponentIndex--;
+        }
+        return offset;
+    }
+
+    archetype_t archetype_;
+    alignas(prefab_component_alignment) uint8_t row_[prefab_max_row_size];
+};
+
+} // namespace ecs
+
+// Creates a number of entities of the prefab's archetype with every component set to the prefab's values
+// The callback is then called for each block of new entities (the same way as createEntitiesCallback) to apply any per-instance values
+void spawnPrefab(const ecs::Prefab& prefab, int count, void *arg, EntityArrayCallback callback);
+// Used to spawn entities from a prefab during entity iteration, the prefab must stay alive until the queue is processed
+void queue_prefab_spawn(const ecs::Prefab& prefab, int count, void *arg, EntityArrayCallback callback);
+
+namespace ecs {
+
+// Groups the entities matched by a query by the value of a component, see groupEntities
+template <typename C>
+void group_by(EntityQuery& query, int budget)
+{
+    groupEntities(query, std::countr_zero(C::bit), budget);
+}
+
+// Turns a captureless lambda taking a span of behavior states and a span for each of the given components into a
+// batch behavior function, e.g.
+//   registerBatchBehavior(spinBehavior, ecs::batch_behavior<ecs::Rotation>(
+//       [](std::span<BehaviorState> behaviors, std::span<Vec3s> rotations) { ... }));
+// Every entity using the behavior must have all of the given components
+template <typename... Cs, typename Func>
+EntityBehaviorBatchCallback batch_behavior(Func)
+{
+    static_assert(std::is_empty_v<Func> && std::is_default_constructible_v<Func>, "Batch behaviors can't capture anything");
+    return [](size_t count, void **componentArrays, archetype_t archetype, BehaviorState *behaviors)
+    {
+        Func body{};
+        body(std::span<BehaviorState>(behaviors, count),
+            std::span<component_t<Cs>>(static_cast<component_t<Cs>*>(componentArrays[1 + std::popcount(archetype & (Cs::bit - 1))]), count)...);
+    };
+}
+
+// Queues setting one of an entity's components during iteration, see queue_component_set
+template <typename C>
+void queue_set(Entity *e, const typename C::type& value)
+{
+    queue_component_set(e, std::countr_zero(C::bit), &value);
+}
+
+// Creates a number of entities from a prefab
+inline void spawn(const Prefab& prefab, int count)
+{
+    spawnPrefab(prefab, count, nullptr, nullptr);
+}
+
+// Creates a number of entities from a prefab, then calls body with the index of every new entity (counting from 0)
+// and a reference to each of the given components so it can override the prefab's values
+template <typename... Cs, typename Func>
+void spawn(const Prefab& prefab, int count, Func&& body)
+{
+    using FuncType = std::remove_reference_t<Func>;
+    struct SpawnState {
+        FuncType *body;
+        archetype_t archetype;
+        size_t instance;
+    };
+    SpawnState state{&body, prefab.archetype(), 0};
+
+    spawnPrefab(prefab, count, &state,
+        [](size_t blockCount, void *arg, void **componentArrays)
+        {
+            SpawnState *state = static_cast<SpawnState*>(arg);
+            [blockCount, state](component_t<Cs>*... arrays)
+            {
+                for (size_t i = 0; i < blockCount; i++)
+                {
+                    (*state->body)(state->instance++, arrays[i]...);
+                }
+            }(static_cast<component_t<Cs>*>(componentArrays[1 + std::popcount(state->archetype & (Cs::bit - 1))])...);
+        });
+}
+
+// Copy of the whole ECS world (the entity table, the archetype registry and every archetype's blocks) taken by ecs::snapshot
+// Every entity table chunk and block is stored whole in one buffer along with a hash of its contents, so taking another
+// snapshot into the same object only copies the ones that changed since the previous one. Restoring works the same way
+// in reverse, only blocks that differ from the snapshot are copied back.
+// Behavior callbacks and Model pointers are stored as is, so a snapshot is only valid while the code and models it refers
+// to stay loaded (i.e. it's meant for rollback and instant retry, not for saving to disk)
+class Snapshot {
+public:
+    constexpr Snapshot() = default;
+    ~Snapshot() { clear(); }
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    // Checks if a snapshot has been taken into this object
+    bool valid() const { return buffer_ != nullptr; }
+    // Size in bytes of the snapshot's contents
+    size_t size() const { return size_; }
+    // Number of bytes the last ecs::snapshot call actually copied, the rest were unchanged
+    size_t bytesCopied() const { return bytesCopied_; }
+    // Frees the snapshot's memory
+    void clear();
+private:
+    friend void snapshot(Snapshot& out);
+    friend void restore(const Snapshot& in);
+    struct Unit;
+
+    uint8_t *buffer_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    size_t bytesCopied_ = 0;
+    // Table of the chunks and blocks in the buffer, with the offset, size and hash of each
+    Unit *units_ = nullptr;
+    size_t numUnits_ = 0;
+    size_t unitCapacity_ = 0;
+    // Change version taken right after the snapshot was stored, blocks not written since then still match it
+    uint32_t version_ = 0;
+};
+
+// Copies the current state of the world into the given snapshot, reusing whatever it already holds
+// Must not be called while iterating over entities, and entities queued for creation or deletion aren't included
+void snapshot(Snapshot& out);
+// Puts the world back into the state of the given snapshot
+// Entity handles that were valid when the snapshot was taken are valid again afterwards, and so are entity pointers as long
+// as deleteAllEntities hasn't been called in between (which frees the entity table they point into). Anything queued
+// for creation or deletion is dropped. Every restored block counts as having all of its components written.
+// Grouping progress is reset and the world reset count goes up, so spatial indices rebuild on their next update.
+void restore(const Snapshot& in);
+
+} // namespace ecs
+
 #endif
@@ -7,6 +7,7 @@
 constexpr int health_per_pixel = 4;
 constexpr int health_bar_height = 4;
 
+// The returned entity is only guaranteed to exist until the next entity deletion, use getEntityHandle to hold onto it longer
 Entity *findClosestEntity(Vec3 pos, archetype_t archetype, float maxDist, float *foundDist, Vec3 foundPos);
 
 #endif
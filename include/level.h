@@ -16,4 +16,48 @@ typedef struct LevelHeader_t {
 
 void processLevelHeader(LevelHeader *header);
 
+// Prebaked level entities, made from a LevelHeader by tools/levelbake
+// The component data is already laid out as the archetypes' arraylist blocks, so loading a level DMAs each block
+// straight into its own pool allocation and hands it to the ECS, which only has to fill in the entity pointers.
+// The file starts with a LevelBlocksHeader followed by one LevelBlocksArchetype per archetype, padded out to a
+// multiple of mem_block_size. After that comes the block data, each block taking up blockChunks pool chunks.
+
+// "LVBK"
+constexpr uint32_t level_blocks_magic = 0x4C56424B;
+// Number of component sizes recorded in the header, one for each bit of an archetype
+constexpr size_t level_blocks_max_components = 32;
+
+typedef struct LevelBlocksArchetype_t {
+    archetype_t archetype;
+    // Number of entities of this archetype
+    uint32_t entityCount;
+    // Offset from the start of the file to this archetype's first block, a multiple of mem_block_size
+    uint32_t dataOffset;
+    // Number of elements in every block but the last, which holds the remainder
+    uint16_t elementCount;
+    // Number of pool chunks that make up each block
+    uint8_t blockChunks;
+    uint8_t pad;
+} LevelBlocksArchetype;
+
+typedef struct LevelBlocksHeader_t {
+    uint32_t magic;
+    // Number of archetypes in the level (length of the LevelBlocksArchetype array that follows this header)
+    uint32_t archetypeCount;
+    // Size of this header and the archetype array including padding, which is where the block data starts
+    uint32_t headerSize;
+    // Layout the blocks were baked for, the level can only be loaded by an engine build where these all match
+    uint16_t blockHeaderSize;
+    uint8_t entityPointerSize;
+    uint8_t componentCount;
+    uint16_t componentSizes[level_blocks_max_components];
+} LevelBlocksHeader;
+
+// Loads the prebaked level entities at the given ROM address
+// Archetypes that already have entities, or whose blocks the engine lays out differently, get their entities copied
+// in from the baked blocks instead
+// Entities baked with their deactivated flag set are moved into their inactive archetypes afterwards
+// Returns false without creating any entities if the file wasn't baked for this build's component sizes
+bool loadLevelBlocks(uint32_t romPos);
+
 #endif
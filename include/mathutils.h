@@ -63,7 +63,9 @@ constexpr uint16_t degrees_to_angle(float degrees)
     return (uint16_t)((degrees / 360.0f) * 0x10000L);
 }
 
+#ifndef M_PIf
 #define M_PIf (3.14159265358979323846f)
+#endif
 #define M_PIf_2 (1.57079632679489661923f)
 
 #define M_PI_4_P_0273	(1.05839816339744830962f) //M_PI/4 + 0.273
@@ -19,13 +19,14 @@ typedef uint8_t owner_t;
 #define ALLOC_ECS        3
 #define ALLOC_FILE       4
 
+#define ALLOC_SLAB       251 // Slab page holding small allocations (see allocSmall)
 #define ALLOC_MALLOC     252 // Memory allocated by malloc
 #define ALLOC_NEW        253 // Memory allocated by new
 #define ALLOC_NEW_ARR    254 // Memory allocated by new[]
 #define ALLOC_CONTIGUOUS 255 // Allocation from previous chunk
 
 constexpr size_t mem_block_size = 1024;
-constexpr size_t mem_small_block_size = 256; // TODO: implement small chunks in memory pool
+constexpr size_t mem_small_block_size = 256; // Largest allocation that allocSmall serves from a slab page
 #define SEGMENT_COUNT 32
 #define ROUND_UP(val, multiple) (((val) + (multiple) - 1) & ~((multiple) - 1))
 #define ROUND_DOWN(val, multiple) (((val) / (multiple)) * (multiple))
@@ -46,6 +47,9 @@ void initMemAllocator(void *start, void *end);
 void *allocChunks(int numChunks, owner_t owner);
 // Allocates a contiguous region of memory at least as large as the given length
 void *allocRegion(int length, owner_t owner);
+// Allocates at most mem_small_block_size bytes from a slab page shared with other allocations of a similar size
+// The result is aligned to 16 bytes and can be freed with freeAlloc like any other allocation
+void *allocSmall(size_t length);
 // Free a region of allocated memory
 void freeAlloc(void *start) noexcept;
 
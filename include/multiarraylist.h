@@ -2,20 +2,60 @@
 #define __MULTIARRAYLIST_H__
 
 #include <types.h>
+#include <mem.h>
+
+// Number of component types, counted here since ecs.h (which has the component enum) depends on this header
+#define COMPONENT(Name, Type) + 1
+constexpr size_t multiarraylist_num_component_types = 0
+#include "components.inc.h"
+;
+#undef COMPONENT
 
 typedef struct MultiArrayListBlock_t {
     MultiArrayListBlock *next;
     uint32_t numElements;
+    // Low 16 bits of the change version each component (by component type) in this block was last written at
+    // Stamps are kept from falling too far behind the current version (see multiarraylist_rebase_versions), so comparing them can't wrap around
+    uint16_t componentVersions[multiarraylist_num_component_types];
 } MultiArrayListBlock;
 
+// Current change version, which every write to a block's components is stamped with
+extern uint32_t g_changeVersion;
+
+// Versions older than this can't be compared against the 16 bit stamps, so checking one counts every component as changed
+constexpr uint32_t multiarraylist_max_version_age = 0x4000;
+// Number of versions between pulling the stamps that have fallen behind forward, the stamps never get more than the age
+// limit plus this behind, which has to stay under half the 16 bit range
+constexpr uint32_t multiarraylist_version_rebase_interval = 0x4000;
+
+// Number of elements a block should be able to hold, blocks are made of multiple contiguous pool chunks until they do
+constexpr size_t multiarraylist_target_element_count = 32;
+// Upper limit on the number of pool chunks in one block, larger blocks are harder to find room for in the pool
+constexpr size_t multiarraylist_max_block_chunks = 4;
+
+// Number of block pointers stored directly in the list before the block table has to be allocated separately
+constexpr size_t multiarraylist_inline_blocks = 4;
+
 // Dynamically allocated structure consisting of chunks, each which hold an equal length array of each component
 // in the provided archetype.
+// The blocks are chained through their next pointers for iteration, and also kept in order in a block table so the
+// block holding any index (and the one before the end) can be found without walking the chain.
+// The block table starts out pointing at inlineBlocks, so a list must not be moved after it's initialized.
 typedef struct MultiArrayList_t {
     MultiArrayListBlock *start;
     MultiArrayListBlock *end;
+    MultiArrayListBlock **blocks;
+    // Last block emptied by a deletion, kept around so that a list hovering at a block boundary doesn't
+    // free and reallocate a block every time it crosses it
+    MultiArrayListBlock *spare;
     archetype_t archetype;
     uint16_t totalElementSize;
     uint16_t elementCount;
+    uint16_t numBlocks;
+    uint16_t blockCapacity;
+    // Number of pool chunks (of mem_block_size each) that make up every block in this list
+    uint8_t blockChunks;
+    MultiArrayListBlock *inlineBlocks[multiarraylist_inline_blocks];
 } MultiArrayList;
 
 int lowest_bit(size_t value);
@@ -23,6 +63,9 @@ int lowest_bit(size_t value);
 // Initializes a new multiarraylist
 void multiarraylist_init(MultiArrayList *arr, archetype_t archetype);
 
+// Frees every block owned by the arraylist, along with its block table
+void multiarraylist_free(MultiArrayList *arr);
+
 // Allocates count more members in the arraylist
 void multiarraylist_alloccount(MultiArrayList *arr, size_t count);
 
@@ -33,8 +76,82 @@ size_t multiarraylist_get_component_offset(MultiArrayList *arr, size_t component
 // Returns the new length of the array list
 void multiarraylist_delete(MultiArrayList *arr, size_t arrayIndex);
 
+// Removes every element at the given indices, which must be unique and sorted in ascending order
+// Surviving elements past the new end are moved into the holes starting from the tail, one component array at a time
+void multiarraylist_delete_sorted(MultiArrayList *arr, const uint32_t *indices, size_t count);
+
+// Copies the elements at the given sorted indices of src into consecutive elements of dst starting at dstStart, which must already be allocated
+// Components that dst has and src doesn't are zeroed, and components that only src has are skipped
+// Runs of consecutive source indices are copied with a single memcpy per component array
+void multiarraylist_copy_elements(MultiArrayList *dst, size_t dstStart, MultiArrayList *src, const uint32_t *srcIndices, size_t count);
+
+// Swaps the elements at the two given indices, repointing both entities at their new indices
+void multiarraylist_swap(MultiArrayList *arr, size_t indexA, size_t indexB);
+
+// Adds empty blocks to or removes blocks from the end of the arraylist until it has the given number, always keeping at least one
+void multiarraylist_set_block_count(MultiArrayList *arr, size_t numBlocks);
+
+// Replaces the blocks of an empty arraylist with the given ones, which must already be laid out for the list's archetype
+// Every block but the last has to be full, and the entity pointers are left for the caller to fill in
+void multiarraylist_adopt_blocks(MultiArrayList *arr, MultiArrayListBlock **blocks, size_t count);
+
 // Gets the array of Entity pointers for this block
 Entity** multiarraylist_get_block_entity_pointers(MultiArrayListBlock *block);
 
+// Moves every stamp in the arraylist that's more than multiarraylist_max_version_age versions old up to that age
+// Any version a reader could still compare against is newer than that, so nothing starts looking changed
+void multiarraylist_rebase_versions(MultiArrayList *arr);
+
+// Stamps the given components of a block with the current change version
+inline void multiarraylist_mark_changed(MultiArrayListBlock *block, archetype_t components)
+{
+    while (components != 0)
+    {
+        int componentType = lowest_bit(components);
+        block->componentVersions[componentType] = static_cast<uint16_t>(g_changeVersion);
+        components &= components - 1;
+    }
+}
+
+// Checks if any of the given components of a block were written after the given change version
+inline bool multiarraylist_changed_since(const MultiArrayListBlock *block, archetype_t components, uint32_t version)
+{
+    if (g_changeVersion - version >= multiarraylist_max_version_age)
+    {
+        return components != 0;
+    }
+    while (components != 0)
+    {
+        int componentType = lowest_bit(components);
+        // The stamp and the version are both less than half the 16 bit range behind the current version, so their difference can't wrap
+        if (static_cast<int16_t>(block->componentVersions[componentType] - static_cast<uint16_t>(version)) > 0)
+        {
+            return true;
+        }
+        components &= components - 1;
+    }
+    return false;
+}
+
+// Gets the size in bytes of each of the arraylist's blocks
+inline size_t multiarraylist_block_size(const MultiArrayList *arr)
+{
+    return arr->blockChunks * mem_block_size;
+}
+
+// Gets the number of elements in the arraylist, every block but the last is full
+inline size_t multiarraylist_length(const MultiArrayList *arr)
+{
+    return (arr->numBlocks - 1) * arr->elementCount + arr->end->numElements;
+}
+
+// Gets the block holding the element at the given index and outputs the element's index within that block
+inline MultiArrayListBlock *multiarraylist_get_block(MultiArrayList *arr, size_t arrayIndex, size_t *blockArrayIndexOut)
+{
+    size_t blockIndex = arrayIndex / arr->elementCount;
+    *blockArrayIndexOut = arrayIndex - blockIndex * arr->elementCount;
+    return arr->blocks[blockIndex];
+}
+
 
 #endif
@@ -15,5 +15,7 @@ typedef struct GravityParams_t {
 } GravityParams;
 
 void physicsTick();
+// Registers the gravity and velocity systems, the scheduled equivalent of physicsTick
+void registerPhysicsSystems();
 
 #endif
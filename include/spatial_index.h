@@ -0,0 +1,118 @@
+#ifndef __SPATIAL_INDEX_H__
+#define __SPATIAL_INDEX_H__
+
+#include <ecs.h>
+
+// Number of buckets in a spatial index's hash table, must be a power of two
+constexpr size_t spatial_index_buckets = 1024;
+// Number of rings of cells around the query point a nearest entity search checks before giving up on the grid
+// and checking every entity in the index instead
+constexpr int spatial_index_max_rings = 8;
+
+// Spatial hash of the positions of every entity matched by a query, for finding entities near a point without
+// checking all of them. Space is split into square cells along X and Z (Y is ignored for picking cells but still
+// counts for distances), and each cell's entities are kept in a list in the bucket the cell hashes to.
+// The index only changes when update is called, which picks up every entity in a block whose Position was written
+// since the last update. Searches use the positions from that update and skip entities that have been deleted since.
+// Every way of writing a component stamps its block (see iterateOverEntities and getEntityComponents), but pointers
+// kept around and written to later aren't seen, so writes through them have to be stamped with markEntityChanged.
+// Memory is only used for the entities in the index, not for every entity slot.
+// The constructor is constexpr so indices can be declared as globals:
+//   SpatialIndex enemyIndex{Bit_Position | Bit_Behavior, 0, 256.0f};
+class SpatialIndex {
+public:
+    constexpr SpatialIndex(archetype_t componentMask, archetype_t rejectMask, float cellSize) :
+        query_(componentMask | Bit_Position, rejectMask), cellSize_(cellSize), invCellSize_(1.0f / cellSize),
+        version_(0), worldResets_(0), numEntries_(0), nodes_(nullptr), numNodes_(0), nodeCapacity_(0), firstFreeNode_(0),
+        lookup_(nullptr), lookupBits_(0), buckets_{} {}
+    SpatialIndex(const SpatialIndex&) = delete;
+    SpatialIndex& operator=(const SpatialIndex&) = delete;
+    ~SpatialIndex();
+
+    // Moves every entity whose Position was written since the last update into its current cell
+    // If deleteAllEntities or ecs::restore has been called since, the index is cleared and rebuilt instead
+    void update();
+    // Removes every entity from the index and frees its memory, the next update adds them all back
+    void clear();
+
+    // Finds the entity closest to the given position that's within maxDist of it, or returns nullptr if there is none
+    // Outputs the distance to the entity and its position the same way findClosestEntity does
+    Entity *findNearest(const Vec3 pos, float maxDist, float *foundDist, Vec3 foundPos);
+    // Outputs up to maxCount entities within the given radius of the given position, returns the number found
+    int findInRadius(const Vec3 pos, float radius, Entity **entitiesOut, int maxCount);
+    // Outputs up to maxCount entities inside the given box, returns the number found
+    int findInBox(const Vec3 boxMin, const Vec3 boxMax, Entity **entitiesOut, int maxCount);
+
+    // Number of entities in the index, including any that have been deleted since the last update
+    size_t size() const { return numEntries_; }
+private:
+    // An entity in the index
+    // Nodes are packed at the start of the node array, with the ones removed from the index kept in a free list for reuse
+    struct Node {
+        // Position of the entity at the last update
+        Vec3 pos;
+        // Handle of the entity, or the null handle if the node isn't in use
+        EntityHandle entity;
+        // Node indices plus one of the next and previous nodes in the same bucket, zero marks the end of the list
+        // Free nodes use next for the free list instead
+        uint32_t next;
+        uint32_t prev;
+        // Cell the entity is in
+        int16_t cellX;
+        int16_t cellZ;
+    };
+
+    static size_t bucketIndex(int cellX, int cellZ)
+    {
+        return (static_cast<uint32_t>(cellX) * 73856093u ^ static_cast<uint32_t>(cellZ) * 19349663u) & (spatial_index_buckets - 1);
+    }
+    int cellCoord(float coord) const;
+
+    // Adds a node to the list of the bucket its cell hashes to, or takes it out of that list
+    void link(uint32_t nodeIndex, int cellX, int cellZ);
+    void unlink(uint32_t nodeIndex);
+    // Takes the entity in a node out of the index and frees the node
+    void remove(uint32_t nodeIndex);
+    // Gets the entity in the given node, or removes it and returns nullptr if the entity is no longer in the query
+    Entity *resolve(uint32_t nodeIndex);
+    // Makes room for the given number of nodes in the node array and the lookup table
+    void reserveNodes(size_t count);
+    // Finds the lookup table entry for the given entity slot index, or the empty entry where it would be added
+    uint32_t *findLookup(uint32_t slot);
+    void removeLookup(uint32_t slot);
+    size_t lookupHome(uint32_t slot) const
+    {
+        // Entities in a block tend to have nearby slots, so using the slot as is keeps updates walking the table in order
+        return slot & ((static_cast<size_t>(1) << lookupBits_) - 1);
+    }
+
+    // Calls func(nodeIndex, node) for every node in the cells overlapping the given X and Z range
+    // The nodes may hold entities that have been deleted since, so func has to resolve any it wants to keep
+    template <typename Func>
+    void forEachInCells(float minX, float minZ, float maxX, float maxZ, Func&& func);
+    template <typename Func>
+    void forEachInCell(int cellX, int cellZ, Func&& func);
+
+    EntityQuery query_;
+    float cellSize_;
+    float invCellSize_;
+    // Change version taken by the last update
+    uint32_t version_;
+    // Value of getWorldResets at the last update, the index starts over if the world has been replaced since
+    uint32_t worldResets_;
+    size_t numEntries_;
+    Node *nodes_;
+    // Number of nodes that have been used, including free ones
+    size_t numNodes_;
+    size_t nodeCapacity_;
+    // Node index plus one of the first free node, zero if there are none
+    uint32_t firstFreeNode_;
+    // Open addressing hash table from entity slot indices to node indices plus one, zero for an empty entry
+    // It has 2^lookupBits_ entries and is kept at most half full
+    uint32_t *lookup_;
+    int lookupBits_;
+    // Slot index plus one of the first node in each bucket, zero for an empty bucket
+    uint32_t buckets_[spatial_index_buckets];
+};
+
+#endif
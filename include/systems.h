@@ -0,0 +1,66 @@
+#ifndef __SYSTEMS_H__
+#define __SYSTEMS_H__
+
+#include <ecs.h>
+
+// Maximum number of systems that can be registered at once
+#define MAX_SYSTEMS 32
+// Maximum number of threads runSystems can spread blocks over, including the calling thread
+#define MAX_SYSTEM_THREADS 16
+
+// Called for a single block of entities matched by a system's query
+typedef void (*SystemBlockCallback)(const EntityQueryMatch& match, MultiArrayListBlock *block, void *arg);
+
+// Flags for registerSystem
+// The system's blocks all run on the calling thread, for callbacks that touch entities outside of the block they're given
+#define SYSTEM_SERIAL (1 << 0)
+
+// Registers a system that runs the callback over every block of entities matching the query each time runSystems is called
+// reads and writes are the components the callback reads from and writes to. Two systems conflict if either one writes a
+// component the other touches and their queries can match the same archetype. Systems that don't conflict may run at the
+// same time, and systems that do always run in the order they were registered.
+// Structural changes must go through queue_entity_deletion and queue_entity_creation as with the other iteration functions,
+// they get processed once every system has run.
+// Every block a system runs over gets its written components stamped with the current change version.
+// Returns the index of the system, or -1 if there's no room for it
+int registerSystem(EntityQuery& query, archetype_t reads, archetype_t writes, SystemBlockCallback callback, void *arg, uint32_t flags = 0);
+// Unregisters every system
+void clearSystems(void);
+// Runs every registered system once
+void runSystems(void);
+// Sets how many threads runSystems spreads blocks over, including the calling thread, up to MAX_SYSTEM_THREADS
+// Levels with only a few thousand entities between their systems use fewer threads, since waking more costs more than it saves
+// Only builds with ECS_THREADED have worker threads, everywhere else the systems always run on the calling thread
+// The count starts at 1, so systems only run on worker threads once a caller that has measured a win asks for more
+void setSystemThreadCount(int count);
+
+// Registers the behavior and destroy timer systems (the scheduled equivalents of iterateBehaviorEntities and tickDestroyTimers)
+void registerBehaviorSystem(void);
+void registerDestroyTimerSystem(void);
+
+namespace ecs {
+
+// Turns a captureless lambda taking a reference to each of the given components into a system block callback, e.g.
+//   registerSystem(velocityQuery, Bit_Velocity, Bit_Position,
+//       ecs::system_callback<ecs::Position, const ecs::Velocity>([](Vec3& pos, const Vec3& vel) { ... }), nullptr);
+template <typename... Cs, typename Func>
+SystemBlockCallback system_callback(Func)
+{
+    static_assert(std::is_empty_v<Func> && std::is_default_constructible_v<Func>, "System callbacks can't capture anything");
+    return [](const EntityQueryMatch& match, MultiArrayListBlock *block, void *)
+    {
+        size_t count = block->numElements;
+        [count](component_t<Cs>*... arrays)
+        {
+            Func body{};
+            for (size_t i = 0; i < count; i++)
+            {
+                body(arrays[i]...);
+            }
+        }(block_array<Cs>(match, block)...);
+    };
+}
+
+} // namespace ecs
+
+#endif
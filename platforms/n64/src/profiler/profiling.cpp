@@ -10,6 +10,7 @@ extern "C" {
 #include "fasttext.h"
 }
 #include <main.h>
+#include <ecs.h>
 
 #define RDP_CYCLE_CONV(x) ((10 * (x)) / 625) // 62.5 million cycles per frame
 
@@ -141,12 +142,15 @@ extern "C" int sprintf(char *s, const char *fmt, ...);
 
 void profiler_print_times() {
     uint32_t microseconds[PROFILER_TIME_COUNT];
-    char text_buffer[256];
+    char text_buffer[384];
 
     update_fps_timer();
     update_total_timer();
     update_rdp_timers();
 
+    // Gathered after the timers are updated so walking the ECS doesn't count towards the frame
+    ecs::Stats ecs_stats = ecs::stats();
+
     for (int i = 0; i < PROFILER_TIME_COUNT; i++) {
         if (i < PROFILER_TIME_TMEM) {
             microseconds[i] = OS_CYCLES_TO_USEC(all_profiling_data[i].total / PROFILING_BUFFER_SIZE);
@@ -176,6 +180,14 @@ void profiler_print_times() {
         "TMEM: %7" PRIu32 "\n"
         "CMD:  %7" PRIu32 "\n"
         "PIPE: %7" PRIu32 "\n"
+        "ECS\n"
+        "ENTS: %7" PRIu32 "\n"
+        "GAPS: %7" PRIu32 "\n"
+        "ARCH: %3d/%3d\n"
+        "BLKS: %7" PRIu32 "\n"
+        "KB:   %7" PRIu32 "\n"
+        "WASTE:%7" PRIu32 "\n"
+        "QUEUE:%3" PRIu32 "/%3" PRIu32 "\n"
         // "RSP\n"
         // "GFX:  %7d\n"
         // "AUDIO:%7d\n"
@@ -198,7 +210,14 @@ void profiler_print_times() {
         microseconds[PROFILER_TIME_TOTAL] + microseconds[PROFILER_TIME_AUDIO] * 2, // audio time is removed from the main thread profiling, so add it back here
         microseconds[PROFILER_TIME_TMEM],
         microseconds[PROFILER_TIME_CMD],
-        microseconds[PROFILER_TIME_PIPE]
+        microseconds[PROFILER_TIME_PIPE],
+        ecs_stats.numEntities,
+        ecs_stats.entityGaps,
+        ecs_stats.numOccupiedArchetypes, ecs_stats.numArchetypes,
+        ecs_stats.numBlocks,
+        (ecs_stats.bytesAllocated + ecs_stats.entityTableBytes + ecs_stats.commandBufferBytes) / 1024,
+        ecs_stats.bytesWasted / 1024,
+        ecs_stats.queuedCreations, ecs_stats.queuedDeletions
         // microseconds[PROFILER_TIME_RSP_GFX],
         // microseconds[PROFILER_TIME_RSP_AUDIO],
         // microseconds[PROFILER_TIME_RSP_GFX] + microseconds[PROFILER_TIME_RSP_AUDIO]
@@ -8,15 +8,19 @@
 #include <collision.h>
 #include <physics.h>
 #include <interaction.h>
-#include <block_vector.h>
+#include <systems.h>
 
+#include <algorithm>
 #include <memory>
+#ifdef ECS_THREADED
+#include <mutex>
+#endif
 
 extern "C" {
 #include <debug.h>
 }
 
-#define COMPONENT(Name, Type) sizeof(Type),
+#define COMPONENT(Name, Type) component_storage_size<Type>,
 
 const size_t g_componentSizes[] = {
 #include "components.inc.h"
@@ -24,18 +28,66 @@ const size_t g_componentSizes[] = {
 
 #undef COMPONENT
 
+#define COMPONENT(Name, Type) + ROUND_UP(component_storage_size<Type>, ecs::prefab_component_alignment)
+static_assert(ecs::prefab_max_row_size >= 0
+#include "components.inc.h"
+    , "Prefab rows are too small to hold every component type");
+
+#undef COMPONENT
+
+// Starts at 1 so that every block written counts as changed for a reader that hasn't run yet (which passes 0 as its version)
+uint32_t g_changeVersion = 1;
+
 int archetypeEntityCounts[MAX_ARCHETYPES];
 archetype_t currentArchetypes[MAX_ARCHETYPES];
 MultiArrayList archetypeArrays[MAX_ARCHETYPES];
 
-int numArchetypes = 0;
+// Progress of groupEntities through one archetype
+struct ArchetypeGrouping {
+    // Bit of the component the archetype is being grouped by, 0 if it hasn't been grouped yet
+    archetype_t keyBit;
+    // Change version the archetype was last found to be fully grouped at, 0 if it isn't known to be
+    uint32_t groupedVersion;
+    // Change version the current pass over the archetype started at
+    uint32_t passVersion;
+    // Every entity before this index is grouped, 0 if no pass is in progress
+    uint32_t cursor;
+    // None of the entities from the cursor up to this index have the key of the run before the cursor
+    uint32_t scan;
+    // Whether the current pass has had to move any entities
+    bool passSwapped;
+};
+
+ArchetypeGrouping archetypeGroupings[MAX_ARCHETYPES];
 
-Entity allEntities[MAX_ENTITIES];
+int numArchetypes = 0;
+// Number of times the archetype registry has been cleared, lets queries notice that their cached matches are stale
+uint32_t archetypeRegistryResets = 0;
+// Number of times the whole world has been replaced, see getWorldResets
+uint32_t worldResets = 0;
+
+// log2 of the number of slots in the archetype lookup table
+constexpr int archetype_table_bits = 9;
+constexpr size_t archetype_table_size = 1 << archetype_table_bits;
+// Keeping the table at least twice as large as the archetype count bounds the load factor to one half, which keeps probe sequences short
+static_assert(archetype_table_size >= 2 * MAX_ARCHETYPES, "Archetype lookup table is too small for MAX_ARCHETYPES");
+// Open-addressed hash table of archetype indices plus one, a value of zero marks an empty slot
+// Archetypes themselves stay in currentArchetypes in registration order, so iteration order is unaffected
+uint16_t archetypeTable[archetype_table_size];
+
+EntityChunk *entityChunks[max_entity_chunks];
+int numEntityChunks = 0;
+// Generation that slots in newly allocated entity chunks start at
+// Raised past every generation handed out when deleteAllEntities frees the chunks, so handles from a previous level
+// never resolve to entities in the next one
+uint16_t chunkStartGeneration = 0;
 // End of the populated entities in the array
 int entitiesEnd = 0;
 // Actual number of entities (accounts for gaps in the array)
 int numEntities = 0;
 int numGaps = 0;
+// Gaps in the entity table form an intrusive free list (most recently freed first)
+// A free slot has an archetype of zero and stores the index of the next gap in its archetypeArrayIndex
 int firstGap = INT32_MAX;
 
 // Underlying implementation for popcount
@@ -47,70 +99,393 @@ extern "C" int numberOfSetBits(uint32_t i)
      return (((i + (i >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
 }
 
-struct EntityCreationParams {
+uint32_t getEntityKey(Entity *e);
+void deleteEntityKeys(uint32_t *keys, int count);
+ActiveState *getActiveState(Entity *e);
+void syncActiveStates(Entity **entities, int count);
+void createEntitiesImpl(archetype_t archetype, const ecs::Prefab *prefab, void *arg, int count, EntityArrayCallback callback);
+void clearArchetypeRegistry();
+int getArchetypeIndex(archetype_t archetype);
+
+enum class EntityCommandType : uint8_t {
+    Create,
+    Delete,
+    SetComponent,
+    SetActive,
+};
+
+// Start of every command in the command buffer
+struct EntityCommand {
+    EntityCommandType type;
+    // Component type being set by a SetComponent command
+    uint8_t componentType;
+    // Size of the whole command, including this header and any payload
+    uint16_t size;
+};
+
+struct CreateEntitiesCommand {
+    EntityCommand header;
     archetype_t archetype;
-    void* arg;
     int count;
     EntityArrayCallback callback;
+    void *arg;
+    // Prefab to copy the new entities' components from, or nullptr to leave them zeroed
+    const ecs::Prefab *prefab;
+};
+
+struct DeleteEntityCommand {
+    EntityCommand header;
+    // Handle rather than pointer so that an entity that was deleted some other way before playback gets skipped
+    EntityHandle entity;
+};
+
+struct SetComponentCommand {
+    EntityCommand header;
+    EntityHandle entity;
+    // Followed by the component's value, padded to entity_command_alignment
+};
+
+struct SetActiveCommand {
+    EntityCommand header;
+    EntityHandle entity;
+    bool active;
+};
+
+// Every command starts at a multiple of this, which keeps the payloads of SetComponent commands aligned for any component
+constexpr size_t entity_command_alignment = 8;
+
+// Buffer of deferred structural changes, recorded during iteration and played back all at once by process_entity_queues
+// Commands are bump allocated out of a chain of pool chunks. Emptying the buffer keeps the chunks, so once it has grown to
+// hold a frame's worth of commands recording doesn't touch the allocator at all.
+// Commands recorded while the buffer is being played back are appended to the end of the same stream and get played back
+// in the same pass.
+class EntityCommandBuffer {
+public:
+    struct Chunk {
+        Chunk *next;
+        // Number of bytes of commands in this chunk, starting from commands_begin
+        uint32_t used;
+    };
+
+    static constexpr size_t commands_begin = ROUND_UP(sizeof(Chunk), entity_command_alignment);
+    static constexpr size_t chunk_capacity = mem_block_size - commands_begin;
+
+    // Position in the command stream
+    struct Cursor {
+        Chunk *chunk;
+        uint32_t offset;
+
+        bool operator==(const Cursor& rhs) const { return chunk == rhs.chunk && offset == rhs.offset; }
+    };
+
+    // Reserves room for a command of the given size at the end of the stream and fills in its header
+    void *record(EntityCommandType type, size_t size)
+    {
+        size = ROUND_UP(size, entity_command_alignment);
+        if (tail_ == nullptr || tail_->used + size > chunk_capacity)
+        {
+            appendChunk();
+        }
+        EntityCommand *command = reinterpret_cast<EntityCommand*>(reinterpret_cast<uint8_t*>(tail_) + commands_begin + tail_->used);
+        command->type = type;
+        command->componentType = 0;
+        command->size = size;
+        tail_->used += size;
+        return command;
+    }
+
+    // Empties the buffer, keeping its chunks around for the next frame
+    void reset()
+    {
+        for (Chunk *chunk = head_; chunk != nullptr; chunk = chunk->next)
+        {
+            chunk->used = 0;
+        }
+        tail_ = head_;
+    }
+
+    // Start and end of the stream as it is right now, commands recorded after end() is called come after the cursor it returns
+    Cursor begin() const { return Cursor{head_, 0}; }
+    Cursor end() const { return Cursor{tail_, tail_ != nullptr ? tail_->used : 0}; }
+
+    // Number of bytes of commands recorded
+    size_t bytesUsed() const
+    {
+        size_t ret = 0;
+        for (Chunk *chunk = head_; chunk != nullptr; chunk = chunk->next)
+        {
+            ret += chunk->used;
+        }
+        return ret;
+    }
+
+    // Number of bytes of chunks the buffer has allocated, including the ones it's keeping for later
+    size_t bytesAllocated() const
+    {
+        size_t ret = 0;
+        for (Chunk *chunk = head_; chunk != nullptr; chunk = chunk->next)
+        {
+            ret += mem_block_size;
+        }
+        return ret;
+    }
+
+    // Calls func for every command from start up to (but not including) stop
+    template <typename Func>
+    static void forEach(Cursor start, Cursor stop, Func&& func)
+    {
+        Cursor cur = start;
+        while (!(cur == stop))
+        {
+            if (cur.offset == cur.chunk->used)
+            {
+                cur = Cursor{cur.chunk->next, 0};
+                continue;
+            }
+            EntityCommand *command = reinterpret_cast<EntityCommand*>(reinterpret_cast<uint8_t*>(cur.chunk) + commands_begin + cur.offset);
+            cur.offset += command->size;
+            func(command);
+        }
+    }
+private:
+    // Moves the tail on to the next chunk, allocating one if the buffer has never needed this many before
+    void appendChunk()
+    {
+        Chunk *next = tail_ != nullptr ? tail_->next : head_;
+        if (next == nullptr)
+        {
+            next = static_cast<Chunk*>(allocChunks(1, ALLOC_ECS));
+            next->next = nullptr;
+            next->used = 0;
+            if (tail_ != nullptr)
+            {
+                tail_->next = next;
+            }
+            else
+            {
+                head_ = next;
+            }
+        }
+        tail_ = next;
+    }
+
+    Chunk *head_;
+    Chunk *tail_;
 };
 
-block_vector<Entity*> queued_deletions;
-block_vector<EntityCreationParams> queued_creations;
+EntityCommandBuffer entityCommands;
+
+// One bit per entity slot, set while the entity has a deletion recorded in the command buffer so that duplicates can be rejected without scanning it
+// Cleared when the slot is freed, however the entity ends up being deleted
+uint32_t queuedDeletionBits[MAX_ENTITIES / 32];
+// Number of deletions recorded in the command buffer
+int numQueuedDeletions;
+// Number of activations and deactivations recorded in the command buffer
+int numQueuedActivations;
 
+#ifdef ECS_THREADED
+// Systems can queue entities from several threads at once
+std::mutex entityQueueMutex;
+#define LOCK_ENTITY_QUEUES() std::lock_guard<std::mutex> entityQueueLock{entityQueueMutex}
+#else
+#define LOCK_ENTITY_QUEUES()
+#endif
 
 void queue_entity_deletion(Entity *e)
 {
+    LOCK_ENTITY_QUEUES();
     // debug_printf("Entity %08X queued for deletion\n", e);
+    int index = getEntityIndex(e);
+    uint32_t bit = 1U << (index & 31);
     // Check if the entity is already queued and if so do nothing
-    for (auto it = queued_deletions.begin(); it != queued_deletions.end(); ++it)
+    if (queuedDeletionBits[index >> 5] & bit)
     {
-        if (*it == e)
-        {
-            return;
-        }
+        return;
     }
+    queuedDeletionBits[index >> 5] |= bit;
+    numQueuedDeletions++;
     // Queue the entity for deletion
-    queued_deletions.emplace_back(e);
+    DeleteEntityCommand *command = static_cast<DeleteEntityCommand*>(entityCommands.record(EntityCommandType::Delete, sizeof(DeleteEntityCommand)));
+    command->entity = getEntityHandle(e);
+}
+
+// Records a creation command, the prefab is optional
+void queueCreation(archetype_t archetype, const ecs::Prefab *prefab, void* arg, int count, EntityArrayCallback callback)
+{
+    LOCK_ENTITY_QUEUES();
+    CreateEntitiesCommand *command = static_cast<CreateEntitiesCommand*>(entityCommands.record(EntityCommandType::Create, sizeof(CreateEntitiesCommand)));
+    command->archetype = archetype;
+    command->count = count;
+    command->callback = callback;
+    command->arg = arg;
+    command->prefab = prefab;
 }
 
 void queue_entity_creation(archetype_t archetype, void* arg, int count, EntityArrayCallback callback)
 {
-    queued_creations.emplace_back(archetype, arg, count, callback);
+    queueCreation(archetype, nullptr, arg, count, callback);
 }
 
-void process_entity_queues()
+void queue_prefab_spawn(const ecs::Prefab& prefab, int count, void *arg, EntityArrayCallback callback)
+{
+    queueCreation(prefab.archetype(), &prefab, arg, count, callback);
+}
+
+void queue_component_set(Entity *e, int componentType, const void *value)
+{
+    LOCK_ENTITY_QUEUES();
+    size_t componentSize = g_componentSizes[componentType];
+    SetComponentCommand *command = static_cast<SetComponentCommand*>(
+        entityCommands.record(EntityCommandType::SetComponent, ROUND_UP(sizeof(SetComponentCommand), entity_command_alignment) + componentSize));
+    command->header.componentType = componentType;
+    command->entity = getEntityHandle(e);
+    memcpy(reinterpret_cast<uint8_t*>(command) + ROUND_UP(sizeof(SetComponentCommand), entity_command_alignment), value, componentSize);
+}
+
+void queue_entity_activation(Entity *e, bool active)
+{
+    LOCK_ENTITY_QUEUES();
+    SetActiveCommand *command = static_cast<SetActiveCommand*>(entityCommands.record(EntityCommandType::SetActive, sizeof(SetActiveCommand)));
+    command->entity = getEntityHandle(e);
+    command->active = active;
+    numQueuedActivations++;
+}
+
+void clear_entity_queues()
 {
-    // Process deletion queue
-    for (Entity* to_delete : queued_deletions)
+    // Release the bits of anything that was queued but never processed
+    if (numQueuedDeletions != 0)
     {
-        // debug_printf("Deleting entity %08X\n", to_delete);
-        deleteEntity(to_delete);
+        EntityCommandBuffer::forEach(entityCommands.begin(), entityCommands.end(),
+            [](EntityCommand *command)
+            {
+                if (command->type == EntityCommandType::Delete)
+                {
+                    uint32_t index = reinterpret_cast<DeleteEntityCommand*>(command)->entity & 0xFFFF;
+                    queuedDeletionBits[index >> 5] &= ~(1U << (index & 31));
+                }
+            });
+        numQueuedDeletions = 0;
     }
-    
-    // The callbacks are allowed to create more entities, so we need to repeat processing of the creation queue.
-    while (!queued_creations.empty())
+    numQueuedActivations = 0;
+    entityCommands.reset();
+}
+
+// Copies the value of a SetComponent command into its entity, unless the entity is gone or no longer has the component
+void applySetComponent(SetComponentCommand *command)
+{
+    Entity *e = resolveEntityHandle(command->entity);
+    archetype_t componentBit = 1U << command->header.componentType;
+    if (e == nullptr || !(e->archetype & componentBit))
+    {
+        return;
+    }
+    MultiArrayList *arr = &archetypeArrays[getArchetypeIndex(e->archetype)];
+    size_t componentSize = g_componentSizes[command->header.componentType];
+    size_t blockIndex;
+    MultiArrayListBlock *block = multiarraylist_get_block(arr, e->archetypeArrayIndex, &blockIndex);
+    uint8_t *dest = reinterpret_cast<uint8_t*>(block) + multiarraylist_get_component_offset(arr, command->header.componentType) + componentSize * blockIndex;
+    memcpy(dest, reinterpret_cast<uint8_t*>(command) + ROUND_UP(sizeof(SetComponentCommand), entity_command_alignment), componentSize);
+    multiarraylist_mark_changed(block, componentBit);
+}
+
+void process_entity_queues()
+{
+    EntityCommandBuffer::Cursor roundStart = entityCommands.begin();
+
+    // Commands are played back in rounds, each covering everything recorded before it started. Within a round component
+    // sets go first, then every deletion as one batch, then the creations in the order they were recorded.
+    // The creation callbacks are allowed to record more commands, which get played back by the next round.
+    while (!(roundStart == entityCommands.end()))
     {
-        // Move the current creation queue into a temporary to allow callbacks to spawn more entities
-        // This also clears queued_creations via the move operation
-        block_vector<EntityCreationParams> cur_queued_creations = std::move(queued_creations);
-        for (const EntityCreationParams& params : cur_queued_creations)
+        EntityCommandBuffer::Cursor roundEnd = entityCommands.end();
+
+        if (numQueuedDeletions != 0)
+        {
+            uint32_t *keys = static_cast<uint32_t*>(allocRegion(numQueuedDeletions * sizeof(uint32_t), ALLOC_ECS));
+            int numKeys = 0;
+            EntityCommandBuffer::forEach(roundStart, roundEnd,
+                [keys, &numKeys](EntityCommand *command)
+                {
+                    if (command->type == EntityCommandType::SetComponent)
+                    {
+                        applySetComponent(reinterpret_cast<SetComponentCommand*>(command));
+                    }
+                    else if (command->type == EntityCommandType::Delete)
+                    {
+                        // The entity's queued bit gets cleared when its slot is freed, which already happened if the handle is stale
+                        Entity *to_delete = resolveEntityHandle(reinterpret_cast<DeleteEntityCommand*>(command)->entity);
+                        // debug_printf("Deleting entity %08X\n", to_delete);
+                        if (to_delete != nullptr)
+                        {
+                            keys[numKeys++] = getEntityKey(to_delete);
+                        }
+                    }
+                });
+            numQueuedDeletions = 0;
+            deleteEntityKeys(keys, numKeys);
+            freeAlloc(keys);
+        }
+        else
+        {
+            EntityCommandBuffer::forEach(roundStart, roundEnd,
+                [](EntityCommand *command)
+                {
+                    if (command->type == EntityCommandType::SetComponent)
+                    {
+                        applySetComponent(reinterpret_cast<SetComponentCommand*>(command));
+                    }
+                });
+        }
+
+        if (numQueuedActivations != 0)
         {
-            createEntitiesCallback(params.archetype, params.arg, params.count, params.callback);
+            Entity **entities = static_cast<Entity**>(allocRegion(numQueuedActivations * sizeof(Entity*), ALLOC_ECS));
+            int numToSync = 0;
+            // Set the flags in order so the last command for an entity wins, then move everything that changed at once
+            EntityCommandBuffer::forEach(roundStart, roundEnd,
+                [entities, &numToSync](EntityCommand *command)
+                {
+                    if (command->type == EntityCommandType::SetActive)
+                    {
+                        SetActiveCommand *setActive = reinterpret_cast<SetActiveCommand*>(command);
+                        Entity *e = resolveEntityHandle(setActive->entity);
+                        if (e != nullptr && (e->archetype & Bit_Deactivatable))
+                        {
+                            getActiveState(e)->deactivated = !setActive->active;
+                            entities[numToSync++] = e;
+                        }
+                    }
+                });
+            numQueuedActivations = 0;
+            syncActiveStates(entities, numToSync);
+            freeAlloc(entities);
         }
+
+        EntityCommandBuffer::forEach(roundStart, roundEnd,
+            [](EntityCommand *command)
+            {
+                if (command->type == EntityCommandType::Create)
+                {
+                    CreateEntitiesCommand *create = reinterpret_cast<CreateEntitiesCommand*>(command);
+                    createEntitiesImpl(create->archetype, create->prefab, create->arg, create->count, create->callback);
+                }
+            });
+
+        roundStart = roundEnd;
     }
+
+    entityCommands.reset();
 }
 
-void iterateOverEntities(EntityArrayCallback callback, void *arg, archetype_t componentMask, archetype_t rejectMask)
+void iterateOverEntities(EntityArrayCallback callback, void *arg, archetype_t componentMask, archetype_t rejectMask, archetype_t readOnlyMask)
 {
     int componentIndex, curArchetypeIndex;
     int numComponents = NUM_COMPONENTS(componentMask);
     int numComponentsFound = 0;
-    auto components = std::unique_ptr<size_t[]>(new size_t[numComponents]);
+    size_t components[NUM_COMPONENT_TYPES];
     archetype_t componentBits = componentMask;
-
-    // Clear the entity queues
-    queued_deletions = {};
-    queued_creations = {};
+    archetype_t writtenMask = componentMask & ~readOnlyMask;
 
     componentIndex = 0;
     while (componentBits)
@@ -130,13 +505,12 @@ void iterateOverEntities(EntityArrayCallback callback, void *arg, archetype_t co
         {
             MultiArrayList *arr = &archetypeArrays[curArchetypeIndex];
             MultiArrayListBlock *curBlock = arr->start;
-            auto curOffsets = std::unique_ptr<size_t[]>(new size_t[numComponents]);
+            size_t curOffsets[NUM_COMPONENT_TYPES];
             // Array for each component pointer, plus the pointer to the entity itself
-            auto curAddresses = std::unique_ptr<void*[]>(new void*[numComponents + 1]);
+            void *curAddresses[NUM_COMPONENT_TYPES + 1];
             int i;
             
             // Find the offsets for each component
-            // TODO this can be optimized by not using multiarraylist_get_component_offset
             for (i = 0; i < numComponents; i++)
             {
                 curOffsets[i] = multiarraylist_get_component_offset(arr, components[i]);
@@ -152,8 +526,9 @@ void iterateOverEntities(EntityArrayCallback callback, void *arg, archetype_t co
                 {
                     curAddresses[i + 1] = (void*)(curOffsets[i] + (uintptr_t)curBlock);
                 }
+                multiarraylist_mark_changed(curBlock, writtenMask);
                 // Call the provided callback
-                callback(curBlock->numElements, arg, curAddresses.get());
+                callback(curBlock->numElements, arg, curAddresses);
                 // Advance to the next block
                 curBlock = curBlock->next;
             }
@@ -163,44 +538,46 @@ void iterateOverEntities(EntityArrayCallback callback, void *arg, archetype_t co
     process_entity_queues();
 }
 
-void iterateOverEntitiesAllComponents(EntityArrayCallbackAll callback, void *arg, archetype_t componentMask, archetype_t rejectMask)
+// Fills in the offset and size of every component in the given archetype's blocks, returns the number of components
+int getArchetypeLayout(MultiArrayList *arr, uint16_t *offsetsOut, size_t *sizesOut)
 {
-    int curArchetypeIndex;
+    int curComponentIndex = 0;
+    int curNumComponentsFound = 0;
+    archetype_t componentBits = arr->archetype;
+    size_t curOffset = sizeof(MultiArrayListBlock) + arr->elementCount * sizeof(Entity*);
+
+    while (componentBits)
+    {
+        if (componentBits & 1)
+        {
+            offsetsOut[curNumComponentsFound] = curOffset;
+            sizesOut[curNumComponentsFound] = g_componentSizes[curComponentIndex];
+            curOffset += sizesOut[curNumComponentsFound] * arr->elementCount;
+            curNumComponentsFound++;
+        }
+        componentBits >>= 1;
+        curComponentIndex++;
+    }
+    return curNumComponentsFound;
+}
 
-    // Clear the entity queues
-    queued_deletions = {};
-    queued_creations = {};
+void iterateOverEntitiesAllComponents(EntityArrayCallbackAll callback, void *arg, archetype_t componentMask, archetype_t rejectMask, archetype_t readOnlyMask)
+{
+    int curArchetypeIndex;
 
     for (curArchetypeIndex = 0; curArchetypeIndex < numArchetypes; curArchetypeIndex++)
     {
         archetype_t curArchetype = currentArchetypes[curArchetypeIndex];
         if (((curArchetype & componentMask) == componentMask) && !(curArchetype & rejectMask))
         {
-            int curComponentIndex;
-            int curNumComponents = NUM_COMPONENTS(curArchetype);
-            int curNumComponentsFound = 0;
-            archetype_t componentBits = curArchetype;
             MultiArrayList *arr = &archetypeArrays[curArchetypeIndex];
             MultiArrayListBlock *curBlock = arr->start;
-            auto curComponentSizes = std::unique_ptr<size_t[]>(new size_t[curNumComponents]);
-            auto curOffsets = std::unique_ptr<size_t[]>(new size_t[curNumComponents]);
-            auto curAddresses = std::unique_ptr<void*[]>(new void*[curNumComponents + 1]);
-            size_t curOffset = sizeof(MultiArrayListBlock) + arr->elementCount * sizeof(Entity*);
+            size_t curComponentSizes[NUM_COMPONENT_TYPES];
+            uint16_t curOffsets[NUM_COMPONENT_TYPES];
+            void *curAddresses[NUM_COMPONENT_TYPES + 1];
             
             // Find all components in the current archetype and determine their size and offset in the multi array block
-            curComponentIndex = 0;
-            while (componentBits)
-            {
-                if (componentBits & 1)
-                {
-                    curOffsets[curNumComponentsFound] = curOffset;
-                    curComponentSizes[curNumComponentsFound] = g_componentSizes[curComponentIndex];
-                    curOffset += curComponentSizes[curNumComponentsFound] * arr->elementCount;
-                    curNumComponentsFound++;
-                }
-                componentBits >>= 1;
-                curComponentIndex++;
-            }
+            int curNumComponents = getArchetypeLayout(arr, curOffsets, curComponentSizes);
 
             // Iterate over every block in this multiarray
             while (curBlock)
@@ -212,8 +589,9 @@ void iterateOverEntitiesAllComponents(EntityArrayCallbackAll callback, void *arg
                 {
                     curAddresses[i + 1] = (void*)(curOffsets[i] + (uintptr_t)curBlock);
                 }
+                multiarraylist_mark_changed(curBlock, curArchetype & ~readOnlyMask);
                 // Call the provided callback
-                callback(curBlock->numElements, arg, curNumComponents, curArchetype, curAddresses.get(), curComponentSizes.get());
+                callback(curBlock->numElements, arg, curNumComponents, curArchetype, curAddresses, curComponentSizes);
                 // Advance to the next block
                 curBlock = curBlock->next;
             }
@@ -223,221 +601,734 @@ void iterateOverEntitiesAllComponents(EntityArrayCallbackAll callback, void *arg
     process_entity_queues();
 }
 
-// TODO sort upon add, use binary search to check if already exists
-void registerArchetype(archetype_t archetype)
+EntityQuery::~EntityQuery()
 {
-    int i;
-    // Don't add an archetype that is already registered
-    for (i = 0; i < numArchetypes; i++)
+    if (matches_ != nullptr)
     {
-        if (currentArchetypes[i] == archetype)
-            return;
+        freeAlloc(matches_);
     }
-    currentArchetypes[numArchetypes] = archetype;
-    multiarraylist_init(&archetypeArrays[numArchetypes], archetype);
-    archetypeEntityCounts[numArchetypes] = 0;
-    numArchetypes++;
 }
 
-// TODO use binary search after adding sorted archetype array
-int getArchetypeIndex(archetype_t archetype)
+void EntityQuery::addMatch(MultiArrayList *arr)
 {
-    int i;
-    for (i = 0; i < numArchetypes; i++)
+    // Grow the match array if it's full, this only happens when archetypes are registered so it's kept out of iteration
+    if (numMatches_ == capacity_)
     {
-        if (currentArchetypes[i] == archetype)
-            return i;
+        size_t newCapacity = std::max<size_t>(2 * capacity_, mem_block_size / sizeof(EntityQueryMatch));
+        EntityQueryMatch *newMatches = static_cast<EntityQueryMatch*>(allocRegion(newCapacity * sizeof(EntityQueryMatch), ALLOC_ECS));
+        if (matches_ != nullptr)
+        {
+            std::copy_n(matches_, numMatches_, newMatches);
+            freeAlloc(matches_);
+        }
+        matches_ = newMatches;
+        capacity_ = newCapacity;
     }
-    // If the loop completed then the archetype isn't registered, so register it
-    registerArchetype(archetype);
-    // Return the last archetype, which will be the newly registered one
-    return numArchetypes - 1;
-}
 
-int findNextGap(int prevGap)
-{
-    int retVal;
-    for (retVal = prevGap + 1; retVal < entitiesEnd; retVal++)
+    EntityQueryMatch *match = &matches_[numMatches_++];
+    archetype_t componentBits = arr->archetype;
+    int numFound = 0;
+    int i;
+    match->arr = arr;
+    match->archetype = arr->archetype;
+    match->numComponents = getArchetypeLayout(arr, match->allComponentOffsets, match->allComponentSizes);
+
+    // Pick out the offsets of the queried components from those of every component in the archetype
+    for (i = 0; componentBits; i++)
     {
-        if (allEntities[retVal].archetype == 0)
+        // Lowest remaining bit is the i-th component of the archetype
+        if ((componentBits & -componentBits) & componentMask_)
         {
-            return retVal;
+            match->componentOffsets[numFound++] = match->allComponentOffsets[i];
         }
+        componentBits &= componentBits - 1;
     }
-    return INT32_MAX;
 }
 
-void allocEntities(archetype_t archetype, int count, Entity** output)
+void EntityQuery::update()
 {
-    // The index of this archetype
-    int archetypeIndex = getArchetypeIndex(archetype);
-    int archetypeEntityCount = archetypeEntityCounts[archetypeIndex];
-    Entity *curEntity;
-    int curNumEntities = numEntities;
-    int curGap = firstGap;
-
-    // Fill in any gaps in the entity array
-    while (numGaps > 0 && count > 0)
+    // If the archetype registry was cleared since the last update, start over
+    if (registryResets_ != archetypeRegistryResets)
     {
-        allEntities[curGap].archetype = archetype;
-        allEntities[curGap].archetypeArrayIndex = archetypeEntityCount++;
-        *output = &allEntities[curGap];
-        output++;
-        curGap = findNextGap(curGap);
-        curNumEntities++;
-        numGaps--;
-        count--;
+        registryResets_ = archetypeRegistryResets;
+        numArchetypesChecked_ = 0;
+        numMatches_ = 0;
     }
-    // Update the first gap index
-    firstGap = curGap;
 
-    // Append new entities to the end of the array
-    for (curEntity = &allEntities[entitiesEnd]; curEntity < &allEntities[entitiesEnd + count]; curEntity++)
+    // Only archetypes registered since the last update need to be checked
+    for (; numArchetypesChecked_ < numArchetypes; numArchetypesChecked_++)
     {
-        curEntity->archetype = archetype;
-        curEntity->archetypeArrayIndex = archetypeEntityCount++;
-        *output = curEntity;
-        output++;
-        curNumEntities++;
+        archetype_t curArchetype = currentArchetypes[numArchetypesChecked_];
+        if (((curArchetype & componentMask_) == componentMask_) && !(curArchetype & rejectMask_))
+        {
+            addMatch(&archetypeArrays[numArchetypesChecked_]);
+        }
     }
+}
 
-    // Update the count of entities of this archetype
-    archetypeEntityCounts[archetypeIndex] = archetypeEntityCount;
-    // Update the total entity count
-    numEntities = curNumEntities;
-
-    // If the entity list has run past the previous end index, update the end
-    if (numEntities > entitiesEnd)
+void forEachMatchingArchetype(archetype_t componentMask, archetype_t rejectMask, void (*func)(const EntityQueryMatch& match, void *arg), void *arg)
+{
+    int curArchetypeIndex;
+    for (curArchetypeIndex = 0; curArchetypeIndex < numArchetypes; curArchetypeIndex++)
     {
-        entitiesEnd = numEntities;
+        archetype_t curArchetype = currentArchetypes[curArchetypeIndex];
+        if (((curArchetype & componentMask) == componentMask) && !(curArchetype & rejectMask))
+        {
+            EntityQueryMatch match;
+            match.arr = &archetypeArrays[curArchetypeIndex];
+            match.archetype = curArchetype;
+            match.numComponents = getArchetypeLayout(match.arr, match.allComponentOffsets, match.allComponentSizes);
+            func(match, arg);
+        }
     }
 }
 
-Entity *createEntity(archetype_t archetype)
+void iterateOverEntitiesChangedSince(EntityArrayCallback callback, void *arg, EntityQuery& query, archetype_t changedMask, uint32_t version, archetype_t readOnlyMask)
 {
-    // The index of this archetype
-    int archetypeIndex = getArchetypeIndex(archetype);
-    Entity *curEntity;
-    // The arraylist for this archetype
-    MultiArrayList *archetypeList = &archetypeArrays[archetypeIndex];
-    
-    // Allocate the components for the new entity
-    multiarraylist_alloccount(archetypeList, 1);
+    query.update();
 
-    MultiArrayListBlock* endBlock = archetypeList->end;
-    Entity** block_entry = reinterpret_cast<Entity**>(reinterpret_cast<uintptr_t>(endBlock) + sizeof(MultiArrayListBlock) + sizeof(Entity*) * (endBlock->numElements - 1));
+    archetype_t writtenMask = query.componentMask() & ~readOnlyMask;
 
-    if (numGaps)
-    {
-        curEntity = &allEntities[firstGap];
-        firstGap = findNextGap(firstGap);
-        numGaps--;
-    }
-    else
+    int numComponents = NUM_COMPONENTS(query.componentMask());
+    for (const EntityQueryMatch& match : query)
     {
-        curEntity = &allEntities[entitiesEnd];
-        entitiesEnd++;
-    }
-
-    *block_entry = curEntity;
-    curEntity->archetype = archetype;
-    curEntity->archetypeArrayIndex = archetypeEntityCounts[archetypeIndex];
+        MultiArrayListBlock *curBlock = match.arr->start;
+        // Array for each component pointer, plus the pointer to the entity itself
+        void *curAddresses[NUM_COMPONENT_TYPES + 1];
 
-    archetypeEntityCounts[archetypeIndex]++;
-    numEntities++;
+        // Iterate over every block in this multiarray
+        while (curBlock)
+        {
+            int i;
+            if (changedMask == 0 || multiarraylist_changed_since(curBlock, changedMask, version))
+            {
+                curAddresses[0] = multiarraylist_get_block_entity_pointers(curBlock);
+                for (i = 0; i < numComponents; i++)
+                {
+                    curAddresses[i + 1] = (void*)(match.componentOffsets[i] + (uintptr_t)curBlock);
+                }
+                multiarraylist_mark_changed(curBlock, writtenMask);
+                callback(curBlock->numElements, arg, curAddresses);
+            }
+            curBlock = curBlock->next;
+        }
+    }
 
-    return curEntity;
+    process_entity_queues();
 }
 
-void deleteEntity(Entity *e)
+void iterateOverEntities(EntityArrayCallback callback, void *arg, EntityQuery& query, archetype_t readOnlyMask)
 {
-    // The index of this archetype
-    int archetypeIndex = getArchetypeIndex(e->archetype);
-    --archetypeEntityCounts[archetypeIndex];
-    // Entity *curEntity;
-
-    multiarraylist_delete(&archetypeArrays[archetypeIndex], e->archetypeArrayIndex);
+    iterateOverEntitiesChangedSince(callback, arg, query, 0, 0, readOnlyMask);
+}
 
-    // Ugly linear search over all entities to update the archetype array index of the entity that was moved in the delete
-    // e->archetypeArrayIndex = 
-    // TODO keep the entity list sorted?
-    // for (curEntity = &allEntities[0]; curEntity != &allEntities[entitiesEnd]; curEntity++)
-    // {
-    //     if (curEntity->archetypeArrayIndex == newLength)
-    //     {
-    //         curEntity->archetypeArrayIndex = e->archetypeArrayIndex;
-    //         break;
-    //     }
-    // }
-    
-    // Find the deleted entity in the list and clear its data
-    int entityIndex = e - &allEntities[0];
-    e->archetype = 0;
-    e->archetypeArrayIndex = 0;
-    numEntities--;
-    // If this is the last entity, update the end index
-    if (entityIndex == entitiesEnd - 1)
-    {
-        entitiesEnd--;
-    }
-    // Otherwise, increase the number of gaps
-    else
+uint32_t takeChangeVersion(void)
+{
+    uint32_t version = g_changeVersion++;
+    // Blocks only hold the low bits of their stamps, so pull the ones that have gone untouched for a while forward before they wrap
+    if (g_changeVersion % multiarraylist_version_rebase_interval == 0)
     {
-        numGaps++;
-        // If this new gap is less than the previous first gap, update the first gap to this one
-        if (entityIndex < firstGap)
+        for (int archetypeIndex = 0; archetypeIndex < numArchetypes; archetypeIndex++)
         {
-            firstGap = entityIndex;
+            multiarraylist_rebase_versions(&archetypeArrays[archetypeIndex]);
         }
     }
+    return version;
 }
 
-void deleteEntityIndex(int index)
+void markQueryChanged(EntityQuery& query, archetype_t components)
 {
-    // The archetype and array list index for this entity
-    archetype_t archetype = allEntities[index].archetype;
-    size_t archetypeArrayIndex = allEntities[index].archetypeArrayIndex;
-    // The index of this archetype
-    int archetypeIndex = getArchetypeIndex(archetype);
-    --archetypeEntityCounts[archetypeIndex];
-    // Entity *curEntity;
-
-    // Delete this entity's component info
-    multiarraylist_delete(&archetypeArrays[archetypeIndex], archetypeArrayIndex);
-
-    // Ugly linear search over all entities to update the archetype array index of the entity that was moved in the delete
-    // TODO keep the entity list sorted?
-    // for (curEntity = &allEntities[0]; curEntity != &allEntities[entitiesEnd]; curEntity++)
-    // {
-    //     if (curEntity->archetypeArrayIndex == newLength)
-    //     {
-    //         curEntity->archetypeArrayIndex = archetypeArrayIndex;
-    //         break;
-    //     }
-    // }
-    
-    // Clear the deleted entity's data
-    allEntities[index].archetype = 0;
-    allEntities[index].archetypeArrayIndex = 0;
-    numEntities--;
-
-    // If this is the last entity, update the end index
-    if (index == entitiesEnd - 1)
-    {
-        entitiesEnd--;
-    }
-    // Otherwise, increase the number of gaps
-    else
+    query.update();
+    for (const EntityQueryMatch& match : query)
     {
-        numGaps++;
-        // If this new gap is less than the previous first gap, update the first gap to this one
-        if (index < firstGap)
+        for (MultiArrayListBlock *curBlock = match.arr->start; curBlock != nullptr; curBlock = curBlock->next)
         {
-            firstGap = index;
+            multiarraylist_mark_changed(curBlock, components & match.archetype);
         }
     }
 }
 
+void iterateOverEntitiesAllComponents(EntityArrayCallbackAll callback, void *arg, EntityQuery& query, archetype_t readOnlyMask)
+{
+    query.update();
+
+    for (const EntityQueryMatch& match : query)
+    {
+        MultiArrayListBlock *curBlock = match.arr->start;
+        void *curAddresses[NUM_COMPONENT_TYPES + 1];
+
+        // Iterate over every block in this multiarray
+        while (curBlock)
+        {
+            int i;
+            curAddresses[0] = multiarraylist_get_block_entity_pointers(curBlock);
+            for (i = 0; i < match.numComponents; i++)
+            {
+                curAddresses[i + 1] = (void*)(match.allComponentOffsets[i] + (uintptr_t)curBlock);
+            }
+            multiarraylist_mark_changed(curBlock, match.archetype & ~readOnlyMask);
+            // The callback takes a non-const size array, but is never meant to modify it
+            callback(curBlock->numElements, arg, match.numComponents, match.archetype, curAddresses, const_cast<size_t*>(match.allComponentSizes));
+            curBlock = curBlock->next;
+        }
+    }
+
+    process_entity_queues();
+}
+
+// Finds the slot in the archetype lookup table that holds the given archetype, or the empty slot where it would be inserted
+uint16_t *findArchetypeSlot(archetype_t archetype)
+{
+    // Fibonacci hashing, the top bits of the product are the best distributed
+    size_t slot = (archetype * 2654435769u) >> (32 - archetype_table_bits);
+    while (true)
+    {
+        uint16_t curEntry = archetypeTable[slot];
+        if (curEntry == 0 || currentArchetypes[curEntry - 1] == archetype)
+        {
+            return &archetypeTable[slot];
+        }
+        // Linear probing, wrapping around at the end of the table
+        slot = (slot + 1) & (archetype_table_size - 1);
+    }
+}
+
+// Adds a new archetype to the end of the archetype list and records its index in the given (empty) lookup table slot
+int insertArchetype(uint16_t *slot, archetype_t archetype)
+{
+    int archetypeIndex = numArchetypes;
+    currentArchetypes[archetypeIndex] = archetype;
+    multiarraylist_init(&archetypeArrays[archetypeIndex], archetype);
+    archetypeEntityCounts[archetypeIndex] = 0;
+    archetypeGroupings[archetypeIndex] = {};
+    *slot = archetypeIndex + 1;
+    numArchetypes++;
+    return archetypeIndex;
+}
+
+void registerArchetype(archetype_t archetype)
+{
+    uint16_t *slot = findArchetypeSlot(archetype);
+    // Don't add an archetype that is already registered
+    if (*slot == 0)
+    {
+        insertArchetype(slot, archetype);
+    }
+}
+
+int getArchetypeIndex(archetype_t archetype)
+{
+    uint16_t *slot = findArchetypeSlot(archetype);
+    if (*slot != 0)
+    {
+        return *slot - 1;
+    }
+    // If the slot is empty then the archetype isn't registered, so register it
+    return insertArchetype(slot, archetype);
+}
+
+// Gets the entity in the given slot of the entity table, the slot's chunk must already be allocated
+Entity *getEntityFromIndex(int index)
+{
+    return &entityChunks[index / entities_per_chunk]->entities[index % entities_per_chunk];
+}
+
+// Gets the chunk of the entity table that holds the given slot, allocating it if needed
+EntityChunk *getOrAllocEntityChunk(int index)
+{
+    int chunkIndex = index / entities_per_chunk;
+    // Chunks are only ever allocated at the end of the entity table, so any missing chunk must be the next one
+    if (chunkIndex == numEntityChunks)
+    {
+        EntityChunk *newChunk = static_cast<EntityChunk*>(allocChunks(1, ALLOC_ECS));
+        newChunk->firstIndex = chunkIndex * entities_per_chunk;
+        std::fill_n(newChunk->generations, entities_per_chunk, chunkStartGeneration);
+        memset(newChunk->entities, 0, sizeof(newChunk->entities));
+        entityChunks[chunkIndex] = newChunk;
+        numEntityChunks++;
+    }
+    return entityChunks[chunkIndex];
+}
+
+// Advances the generation of the given entity slot as it's claimed by a new entity, invalidating any handles to the previous occupant
+// Generation zero is skipped so that a zero handle never refers to a live entity
+void bumpGeneration(Entity *e)
+{
+    EntityChunk *chunk = getEntityChunk(e);
+    uint16_t *generation = &chunk->generations[e - &chunk->entities[0]];
+    if (++(*generation) == 0)
+    {
+        *generation = 1;
+    }
+}
+
+// Removes the first gap from the free list and returns its entity slot, the caller must make sure there is a gap
+Entity *popGap()
+{
+    Entity *ret = getEntityFromIndex(firstGap);
+    firstGap = ret->archetypeArrayIndex;
+    numGaps--;
+    return ret;
+}
+
+// Claims the slot at the end of the entity table, growing the table if needed
+Entity *appendEntity()
+{
+    EntityChunk *chunk = getOrAllocEntityChunk(entitiesEnd);
+    Entity *ret = &chunk->entities[entitiesEnd - chunk->firstIndex];
+    entitiesEnd++;
+    return ret;
+}
+
+// Releases the given entity's slot, either by shrinking the end of the table or by adding it to the free list
+void freeEntitySlot(Entity *e)
+{
+    int index = getEntityIndex(e);
+    e->archetype = 0;
+    numEntities--;
+    // Any deletion still queued for the entity is now stale, so the slot's next entity must be able to queue its own
+    queuedDeletionBits[index >> 5] &= ~(1U << (index & 31));
+
+    // If this is the last entity, update the end index
+    if (index == entitiesEnd - 1)
+    {
+        e->archetypeArrayIndex = 0;
+        entitiesEnd--;
+    }
+    // Otherwise, push the slot onto the free list
+    else
+    {
+        e->archetypeArrayIndex = firstGap;
+        firstGap = index;
+        numGaps++;
+    }
+}
+
+void allocEntities(archetype_t archetype, int count, Entity** output)
+{
+    // The index of this archetype
+    int archetypeIndex = getArchetypeIndex(archetype);
+    int archetypeEntityCount = archetypeEntityCounts[archetypeIndex];
+    Entity *curEntity;
+    Entity *runEnd;
+
+    // Update the total entity count
+    numEntities += count;
+
+    // Fill in any gaps in the entity array
+    while (numGaps > 0 && count > 0)
+    {
+        curEntity = popGap();
+        bumpGeneration(curEntity);
+        curEntity->archetype = archetype;
+        curEntity->archetypeArrayIndex = archetypeEntityCount++;
+        *output = curEntity;
+        output++;
+        count--;
+    }
+
+    // Take the remaining entities as runs from the end of the table, one run per entity chunk
+    while (count > 0)
+    {
+        EntityChunk *chunk = getOrAllocEntityChunk(entitiesEnd);
+        int chunkOffset = entitiesEnd - chunk->firstIndex;
+        int runLength = std::min(count, (int)entities_per_chunk - chunkOffset);
+        uint16_t *curGeneration = &chunk->generations[chunkOffset];
+
+        runEnd = &chunk->entities[chunkOffset + runLength];
+        for (curEntity = &chunk->entities[chunkOffset]; curEntity != runEnd; curEntity++)
+        {
+            if (++(*curGeneration) == 0)
+            {
+                *curGeneration = 1;
+            }
+            curGeneration++;
+            curEntity->archetype = archetype;
+            curEntity->archetypeArrayIndex = archetypeEntityCount++;
+            *output = curEntity;
+            output++;
+        }
+        entitiesEnd += runLength;
+        count -= runLength;
+    }
+
+    // Update the count of entities of this archetype
+    archetypeEntityCounts[archetypeIndex] = archetypeEntityCount;
+}
+
+Entity *createEntity(archetype_t archetype)
+{
+    // The index of this archetype
+    int archetypeIndex = getArchetypeIndex(archetype);
+    Entity *curEntity;
+    // The arraylist for this archetype
+    MultiArrayList *archetypeList = &archetypeArrays[archetypeIndex];
+    
+    // Allocate the components for the new entity
+    multiarraylist_alloccount(archetypeList, 1);
+
+    MultiArrayListBlock* endBlock = archetypeList->end;
+    Entity** block_entry = reinterpret_cast<Entity**>(reinterpret_cast<uintptr_t>(endBlock) + sizeof(MultiArrayListBlock) + sizeof(Entity*) * (endBlock->numElements - 1));
+
+    if (numGaps)
+    {
+        curEntity = popGap();
+    }
+    else
+    {
+        curEntity = appendEntity();
+    }
+
+    bumpGeneration(curEntity);
+    *block_entry = curEntity;
+    curEntity->archetype = archetype;
+    curEntity->archetypeArrayIndex = archetypeEntityCounts[archetypeIndex];
+
+    archetypeEntityCounts[archetypeIndex]++;
+    numEntities++;
+
+    return curEntity;
+}
+
+void deleteEntity(Entity *e)
+{
+    // The index of this archetype
+    int archetypeIndex = getArchetypeIndex(e->archetype);
+    --archetypeEntityCounts[archetypeIndex];
+    // Entity *curEntity;
+
+    multiarraylist_delete(&archetypeArrays[archetypeIndex], e->archetypeArrayIndex);
+
+    // Ugly linear search over all entities to update the archetype array index of the entity that was moved in the delete
+    // e->archetypeArrayIndex = 
+    // TODO keep the entity list sorted?
+    // for (curEntity = &allEntities[0]; curEntity != &allEntities[entitiesEnd]; curEntity++)
+    // {
+    //     if (curEntity->archetypeArrayIndex == newLength)
+    //     {
+    //         curEntity->archetypeArrayIndex = e->archetypeArrayIndex;
+    //         break;
+    //     }
+    // }
+    
+    // Release the deleted entity's slot
+    freeEntitySlot(e);
+}
+
+// Packs an entity's archetype index and its index in the archetype's arraylist into a key that sorts by both in that order
+// Used to group batched deletions and migrations by archetype
+// Every entity fits in 16 bits of index since there can't be more than 0x10000 of them
+uint32_t getEntityKey(Entity *e)
+{
+    return (getArchetypeIndex(e->archetype) << 16) | e->archetypeArrayIndex;
+}
+
+// Deletes every entity given by the keys, sorting them so each archetype's entities can be removed in one batch
+// The keys are overwritten in the process
+void deleteEntityKeys(uint32_t *keys, int count)
+{
+    int groupStart, groupEnd;
+
+    std::sort(keys, keys + count);
+    count = std::unique(keys, keys + count) - keys;
+
+    for (groupStart = 0; groupStart < count; groupStart = groupEnd)
+    {
+        int archetypeIndex = keys[groupStart] >> 16;
+        MultiArrayList *arr = &archetypeArrays[archetypeIndex];
+
+        // Release the slot of every entity in this archetype being deleted and strip the keys down to array indices
+        for (groupEnd = groupStart; groupEnd < count && (int)(keys[groupEnd] >> 16) == archetypeIndex; groupEnd++)
+        {
+            size_t blockIndex;
+            keys[groupEnd] &= 0xFFFF;
+            MultiArrayListBlock *block = multiarraylist_get_block(arr, keys[groupEnd], &blockIndex);
+            freeEntitySlot(multiarraylist_get_block_entity_pointers(block)[blockIndex]);
+        }
+
+        archetypeEntityCounts[archetypeIndex] -= groupEnd - groupStart;
+        multiarraylist_delete_sorted(arr, &keys[groupStart], groupEnd - groupStart);
+    }
+}
+
+void deleteEntities(Entity **entities, int count)
+{
+    int i;
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    uint32_t *keys = static_cast<uint32_t*>(allocRegion(count * sizeof(uint32_t), ALLOC_ECS));
+    for (i = 0; i < count; i++)
+    {
+        keys[i] = getEntityKey(entities[i]);
+    }
+    deleteEntityKeys(keys, count);
+    freeAlloc(keys);
+}
+
+// Moves every entity given by the keys into the archetype made by adding and removing the given components from its current one
+// The keys are overwritten in the process
+void migrateEntityKeys(uint32_t *keys, int count, archetype_t addMask, archetype_t removeMask)
+{
+    int groupStart, groupEnd, i;
+
+    std::sort(keys, keys + count);
+    count = std::unique(keys, keys + count) - keys;
+
+    for (groupStart = 0; groupStart < count; groupStart = groupEnd)
+    {
+        int srcArchetypeIndex = keys[groupStart] >> 16;
+        archetype_t srcArchetype = currentArchetypes[srcArchetypeIndex];
+        archetype_t dstArchetype = (srcArchetype | addMask) & ~removeMask;
+
+        // Strip this archetype's keys down to array indices
+        for (groupEnd = groupStart; groupEnd < count && (int)(keys[groupEnd] >> 16) == srcArchetypeIndex; groupEnd++)
+        {
+            keys[groupEnd] &= 0xFFFF;
+        }
+
+        if (dstArchetype == srcArchetype || dstArchetype == 0)
+        {
+            continue;
+        }
+
+        int numMoved = groupEnd - groupStart;
+        int dstArchetypeIndex = getArchetypeIndex(dstArchetype);
+        MultiArrayList *src = &archetypeArrays[srcArchetypeIndex];
+        MultiArrayList *dst = &archetypeArrays[dstArchetypeIndex];
+        size_t dstStart = archetypeEntityCounts[dstArchetypeIndex];
+
+        // Append the entities to the destination and copy their components over
+        multiarraylist_alloccount(dst, numMoved);
+        multiarraylist_copy_elements(dst, dstStart, src, &keys[groupStart], numMoved);
+
+        // Point the moved entities at their new location
+        for (i = 0; i < numMoved; i++)
+        {
+            size_t blockIndex;
+            MultiArrayListBlock *block = multiarraylist_get_block(dst, dstStart + i, &blockIndex);
+            Entity *moved = multiarraylist_get_block_entity_pointers(block)[blockIndex];
+            moved->archetype = dstArchetype;
+            moved->archetypeArrayIndex = dstStart + i;
+        }
+        archetypeEntityCounts[dstArchetypeIndex] += numMoved;
+
+        // Close the gaps the entities left in the source
+        archetypeEntityCounts[srcArchetypeIndex] -= numMoved;
+        multiarraylist_delete_sorted(src, &keys[groupStart], numMoved);
+    }
+}
+
+void addComponents(Entity *e, archetype_t components)
+{
+    uint32_t key = getEntityKey(e);
+    migrateEntityKeys(&key, 1, components, 0);
+}
+
+void removeComponents(Entity *e, archetype_t components)
+{
+    uint32_t key = getEntityKey(e);
+    migrateEntityKeys(&key, 1, 0, components);
+}
+
+// Builds the keys for a batch of entities and migrates them
+void migrateEntities(Entity **entities, int count, archetype_t addMask, archetype_t removeMask)
+{
+    int i;
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    uint32_t *keys = static_cast<uint32_t*>(allocRegion(count * sizeof(uint32_t), ALLOC_ECS));
+    for (i = 0; i < count; i++)
+    {
+        keys[i] = getEntityKey(entities[i]);
+    }
+    migrateEntityKeys(keys, count, addMask, removeMask);
+    freeAlloc(keys);
+}
+
+// Gets the ActiveState of an entity with the Deactivatable component
+ActiveState *getActiveState(Entity *e)
+{
+    MultiArrayList *arr = &archetypeArrays[getArchetypeIndex(e->archetype)];
+    size_t blockIndex;
+    MultiArrayListBlock *block = multiarraylist_get_block(arr, e->archetypeArrayIndex, &blockIndex);
+    return reinterpret_cast<ActiveState*>(reinterpret_cast<uint8_t*>(block) + multiarraylist_get_component_offset(arr, Component_Deactivatable)) + blockIndex;
+}
+
+// Moves each of the given Deactivatable entities into or out of its inactive archetype to match its deactivated flag,
+// deleting the ones being deactivated that have delete_on_deactivate set
+// Duplicate entries are allowed
+void syncActiveStates(Entity **entities, int count)
+{
+    int i;
+    int numDeactivated = 0, numActivated = 0, numDeleted = 0;
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    Entity **sorted = static_cast<Entity**>(allocRegion(3 * count * sizeof(Entity*), ALLOC_ECS));
+    Entity **deactivated = sorted;
+    Entity **activated = sorted + count;
+    Entity **deleted = sorted + 2 * count;
+
+    for (i = 0; i < count; i++)
+    {
+        Entity *e = entities[i];
+        if (!(e->archetype & Bit_Deactivatable))
+        {
+            continue;
+        }
+        ActiveState *state = getActiveState(e);
+        bool inactive = (e->archetype & Bit_Inactive) != 0;
+        if (state->deactivated && !inactive)
+        {
+            if (state->delete_on_deactivate)
+            {
+                deleted[numDeleted++] = e;
+            }
+            else
+            {
+                deactivated[numDeactivated++] = e;
+            }
+        }
+        else if (!state->deactivated && inactive)
+        {
+            activated[numActivated++] = e;
+        }
+    }
+
+    if (numDeleted != 0)
+    {
+        deleteEntities(deleted, numDeleted);
+    }
+    if (numDeactivated != 0)
+    {
+        migrateEntities(deactivated, numDeactivated, Bit_Inactive, 0);
+    }
+    if (numActivated != 0)
+    {
+        migrateEntities(activated, numActivated, 0, Bit_Inactive);
+    }
+    freeAlloc(sorted);
+}
+
+void setEntitiesActive(Entity **entities, int count, bool active)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (entities[i]->archetype & Bit_Deactivatable)
+        {
+            getActiveState(entities[i])->deactivated = !active;
+        }
+    }
+    syncActiveStates(entities, count);
+}
+
+void deactivateEntities(Entity **entities, int count)
+{
+    setEntitiesActive(entities, count, false);
+}
+
+void activateEntities(Entity **entities, int count)
+{
+    setEntitiesActive(entities, count, true);
+}
+
+void deactivateEntity(Entity *e)
+{
+    setEntitiesActive(&e, 1, false);
+}
+
+void activateEntity(Entity *e)
+{
+    setEntitiesActive(&e, 1, true);
+}
+
+void syncArchetypeActiveStates(archetype_t archetype)
+{
+    if (!(archetype & Bit_Deactivatable) || (archetype & Bit_Inactive))
+    {
+        return;
+    }
+    int archetypeIndex = getArchetypeIndex(archetype);
+    MultiArrayList *arr = &archetypeArrays[archetypeIndex];
+    size_t stateOffset = multiarraylist_get_component_offset(arr, Component_Deactivatable);
+    int numToSync = 0;
+    Entity **toSync;
+
+    if (archetypeEntityCounts[archetypeIndex] == 0)
+    {
+        return;
+    }
+    toSync = static_cast<Entity**>(allocRegion(archetypeEntityCounts[archetypeIndex] * sizeof(Entity*), ALLOC_ECS));
+
+    // Collect every deactivated entity first, since moving them out reorders the arraylist
+    for (MultiArrayListBlock *block = arr->start; block != nullptr; block = block->next)
+    {
+        ActiveState *states = reinterpret_cast<ActiveState*>(reinterpret_cast<uint8_t*>(block) + stateOffset);
+        Entity **entities = multiarraylist_get_block_entity_pointers(block);
+        for (size_t i = 0; i < block->numElements; i++)
+        {
+            if (states[i].deactivated)
+            {
+                toSync[numToSync++] = entities[i];
+            }
+        }
+    }
+
+    syncActiveStates(toSync, numToSync);
+    freeAlloc(toSync);
+}
+
+void addComponents(Entity **entities, int count, archetype_t components)
+{
+    migrateEntities(entities, count, components, 0);
+}
+
+void removeComponents(Entity **entities, int count, archetype_t components)
+{
+    migrateEntities(entities, count, 0, components);
+}
+
+void deleteEntityIndex(int index)
+{
+    // The archetype and array list index for this entity
+    Entity *e = getEntityFromIndex(index);
+    archetype_t archetype = e->archetype;
+    size_t archetypeArrayIndex = e->archetypeArrayIndex;
+    // The index of this archetype
+    int archetypeIndex = getArchetypeIndex(archetype);
+    --archetypeEntityCounts[archetypeIndex];
+    // Entity *curEntity;
+
+    // Delete this entity's component info
+    multiarraylist_delete(&archetypeArrays[archetypeIndex], archetypeArrayIndex);
+
+    // Ugly linear search over all entities to update the archetype array index of the entity that was moved in the delete
+    // TODO keep the entity list sorted?
+    // for (curEntity = &allEntities[0]; curEntity != &allEntities[entitiesEnd]; curEntity++)
+    // {
+    //     if (curEntity->archetypeArrayIndex == newLength)
+    //     {
+    //         curEntity->archetypeArrayIndex = archetypeArrayIndex;
+    //         break;
+    //     }
+    // }
+    
+    // Release the deleted entity's slot
+    freeEntitySlot(e);
+}
+
 void createEntities(archetype_t archetype, int count)
 {
     // // The index of this archetype
@@ -454,7 +1345,73 @@ void createEntities(archetype_t archetype, int count)
     createEntitiesCallback(archetype, nullptr, count, nullptr);
 }
 
+// Fills count elements of a component array one element at a time, with a copy size the compiler can turn into plain stores
+template <size_t Size>
+void fillComponentArrayFixed(uint8_t *dest, const void *value, size_t count)
+{
+    uint8_t element[Size];
+    memcpy(element, value, Size);
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(dest + i * Size, element, Size);
+    }
+}
+
+// Fills count elements of a component array with copies of the value
+// The common component sizes are copied an element at a time, since a block only holds a few dozen elements and that
+// beats making memcpy calls. Any other size doubles the copied range each time, so the whole array takes a logarithmic
+// number of memcpy calls.
+void fillComponentArray(void *array, const void *value, size_t componentSize, size_t count)
+{
+    uint8_t *dest = static_cast<uint8_t*>(array);
+    size_t totalSize = componentSize * count;
+    size_t filled;
+
+    // Also covers tags, which have no data to copy
+    if (totalSize == 0)
+    {
+        return;
+    }
+
+    switch (componentSize)
+    {
+        case 2:
+            fillComponentArrayFixed<2>(dest, value, count);
+            return;
+        case 4:
+            fillComponentArrayFixed<4>(dest, value, count);
+            return;
+        case 6:
+            fillComponentArrayFixed<6>(dest, value, count);
+            return;
+        case 8:
+            fillComponentArrayFixed<8>(dest, value, count);
+            return;
+        case 12:
+            fillComponentArrayFixed<12>(dest, value, count);
+            return;
+    }
+
+    memcpy(dest, value, componentSize);
+    for (filled = componentSize; filled * 2 <= totalSize; filled *= 2)
+    {
+        memcpy(dest + filled, dest, filled);
+    }
+    memcpy(dest + filled, dest, totalSize - filled);
+}
+
 void createEntitiesCallback(archetype_t archetype, void *arg, int count, EntityArrayCallback callback)
+{
+    createEntitiesImpl(archetype, nullptr, arg, count, callback);
+}
+
+void spawnPrefab(const ecs::Prefab& prefab, int count, void *arg, EntityArrayCallback callback)
+{
+    createEntitiesImpl(prefab.archetype(), &prefab, arg, count, callback);
+}
+
+// Creates the entities for createEntitiesCallback and spawnPrefab, filling in every component from the prefab if there is one
+void createEntitiesImpl(archetype_t archetype, const ecs::Prefab *prefab, void *arg, int count, EntityArrayCallback callback)
 {
     // The index of this archetype
     int archetypeIndex = getArchetypeIndex(archetype);
@@ -465,19 +1422,18 @@ void createEntitiesCallback(archetype_t archetype, void *arg, int count, EntityA
 
     // Iteration values
     // Offsets for each component in the arraylist blocks
-    auto componentOffsets = std::unique_ptr<size_t[]>(new size_t[numComponents]);
+    size_t componentOffsets[NUM_COMPONENT_TYPES];
     // Sizes of each component in the arraylist blocks
-    auto componentSizes = std::unique_ptr<size_t[]>(new size_t[numComponents]);
-    // Array of pointers to each entity created
-    auto entity_pointers = std::unique_ptr<Entity*[]>(new Entity*[count]);
+    size_t componentSizes[NUM_COMPONENT_TYPES];
+    // Prefab's value for each component, looked up once rather than once per block
+    const uint8_t *prefabValues[NUM_COMPONENT_TYPES];
     // The block being iterated through
     MultiArrayListBlock *curBlock = archetypeList->end;
     // Number of elements in the current block before allocating more
     uint32_t startingElementCount = curBlock->numElements;
     
-    // Allocate the number of entities given of the archetype given
-    allocEntities(archetype, count, entity_pointers.get());
     // Allocate the requested number of entities for the given archetype
+    // The entities themselves are allocated one block at a time below, straight into each block's entity pointers
     multiarraylist_alloccount(archetypeList, count);
 
     // Find all the components in this archetype and get their offsets and sizes for iteration
@@ -488,184 +1444,844 @@ void createEntitiesCallback(archetype_t archetype, void *arg, int count, EntityA
         archetype_t componentBits = archetype;
         while (componentBits)
         {
-            if (componentBits & 1)
+            if (componentBits & 1)
+            {
+                componentOffsets[numComponentsFound] = multiarraylist_get_component_offset(archetypeList, componentIndex);
+                componentSizes[numComponentsFound] = g_componentSizes[componentIndex];
+                if (prefab)
+                {
+                    prefabValues[numComponentsFound] = prefab->componentData(numComponentsFound);
+                }
+                numComponentsFound++;
+            }
+            componentBits >>= 1;
+            componentIndex++;
+        }
+    }
+
+    // Call the provided callback for modified or new block in the list
+    {
+        int i;
+        void *componentArrays[NUM_COMPONENT_TYPES + 1];
+
+        // Skip callbacks for the previous end block if it was already full
+        if (startingElementCount < archetypeList->elementCount)
+        {
+            componentArrays[0] = multiarraylist_get_block_entity_pointers(curBlock) + startingElementCount;
+            // Call the callback for the original block, which was modified
+            for (i = 0; i < numComponents; i++)
+            {
+                componentArrays[i + 1] = (void*)((uintptr_t)curBlock + componentOffsets[i] + componentSizes[i] * startingElementCount);
+            }
+
+            // Allocate the new entities into the 0th component array
+            allocEntities(archetype, curBlock->numElements - startingElementCount, (Entity**)componentArrays[0]);
+
+            if (prefab)
+            {
+                for (i = 0; i < numComponents; i++)
+                {
+                    fillComponentArray(componentArrays[i + 1], prefabValues[i], componentSizes[i], curBlock->numElements - startingElementCount);
+                }
+            }
+
+            if (callback)
+            {
+                callback(curBlock->numElements - startingElementCount, arg, componentArrays);
+            }
+        }
+        curBlock = curBlock->next;
+
+        // Call the callback for any following blocks, which were allocated
+        while (curBlock)
+        {
+            componentArrays[0] = multiarraylist_get_block_entity_pointers(curBlock);
+            for (i = 0; i < numComponents; i++)
+            {
+                componentArrays[i + 1] = (void*)((uintptr_t)curBlock + componentOffsets[i]);
+            }
+            
+            // Allocate the new entities into the 0th component array
+            allocEntities(archetype, curBlock->numElements, (Entity**)componentArrays[0]);
+
+            if (prefab)
+            {
+                for (i = 0; i < numComponents; i++)
+                {
+                    fillComponentArray(componentArrays[i + 1], prefabValues[i], componentSizes[i], curBlock->numElements);
+                }
+            }
+
+            if (callback)
+            {
+                callback(curBlock->numElements, arg, componentArrays);
+            }
+            curBlock = curBlock->next;
+        }
+    }
+}
+
+void getArchetypeBlockLayout(archetype_t archetype, size_t *elementCountOut, size_t *blockChunksOut)
+{
+    MultiArrayList *archetypeList = &archetypeArrays[getArchetypeIndex(archetype)];
+    *elementCountOut = archetypeList->elementCount;
+    *blockChunksOut = archetypeList->blockChunks;
+}
+
+bool adoptEntityBlocks(archetype_t archetype, MultiArrayListBlock **blocks, int numBlocks)
+{
+    int archetypeIndex = getArchetypeIndex(archetype);
+    MultiArrayList *archetypeList = &archetypeArrays[archetypeIndex];
+
+    if (archetypeEntityCounts[archetypeIndex] != 0 || numBlocks == 0)
+    {
+        return false;
+    }
+
+    multiarraylist_adopt_blocks(archetypeList, blocks, numBlocks);
+
+    // The entities are allocated in order, so each block's entity pointers can be written straight into it
+    for (int i = 0; i < numBlocks; i++)
+    {
+        allocEntities(archetype, blocks[i]->numElements, multiarraylist_get_block_entity_pointers(blocks[i]));
+    }
+    return true;
+}
+
+void getEntityComponents(Entity *entity, void **componentArrayOut, archetype_t readOnlyMask)
+{
+    archetype_t archetype = entity->archetype;
+    int archetypeIndex = getArchetypeIndex(archetype);
+    MultiArrayList *archetypeArray = &archetypeArrays[archetypeIndex];
+    size_t blockElementCount = archetypeArray->elementCount;
+    size_t arrayIndex;
+    MultiArrayListBlock *curBlock = multiarraylist_get_block(archetypeArray, entity->archetypeArrayIndex, &arrayIndex);
+    int componentIndex = 0; // Index of the component in all components
+    int componentArrayIndex = 1; // Index of the component in those in the archetype
+
+    // Keep track of the position of the current component's array in the block
+    uintptr_t block_offset = sizeof(Entity*) * blockElementCount + sizeof(MultiArrayListBlock);
+
+    componentArrayOut[0] = reinterpret_cast<Entity**>((uintptr_t)curBlock + sizeof(Entity*) * arrayIndex + sizeof(MultiArrayListBlock));
+    multiarraylist_mark_changed(curBlock, archetype & ~readOnlyMask);
+
+    while (archetype)
+    {
+        if (archetype & 0x01)
+        {
+            size_t cur_component_size = g_componentSizes[componentIndex];
+            componentArrayOut[componentArrayIndex] = (void *)(
+                (uintptr_t)curBlock +
+                block_offset        + // go to the start of the component array for this component
+                cur_component_size * arrayIndex), // index the component array
+            block_offset += cur_component_size * blockElementCount;
+            componentArrayIndex++;
+        }
+        componentIndex++;
+        archetype >>= 1;
+    }
+}
+
+// Fills in the memory info for the archetype at the given index
+void fillArchetypeMemoryInfo(int archetypeIndex, ArchetypeMemoryInfo *info)
+{
+    MultiArrayList *arr = &archetypeArrays[archetypeIndex];
+    size_t blockSize = multiarraylist_block_size(arr);
+    size_t numBlocks = arr->numBlocks + (arr->spare != nullptr ? 1 : 0);
+    size_t slotsFree = numBlocks * arr->elementCount - archetypeEntityCounts[archetypeIndex];
+
+    info->archetype = arr->archetype;
+    info->numEntities = archetypeEntityCounts[archetypeIndex];
+    info->elementCount = arr->elementCount;
+    info->blockSize = blockSize;
+    info->numBlocks = numBlocks;
+    info->bytesAllocated = numBlocks * blockSize;
+    info->bytesPadding = numBlocks * (blockSize - sizeof(MultiArrayListBlock) - arr->elementCount * arr->totalElementSize);
+    info->bytesUnused = slotsFree * arr->totalElementSize;
+}
+
+int getArchetypeMemoryInfo(ArchetypeMemoryInfo *infoOut, int maxCount)
+{
+    int archetypeIndex;
+    int count = std::min(maxCount, numArchetypes);
+    for (archetypeIndex = 0; archetypeIndex < count; archetypeIndex++)
+    {
+        fillArchetypeMemoryInfo(archetypeIndex, &infoOut[archetypeIndex]);
+    }
+    return count;
+}
+
+void printArchetypeMemoryReport(void)
+{
+    int archetypeIndex;
+    uint32_t totalAllocated = 0;
+    uint32_t totalWasted = 0;
+    debug_printf("archetype entities per_block block_size blocks allocated padding unused\n");
+    for (archetypeIndex = 0; archetypeIndex < numArchetypes; archetypeIndex++)
+    {
+        ArchetypeMemoryInfo info;
+        fillArchetypeMemoryInfo(archetypeIndex, &info);
+        debug_printf("%08X %d %d %d %d %d %d %d\n", info.archetype, info.numEntities, info.elementCount, info.blockSize,
+            info.numBlocks, info.bytesAllocated, info.bytesPadding, info.bytesUnused);
+        totalAllocated += info.bytesAllocated;
+        totalWasted += info.bytesPadding + info.bytesUnused;
+    }
+    debug_printf("total allocated %d wasted %d\n", totalAllocated, totalWasted);
+}
+
+ecs::Stats ecs::stats(ArchetypeStats *archetypesOut, int maxArchetypes)
+{
+    int archetypeIndex;
+    Stats ret{};
+
+    for (archetypeIndex = 0; archetypeIndex < numArchetypes; archetypeIndex++)
+    {
+        ArchetypeMemoryInfo info;
+        fillArchetypeMemoryInfo(archetypeIndex, &info);
+        ret.numArchetypes++;
+        ret.numOccupiedArchetypes += info.numEntities != 0;
+        ret.numEntities += info.numEntities;
+        ret.numBlocks += info.numBlocks;
+        ret.bytesAllocated += info.bytesAllocated;
+        ret.bytesWasted += info.bytesPadding + info.bytesUnused;
+
+        if (archetypeIndex < maxArchetypes)
+        {
+            ArchetypeStats *cur = &archetypesOut[archetypeIndex];
+            size_t slots = info.numBlocks * info.elementCount;
+            cur->archetype = info.archetype;
+            cur->numEntities = info.numEntities;
+            cur->numBlocks = info.numBlocks;
+            cur->elementCount = info.elementCount;
+            cur->bytesPerRow = archetypeArrays[archetypeIndex].totalElementSize;
+            cur->fillRatio = slots != 0 ? static_cast<float>(info.numEntities) / static_cast<float>(slots) : 0.0f;
+            cur->bytesWasted = info.bytesPadding + info.bytesUnused;
+        }
+    }
+
+    ret.entitySlots = entitiesEnd;
+    ret.entityGaps = numGaps;
+    ret.entityTableBytes = numEntityChunks * mem_block_size;
+
+    EntityCommandBuffer::forEach(entityCommands.begin(), entityCommands.end(),
+        [&ret](EntityCommand *command)
+        {
+            if (command->type == EntityCommandType::Create)
             {
-                componentOffsets[numComponentsFound] = multiarraylist_get_component_offset(archetypeList, componentIndex);
-                componentSizes[numComponentsFound++] = g_componentSizes[componentIndex];
+                ret.queuedCreations += reinterpret_cast<CreateEntitiesCommand*>(command)->count;
             }
-            componentBits >>= 1;
-            componentIndex++;
+            else if (command->type == EntityCommandType::Delete)
+            {
+                ret.queuedDeletions++;
+            }
+            else
+            {
+                ret.queuedOther++;
+            }
+        });
+    ret.commandBytes = entityCommands.bytesUsed();
+    ret.commandBufferBytes = entityCommands.bytesAllocated();
+
+    return ret;
+}
+
+// Checks if the given components were written in any of an arraylist's blocks after the given version
+bool arrayChangedSince(MultiArrayList *arr, archetype_t components, uint32_t version)
+{
+    for (MultiArrayListBlock *curBlock = arr->start; curBlock != nullptr; curBlock = curBlock->next)
+    {
+        if (multiarraylist_changed_since(curBlock, components, version))
+        {
+            return true;
         }
     }
+    return false;
+}
 
-    // Call the provided callback for modified or new block in the list
+void groupEntities(EntityQuery& query, int componentType, int budget)
+{
+    archetype_t keyBit = 1U << componentType;
+    size_t keySize = g_componentSizes[componentType];
+
+    query.update();
+
+    for (const EntityQueryMatch& match : query)
     {
-        int i;
-        auto componentArrays = std::unique_ptr<void*[]>(new void*[numComponents + 1]);
-        Entity **cur_entity = entity_pointers.get();
+        MultiArrayList *arr = match.arr;
+        ArchetypeGrouping *grouping = &archetypeGroupings[arr - archetypeArrays];
+        size_t length = multiarraylist_length(arr);
+        size_t keyOffset = multiarraylist_get_component_offset(arr, componentType);
+        size_t cursor;
 
-        // Skip callbacks for the previous end block if it was already full
-        if (startingElementCount < archetypeList->elementCount)
+        if (budget <= 0)
         {
-            componentArrays[0] = multiarraylist_get_block_entity_pointers(curBlock) + startingElementCount;
-            // Call the callback for the original block, which was modified
-            for (i = 0; i < numComponents; i++)
+            break;
+        }
+
+        if (grouping->keyBit != keyBit)
+        {
+            *grouping = {};
+            grouping->keyBit = keyBit;
+        }
+        // Skip archetypes that are already grouped, unless one of their keys has been written since
+        if (grouping->groupedVersion != 0)
+        {
+            if (!arrayChangedSince(arr, keyBit, grouping->groupedVersion))
             {
-                componentArrays[i + 1] = (void*)((uintptr_t)curBlock + componentOffsets[i] + componentSizes[i] * startingElementCount);
+                continue;
             }
+            grouping->groupedVersion = 0;
+        }
 
-            // Copy the entity pointers into the 0th component array
-            std::copy_n(cur_entity, curBlock->numElements - startingElementCount, (Entity**)componentArrays[0]);
-            cur_entity += curBlock->numElements - startingElementCount;
+        auto key = [arr, keyOffset, keySize](size_t index)
+        {
+            size_t blockIndex;
+            MultiArrayListBlock *block = multiarraylist_get_block(arr, index, &blockIndex);
+            return reinterpret_cast<const uint8_t*>(block) + keyOffset + keySize * blockIndex;
+        };
 
-            if (callback)
-            {
-                callback(curBlock->numElements - startingElementCount, arg, componentArrays.get());
-            }
+        cursor = grouping->cursor;
+        if (cursor == 0)
+        {
+            grouping->passVersion = takeChangeVersion();
+            grouping->passSwapped = false;
+            grouping->scan = 1;
+            cursor = 1;
         }
-        curBlock = curBlock->next;
 
-        // Call the callback for any following blocks, which were allocated
-        while (curBlock)
+        // The entities before the cursor form runs of equal keys, and no entity past the cursor has the key of any run
+        // but the last. Each step either extends the last run with the entity at the cursor, or finds the next entity
+        // with the last run's key and swaps it into the cursor. If there is none left, the entity at the cursor starts a new run.
+        // The search for the next entity with the run's key picks up after the last one found, since everything it passed
+        // over has a different key, so each run only takes one scan over the rest of the entities.
+        size_t scan = std::max<size_t>(grouping->scan, cursor);
+        while (cursor < length && budget > 0)
         {
-            componentArrays[0] = multiarraylist_get_block_entity_pointers(curBlock);
-            for (i = 0; i < numComponents; i++)
+            const uint8_t *runKey = key(cursor - 1);
+            size_t searchStart = memcmp(key(cursor), runKey, keySize) == 0 ? cursor : scan;
+            size_t search;
+            for (search = searchStart; search < length; search++)
             {
-                componentArrays[i + 1] = (void*)((uintptr_t)curBlock + componentOffsets[i]);
+                if (memcmp(key(search), runKey, keySize) == 0)
+                {
+                    break;
+                }
             }
-            
-            // Copy the entity pointers into the 0th component array
-            std::copy_n(cur_entity, curBlock->numElements, (Entity**)componentArrays[0]);
-            cur_entity += curBlock->numElements;
+            budget -= search - searchStart + 1;
+            if (search == length)
+            {
+                // The run is finished, so the entity at the cursor starts the next one
+                scan = cursor + 1;
+            }
+            else
+            {
+                if (search != cursor)
+                {
+                    multiarraylist_swap(arr, cursor, search);
+                    grouping->passSwapped = true;
+                }
+                scan = std::max(search, cursor) + 1;
+            }
+            cursor++;
+        }
+        grouping->scan = scan;
 
-            if (callback)
+        if (cursor >= length)
+        {
+            // A pass that didn't move anything and ran without anything else writing the keys shows the archetype is grouped
+            if (!grouping->passSwapped && !arrayChangedSince(arr, keyBit, grouping->passVersion))
             {
-                callback(curBlock->numElements, arg, componentArrays.get());
+                grouping->groupedVersion = takeChangeVersion();
             }
-            curBlock = curBlock->next;
+            cursor = 0;
         }
+        grouping->cursor = cursor;
     }
 }
 
-void getEntityComponents(Entity *entity, void **componentArrayOut)
+void markEntityChanged(Entity *e, archetype_t components)
 {
-    archetype_t archetype = entity->archetype;
-    int archetypeIndex = getArchetypeIndex(archetype);
-    MultiArrayList *archetypeArray = &archetypeArrays[archetypeIndex];
-    size_t blockElementCount = archetypeArray->elementCount;
-    size_t arrayIndex = entity->archetypeArrayIndex;
-    MultiArrayListBlock *curBlock = archetypeArray->start;
-    int componentIndex = 0; // Index of the component in all components
-    int componentArrayIndex = 1; // Index of the component in those in the archetype
+    size_t blockIndex;
+    MultiArrayList *arr = &archetypeArrays[getArchetypeIndex(e->archetype)];
+    multiarraylist_mark_changed(multiarraylist_get_block(arr, e->archetypeArrayIndex, &blockIndex), components & e->archetype);
+}
 
-    while (arrayIndex >= blockElementCount)
+Entity *findEntity(archetype_t archetype, size_t archetypeArrayIndex)
+{
+    // Blocks keep a pointer to each of their entities, so there's no need to search the entity table
+    uint16_t *slot = findArchetypeSlot(archetype);
+    if (*slot == 0 || archetypeArrayIndex >= static_cast<size_t>(archetypeEntityCounts[*slot - 1]))
     {
-        curBlock = curBlock->next;
-        arrayIndex -= blockElementCount;
+        return nullptr;
     }
+    size_t blockIndex;
+    MultiArrayListBlock *block = multiarraylist_get_block(&archetypeArrays[*slot - 1], archetypeArrayIndex, &blockIndex);
+    return multiarraylist_get_block_entity_pointers(block)[blockIndex];
+}
 
-    // Keep track of the position of the current component's array in the block
-    uintptr_t block_offset = sizeof(Entity*) * blockElementCount + sizeof(MultiArrayListBlock);
+// Frees every archetype's arraylist and empties the archetype registry
+void clearArchetypeRegistry()
+{
+    int archetypeIndex;
+    for (archetypeIndex = 0; archetypeIndex < numArchetypes; archetypeIndex++)
+    {
+        MultiArrayList *curArr = &archetypeArrays[archetypeIndex];
 
-    componentArrayOut[0] = reinterpret_cast<Entity**>((uintptr_t)curBlock + sizeof(Entity*) * arrayIndex + sizeof(MultiArrayListBlock));
+        multiarraylist_free(curArr);
+        memset(curArr, 0, sizeof(MultiArrayList));
+        archetypeEntityCounts[archetypeIndex] = 0;
+        currentArchetypes[archetypeIndex] = 0;
+    }
+    numArchetypes = 0;
+    archetypeRegistryResets++;
+    memset(archetypeTable, 0, sizeof(archetypeTable));
+}
 
-    while (archetype)
+uint32_t getWorldResets(void)
+{
+    return worldResets;
+}
+
+void deleteAllEntities(void)
+{
+    int chunkIndex;
+    // Anything queued refers to entities that are about to be gone
+    clear_entity_queues();
+    clearArchetypeRegistry();
+    worldResets++;
+    // Release the entity table, raising the starting generation for the next chunks past every generation handed out so far
+    for (chunkIndex = 0; chunkIndex < numEntityChunks; chunkIndex++)
     {
-        if (archetype & 0x01)
-        {
-            size_t cur_component_size = g_componentSizes[componentIndex];
-            componentArrayOut[componentArrayIndex] = (void *)(
-                (uintptr_t)curBlock +
-                block_offset        + // go to the start of the component array for this component
-                cur_component_size * arrayIndex), // index the component array
-            block_offset += cur_component_size * blockElementCount;
-            componentArrayIndex++;
-        }
-        componentIndex++;
-        archetype >>= 1;
+        EntityChunk *curChunk = entityChunks[chunkIndex];
+        chunkStartGeneration = std::max(chunkStartGeneration, *std::max_element(curChunk->generations, curChunk->generations + entities_per_chunk));
+        freeAlloc(curChunk);
+        entityChunks[chunkIndex] = nullptr;
     }
+    numEntityChunks = 0;
+    numEntities = 0;
+    entitiesEnd = 0;
+    numGaps = 0;
+    firstGap = INT32_MAX;
 }
 
-Entity *findEntity(archetype_t archetype, size_t archetypeArrayIndex)
+// Everything in a snapshot other than the chunks and blocks themselves
+struct SnapshotHeader {
+    int numArchetypes;
+    int numEntityChunks;
+    int entitiesEnd;
+    int numEntities;
+    int numGaps;
+    int firstGap;
+    uint16_t chunkStartGeneration;
+    archetype_t archetypes[MAX_ARCHETYPES];
+    int archetypeEntityCounts[MAX_ARCHETYPES];
+    uint16_t archetypeNumBlocks[MAX_ARCHETYPES];
+};
+
+// Size of the header at the start of a snapshot's buffer, rounded up so the chunks and blocks after it are aligned
+constexpr size_t snapshot_header_size = ROUND_UP(sizeof(SnapshotHeader), 16);
+
+// A single entity table chunk or block stored in a snapshot
+struct ecs::Snapshot::Unit {
+    // Hash of the chunk or block's contents in the world when it was stored
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t size;
+    // The block that was stored and its element count at the time, nullptr for chunks
+    // A block that's still the same one, has the same count and hasn't been written since doesn't need hashing to compare it
+    const MultiArrayListBlock *block;
+    uint32_t numElements;
+};
+
+// Hashes a run of 32-bit words into the given hash, as two independent 32-bit lanes since 64-bit multiplies are slow on the N64
+uint64_t hashWords(uint64_t hash, const uint32_t *words, size_t count)
 {
-    Entity* curEntity;
+    uint32_t low = static_cast<uint32_t>(hash);
+    uint32_t high = static_cast<uint32_t>(hash >> 32);
+    for (size_t i = 0; i < count; i++)
+    {
+        low = (low ^ words[i]) * 16777619u;
+        high = (high ^ words[i]) * 2654435761u;
+        high = (high << 13) | (high >> 19);
+    }
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+constexpr uint64_t snapshot_hash_seed = 0x811C9DC5CBF29CE4ull;
+
+uint64_t hashEntityChunk(const EntityChunk *chunk)
+{
+    return hashWords(snapshot_hash_seed, reinterpret_cast<const uint32_t*>(chunk), sizeof(EntityChunk) / sizeof(uint32_t));
+}
+
+// Hashes a block's element count and arrays, leaving out the next pointer and change versions since those don't affect its contents
+uint64_t hashBlock(const MultiArrayListBlock *block, size_t blockSize)
+{
+    uint64_t hash = hashWords(snapshot_hash_seed, &block->numElements, 1);
+    return hashWords(hash, reinterpret_cast<const uint32_t*>(block + 1), (blockSize - sizeof(MultiArrayListBlock)) / sizeof(uint32_t));
+}
 
-    for (curEntity = &allEntities[0]; curEntity != &allEntities[entitiesEnd]; curEntity++)
+// Replaces the entity pointers of a block stored in a snapshot with their slot indices, so they can be pointed at
+// wherever the entity table chunks are when the snapshot is restored
+void storeBlockEntities(MultiArrayListBlock *storedBlock)
+{
+    Entity **entities = multiarraylist_get_block_entity_pointers(storedBlock);
+    uintptr_t *indices = reinterpret_cast<uintptr_t*>(entities);
+    for (size_t i = 0; i < storedBlock->numElements; i++)
     {
-        if (curEntity->archetype == archetype && curEntity->archetypeArrayIndex == archetypeArrayIndex)
-            return curEntity;
+        indices[i] = getEntityIndex(entities[i]);
     }
-    return nullptr;
 }
 
-void deleteAllEntities(void)
+void loadBlockEntities(MultiArrayListBlock *block)
 {
-    int archetypeIndex;
+    Entity **entities = multiarraylist_get_block_entity_pointers(block);
+    uintptr_t *indices = reinterpret_cast<uintptr_t*>(entities);
+    for (size_t i = 0; i < block->numElements; i++)
+    {
+        entities[i] = getEntityFromIndex(indices[i]);
+    }
+}
+
+void ecs::Snapshot::clear()
+{
+    if (buffer_ != nullptr)
+    {
+        freeAlloc(buffer_);
+    }
+    if (units_ != nullptr)
+    {
+        freeAlloc(units_);
+    }
+    buffer_ = nullptr;
+    units_ = nullptr;
+    size_ = capacity_ = bytesCopied_ = 0;
+    numUnits_ = unitCapacity_ = 0;
+}
+
+void ecs::snapshot(Snapshot& out)
+{
+    size_t numUnits = numEntityChunks;
+    size_t size = snapshot_header_size;
+    size_t unitIndex = 0;
+    size_t offset = snapshot_header_size;
+    // Units can only be skipped if they're at the same place in the buffer as last time
+    bool reuse = true;
+    int archetypeIndex, chunkIndex;
+
+    size += numEntityChunks * sizeof(EntityChunk);
     for (archetypeIndex = 0; archetypeIndex < numArchetypes; archetypeIndex++)
     {
-        MultiArrayList *curArr = &archetypeArrays[archetypeIndex];
-        MultiArrayListBlock *curBlock = curArr->start;
+        MultiArrayList *arr = &archetypeArrays[archetypeIndex];
+        numUnits += arr->numBlocks;
+        size += arr->numBlocks * multiarraylist_block_size(arr);
+    }
 
-        memset(curArr, 0, sizeof(MultiArrayList));
-        archetypeEntityCounts[archetypeIndex] = 0;
-        currentArchetypes[archetypeIndex] = 0;
-        while (curBlock)
+    // Grow the buffer and unit table if needed, which loses everything already stored in them
+    if (size > out.capacity_)
+    {
+        if (out.buffer_ != nullptr)
+        {
+            freeAlloc(out.buffer_);
+        }
+        out.buffer_ = static_cast<uint8_t*>(allocRegion(size, ALLOC_ECS));
+        out.capacity_ = ROUND_UP(size, mem_block_size);
+        reuse = false;
+    }
+    if (numUnits > out.unitCapacity_)
+    {
+        if (out.units_ != nullptr)
+        {
+            freeAlloc(out.units_);
+        }
+        out.unitCapacity_ = std::max(ROUND_UP(numUnits * sizeof(Snapshot::Unit), mem_block_size) / sizeof(Snapshot::Unit), numUnits);
+        out.units_ = static_cast<Snapshot::Unit*>(allocRegion(out.unitCapacity_ * sizeof(Snapshot::Unit), ALLOC_ECS));
+        reuse = false;
+    }
+
+    out.bytesCopied_ = snapshot_header_size;
+    // Stores one chunk or block, unless the unit in the same place of the previous snapshot already holds the same contents
+    // Returns the copy in the buffer if it was stored, or nullptr if it was skipped
+    auto storeUnit = [&](const void *data, size_t unitSize, uint64_t hash, const MultiArrayListBlock *block) -> uint8_t*
+    {
+        Snapshot::Unit *unit = &out.units_[unitIndex];
+        bool unchanged = reuse && unitIndex < out.numUnits_ && unit->offset == offset && unit->size == unitSize && unit->hash == hash;
+        uint8_t *stored = out.buffer_ + offset;
+        unit->hash = hash;
+        unit->offset = offset;
+        unit->size = unitSize;
+        unit->block = block;
+        unit->numElements = block != nullptr ? block->numElements : 0;
+        unitIndex++;
+        offset += unitSize;
+        if (unchanged)
+        {
+            return nullptr;
+        }
+        memcpy(stored, data, unitSize);
+        out.bytesCopied_ += unitSize;
+        return stored;
+    };
+
+    for (chunkIndex = 0; chunkIndex < numEntityChunks; chunkIndex++)
+    {
+        storeUnit(entityChunks[chunkIndex], sizeof(EntityChunk), hashEntityChunk(entityChunks[chunkIndex]), nullptr);
+    }
+
+    SnapshotHeader *header = reinterpret_cast<SnapshotHeader*>(out.buffer_);
+    header->numArchetypes = numArchetypes;
+    header->numEntityChunks = numEntityChunks;
+    header->entitiesEnd = entitiesEnd;
+    header->numEntities = numEntities;
+    header->numGaps = numGaps;
+    header->firstGap = firstGap;
+    header->chunkStartGeneration = chunkStartGeneration;
+    for (archetypeIndex = 0; archetypeIndex < numArchetypes; archetypeIndex++)
+    {
+        MultiArrayList *arr = &archetypeArrays[archetypeIndex];
+        size_t blockSize = multiarraylist_block_size(arr);
+        header->archetypes[archetypeIndex] = currentArchetypes[archetypeIndex];
+        header->archetypeEntityCounts[archetypeIndex] = archetypeEntityCounts[archetypeIndex];
+        header->archetypeNumBlocks[archetypeIndex] = arr->numBlocks;
+
+        for (size_t blockIndex = 0; blockIndex < arr->numBlocks; blockIndex++)
         {
-            MultiArrayListBlock *nextBlock = curBlock->next;
+            MultiArrayListBlock *block = arr->blocks[blockIndex];
+            const Snapshot::Unit *unit = &out.units_[unitIndex];
+            // Blocks that haven't been touched since the last snapshot are still what it stored, so they can be skipped without hashing
+            if (reuse && unitIndex < out.numUnits_ && unit->offset == offset && unit->size == blockSize && unit->block == block &&
+                unit->numElements == block->numElements && !multiarraylist_changed_since(block, arr->archetype, out.version_))
+            {
+                unitIndex++;
+                offset += blockSize;
+                continue;
+            }
+            uint8_t *stored = storeUnit(block, blockSize, hashBlock(block, blockSize), block);
+            if (stored != nullptr)
+            {
+                storeBlockEntities(reinterpret_cast<MultiArrayListBlock*>(stored));
+            }
+        }
+    }
+
+    out.numUnits_ = numUnits;
+    out.size_ = size;
+    // Everything written from here on is newer than the snapshot
+    out.version_ = takeChangeVersion();
+}
+
+void ecs::restore(const Snapshot& in)
+{
+    const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader*>(in.buffer_);
+    const Snapshot::Unit *unit = in.units_;
+    int archetypeIndex, chunkIndex;
+
+    if (!in.valid())
+    {
+        return;
+    }
 
-            freeAlloc(curBlock);
+    // Anything queued refers to the world being replaced
+    clear_entity_queues();
+    // So does anything keeping track of entities outside of the ECS, and any grouping progress
+    worldResets++;
+    std::fill_n(archetypeGroupings, MAX_ARCHETYPES, ArchetypeGrouping{});
 
-            curBlock = nextBlock;
+    // Bring the entity table back first, since blocks need it to turn their stored slot indices back into entity pointers
+    for (chunkIndex = 0; chunkIndex < header->numEntityChunks; chunkIndex++, unit++)
+    {
+        if (chunkIndex >= numEntityChunks)
+        {
+            entityChunks[chunkIndex] = static_cast<EntityChunk*>(allocChunks(1, ALLOC_ECS));
+        }
+        else if (hashEntityChunk(entityChunks[chunkIndex]) == unit->hash)
+        {
+            continue;
         }
+        memcpy(entityChunks[chunkIndex], in.buffer_ + unit->offset, unit->size);
     }
-    numArchetypes = 0;
-    memset(allEntities, 0, sizeof(allEntities));
-    numEntities = 0;
-    entitiesEnd = 0;
-    numGaps = 0;
-    firstGap = INT32_MAX;
+    for (; chunkIndex < numEntityChunks; chunkIndex++)
+    {
+        freeAlloc(entityChunks[chunkIndex]);
+        entityChunks[chunkIndex] = nullptr;
+    }
+    numEntityChunks = header->numEntityChunks;
+    entitiesEnd = header->entitiesEnd;
+    numEntities = header->numEntities;
+    numGaps = header->numGaps;
+    firstGap = header->firstGap;
+    chunkStartGeneration = header->chunkStartGeneration;
+
+    // Rebuild the archetype registry if it doesn't match the snapshot's, otherwise the existing blocks can be reused
+    if (numArchetypes != header->numArchetypes || !std::equal(currentArchetypes, currentArchetypes + numArchetypes, header->archetypes))
+    {
+        clearArchetypeRegistry();
+        for (archetypeIndex = 0; archetypeIndex < header->numArchetypes; archetypeIndex++)
+        {
+            registerArchetype(header->archetypes[archetypeIndex]);
+        }
+    }
+
+    for (archetypeIndex = 0; archetypeIndex < numArchetypes; archetypeIndex++)
+    {
+        MultiArrayList *arr = &archetypeArrays[archetypeIndex];
+        size_t blockSize = multiarraylist_block_size(arr);
+        multiarraylist_set_block_count(arr, header->archetypeNumBlocks[archetypeIndex]);
+        archetypeEntityCounts[archetypeIndex] = header->archetypeEntityCounts[archetypeIndex];
+
+        for (size_t blockIndex = 0; blockIndex < arr->numBlocks; blockIndex++, unit++)
+        {
+            MultiArrayListBlock *block = arr->blocks[blockIndex];
+            const MultiArrayListBlock *stored = reinterpret_cast<const MultiArrayListBlock*>(in.buffer_ + unit->offset);
+            // Same as when taking a snapshot, a block that hasn't been touched since it was stored doesn't need hashing
+            if ((unit->block == block && unit->numElements == block->numElements && !multiarraylist_changed_since(block, arr->archetype, in.version_)) ||
+                hashBlock(block, blockSize) == unit->hash)
+            {
+                continue;
+            }
+            // Leave the block's next pointer and change versions alone
+            block->numElements = stored->numElements;
+            memcpy(block + 1, stored + 1, blockSize - sizeof(MultiArrayListBlock));
+            loadBlockEntities(block);
+            multiarraylist_mark_changed(block, arr->archetype);
+        }
+    }
+}
+
+// A behavior callback's batch function
+struct BatchBehavior {
+    EntityBehaviorCallback callback;
+    EntityBehaviorBatchCallback batch;
+};
+
+BatchBehavior batchBehaviors[MAX_BATCH_BEHAVIORS];
+int numBatchBehaviors = 0;
+
+bool registerBatchBehavior(EntityBehaviorCallback callback, EntityBehaviorBatchCallback batch)
+{
+    for (int i = 0; i < numBatchBehaviors; i++)
+    {
+        if (batchBehaviors[i].callback == callback)
+        {
+            batchBehaviors[i].batch = batch;
+            return true;
+        }
+    }
+    if (numBatchBehaviors == MAX_BATCH_BEHAVIORS)
+    {
+        return false;
+    }
+    batchBehaviors[numBatchBehaviors++] = { callback, batch };
+    return true;
+}
+
+void clearBatchBehaviors(void)
+{
+    numBatchBehaviors = 0;
+}
+
+EntityBehaviorBatchCallback findBatchBehavior(EntityBehaviorCallback callback)
+{
+    for (int i = 0; i < numBatchBehaviors; i++)
+    {
+        if (batchBehaviors[i].callback == callback)
+        {
+            return batchBehaviors[i].batch;
+        }
+    }
+    return nullptr;
 }
 
 void processBehaviorEntities(size_t count, UNUSED void *arg, int numComponents, archetype_t archetype, void **componentArrays, size_t *componentSizes)
 {
     int i = 0;
     // Get the index of the BehaviorState component in the component array and iterate over it
-    BehaviorState *cur_bhv = static_cast<BehaviorState*>(componentArrays[COMPONENT_INDEX(Behavior, archetype)]);
-    ActiveState *cur_active_state = nullptr;
+    BehaviorState *behaviors = static_cast<BehaviorState*>(componentArrays[COMPONENT_INDEX(Behavior, archetype)]);
+    ActiveState *activeStates = nullptr;
+    void *runArrays[NUM_COMPONENT_TYPES + 1];
+    size_t runStart = 0;
+    // Entities whose flag was set without moving them to an Inactive archetype yet still have to be skipped here
     if (archetype & Bit_Deactivatable)
     {
-        cur_active_state = get_component<Bit_Deactivatable, ActiveState>(componentArrays, archetype);
+        activeStates = get_component<Bit_Deactivatable, ActiveState>(componentArrays, archetype);
     }
-    // Iterate over every entity in the given array
-    while (count)
+
+    // Split the entities into runs that share a callback, skipping over any that are deactivated
+    while (runStart < count)
     {
-        if (cur_active_state == nullptr || !cur_active_state->deactivated)
+        if (activeStates != nullptr && activeStates[runStart].deactivated)
         {
-            // Call the entity's callback with the component pointers and it's data pointer
-            cur_bhv->callback(componentArrays, cur_bhv->data.data());
+            runStart++;
+            continue;
+        }
+        EntityBehaviorCallback callback = behaviors[runStart].callback;
+        size_t runEnd = runStart + 1;
+        while (runEnd < count && behaviors[runEnd].callback == callback && (activeStates == nullptr || !activeStates[runEnd].deactivated))
+        {
+            runEnd++;
         }
 
-        componentArrays[0] = static_cast<uint8_t*>(componentArrays[0]) + sizeof(Entity*);
-
-        // Increment the component pointers so they are valid for the next entity
+        // Point the component arrays at the start of the run
+        runArrays[0] = static_cast<Entity**>(componentArrays[0]) + runStart;
         for (i = 0; i < numComponents; i++)
         {
-            componentArrays[i + 1] = static_cast<uint8_t*>(componentArrays[i + 1]) + componentSizes[i];
+            runArrays[i + 1] = static_cast<uint8_t*>(componentArrays[i + 1]) + componentSizes[i] * runStart;
         }
-        if (cur_active_state)
+
+        EntityBehaviorBatchCallback batch = findBatchBehavior(callback);
+        if (batch != nullptr)
         {
-            cur_active_state++;
+            batch(runEnd - runStart, runArrays, archetype, &behaviors[runStart]);
         }
-        // Increment to the next entity's behavior params
-        cur_bhv++;
-        // Decrement the remaining entity count
-        count--;
+        else
+        {
+            for (size_t cur = runStart; cur < runEnd; cur++)
+            {
+                // Call the entity's callback with the component pointers and it's data pointer
+                behaviors[cur].callback(runArrays, behaviors[cur].data.data());
+
+                // Increment the component pointers so they are valid for the next entity
+                runArrays[0] = static_cast<uint8_t*>(runArrays[0]) + sizeof(Entity*);
+                for (i = 0; i < numComponents; i++)
+                {
+                    runArrays[i + 1] = static_cast<uint8_t*>(runArrays[i + 1]) + componentSizes[i];
+                }
+            }
+        }
+        runStart = runEnd;
     }
 }
 
+// Deactivated entities don't run their behaviors
+EntityQuery behaviorQuery{Bit_Behavior, Bit_Inactive};
+
+// Components behaviors are assumed not to write, since stamping Model every frame would keep drawing's grouping by it
+// from ever settling for entities with behaviors
+constexpr archetype_t behaviorReadOnlyMask = Bit_Model;
+
 void iterateBehaviorEntities()
 {
-    iterateOverEntitiesAllComponents(processBehaviorEntities, nullptr, Bit_Behavior, 0);
+    // Behaviors can write any of their entity's other components, so those all get stamped
+    iterateOverEntitiesAllComponents(processBehaviorEntities, nullptr, behaviorQuery, behaviorReadOnlyMask);
+}
+
+void processBehaviorBlock(const EntityQueryMatch& match, MultiArrayListBlock *block, UNUSED void *arg)
+{
+    int i;
+    void *curAddresses[NUM_COMPONENT_TYPES + 1];
+    curAddresses[0] = multiarraylist_get_block_entity_pointers(block);
+    for (i = 0; i < match.numComponents; i++)
+    {
+        curAddresses[i + 1] = (void*)(match.allComponentOffsets[i] + (uintptr_t)block);
+    }
+    processBehaviorEntities(block->numElements, nullptr, match.numComponents, match.archetype, curAddresses, const_cast<size_t*>(match.allComponentSizes));
+}
+
+void registerBehaviorSystem()
+{
+    // Behavior callbacks can read and write anything, including other entities, so they run alone on one thread
+    constexpr archetype_t allComponents = (1 << NUM_COMPONENT_TYPES) - 1;
+    registerSystem(behaviorQuery, allComponents, allComponents & ~behaviorReadOnlyMask, processBehaviorBlock, nullptr, SYSTEM_SERIAL);
 }
 
 void tickDestroyTimersCallback(size_t count, UNUSED void *arg, void **componentArrays)
@@ -686,7 +2302,22 @@ void tickDestroyTimersCallback(size_t count, UNUSED void *arg, void **componentA
     }
 }
 
+EntityQuery destroyTimerQuery{Bit_DestroyTimer, 0};
+
 void tickDestroyTimers()
 {
-    iterateOverEntities(tickDestroyTimersCallback, nullptr, Bit_DestroyTimer, 0);
+    iterateOverEntities(tickDestroyTimersCallback, nullptr, destroyTimerQuery);
+}
+
+void tickDestroyTimersBlock(const EntityQueryMatch& match, MultiArrayListBlock *block, UNUSED void *arg)
+{
+    void *curAddresses[2];
+    curAddresses[0] = multiarraylist_get_block_entity_pointers(block);
+    curAddresses[1] = (void*)(match.componentOffsets[0] + (uintptr_t)block);
+    tickDestroyTimersCallback(block->numElements, nullptr, curAddresses);
+}
+
+void registerDestroyTimerSystem()
+{
+    registerSystem(destroyTimerQuery, 0, Bit_DestroyTimer, tickDestroyTimersBlock, nullptr);
 }
@@ -1,9 +1,13 @@
 #include <cstring>
+#include <memory>
 
 #include <mem.h>
 #include <ecs.h>
+#include <files.h>
 #include <level.h>
 
+#include <algorithm>
+
 #pragma GCC diagnostic ignored "-Wvla"
 
 struct LevelCreateEntitiesCallbackArg_t {
@@ -75,6 +79,8 @@ void processLevelHeader(LevelHeader *header)
 
         // Create the entities for the current archetype
         createEntitiesCallback(curArchetype, (void*) &arg, *entityArchetypeCounts, levelCreateEntitiesCallback);
+        // Move any entities the level has deactivated into the inactive archetype, as deactivateEntities would have
+        syncArchetypeActiveStates(curArchetype);
 
         archetypesRemaining--;
         entityArchetypeCounts++;
@@ -82,3 +88,117 @@ void processLevelHeader(LevelHeader *header)
         curArchetypeComponentArrayPtr++;
     }
 }
+
+// Number of block DMAs kept in flight at once while loading prebaked level entities, which must be fewer than the number of load slots
+constexpr size_t level_block_loads_in_flight = 8;
+
+// Checks that a prebaked level was baked for the same block layout as this build
+bool levelBlocksLayoutMatches(const LevelBlocksHeader *header)
+{
+    if (header->blockHeaderSize != sizeof(MultiArrayListBlock) ||
+        header->entityPointerSize != sizeof(Entity*) ||
+        header->componentCount != NUM_COMPONENT_TYPES)
+    {
+        return false;
+    }
+    for (int i = 0; i < NUM_COMPONENT_TYPES; i++)
+    {
+        if (header->componentSizes[i] != g_componentSizes[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Creates entities by copying them out of a baked block, for archetypes that can't take the block as it is
+void copyLevelBlock(archetype_t archetype, MultiArrayListBlock *block, size_t bakedElementCount)
+{
+    void *componentArrays[NUM_COMPONENT_TYPES];
+    struct LevelCreateEntitiesCallbackArg_t arg = {
+        archetype,
+        componentArrays,
+    };
+    uintptr_t curOffset = sizeof(MultiArrayListBlock) + bakedElementCount * sizeof(Entity*);
+    archetype_t archetypeBits = archetype;
+    int numComponents = 0;
+
+    while (archetypeBits)
+    {
+        int curComponentIndex = lowest_bit(archetypeBits);
+        componentArrays[numComponents++] = (void*)((uintptr_t)block + curOffset);
+        curOffset += g_componentSizes[curComponentIndex] * bakedElementCount;
+        archetypeBits &= archetypeBits - 1;
+    }
+
+    createEntitiesCallback(archetype, (void*) &arg, block->numElements, levelCreateEntitiesCallback);
+}
+
+bool loadLevelBlocks(uint32_t romPos)
+{
+    // The header's full size isn't known until it's loaded, so load the first chunk and then reload it if the header is bigger
+    std::unique_ptr<uint8_t[], alloc_deleter> headerData{static_cast<uint8_t*>(load_data(romPos, mem_block_size))};
+    LevelBlocksHeader *header = reinterpret_cast<LevelBlocksHeader*>(headerData.get());
+
+    if (header->magic != level_blocks_magic || !levelBlocksLayoutMatches(header))
+    {
+        return false;
+    }
+    if (header->headerSize > mem_block_size)
+    {
+        headerData.reset(static_cast<uint8_t*>(load_data(romPos, header->headerSize)));
+        header = reinterpret_cast<LevelBlocksHeader*>(headerData.get());
+    }
+
+    const LevelBlocksArchetype *curArchetype = reinterpret_cast<const LevelBlocksArchetype*>(header + 1);
+    LoadHandle loads[level_block_loads_in_flight];
+
+    for (uint32_t archetypesRemaining = header->archetypeCount; archetypesRemaining != 0; archetypesRemaining--, curArchetype++)
+    {
+        if (curArchetype->entityCount == 0)
+        {
+            continue;
+        }
+
+        int numBlocks = (curArchetype->entityCount + curArchetype->elementCount - 1) / curArchetype->elementCount;
+        size_t bakedBlockSize = curArchetype->blockChunks * mem_block_size;
+        uint32_t curRomPos = romPos + curArchetype->dataOffset;
+        size_t elementCount, blockChunks;
+        auto blocks = std::unique_ptr<MultiArrayListBlock*[]>(new MultiArrayListBlock*[numBlocks]);
+        int i;
+
+        // DMA every block straight into its own pool allocation, waiting on the oldest load whenever too many are in flight
+        for (i = 0; i < numBlocks; i++)
+        {
+            LoadHandle& load = loads[i % level_block_loads_in_flight];
+            if (i >= static_cast<int>(level_block_loads_in_flight))
+            {
+                load.join();
+            }
+            blocks[i] = static_cast<MultiArrayListBlock*>(allocChunks(curArchetype->blockChunks, ALLOC_ECS));
+            load = start_data_load(blocks[i], curRomPos, bakedBlockSize);
+            curRomPos += bakedBlockSize;
+        }
+        for (i = std::max(numBlocks - static_cast<int>(level_block_loads_in_flight), 0); i < numBlocks; i++)
+        {
+            loads[i % level_block_loads_in_flight].join();
+        }
+
+        // Hand the blocks over as they are if the archetype lays its blocks out the same way and is still empty
+        getArchetypeBlockLayout(curArchetype->archetype, &elementCount, &blockChunks);
+        if (elementCount != curArchetype->elementCount || blockChunks != curArchetype->blockChunks ||
+            !adoptEntityBlocks(curArchetype->archetype, blocks.get(), numBlocks))
+        {
+            for (i = 0; i < numBlocks; i++)
+            {
+                copyLevelBlock(curArchetype->archetype, blocks[i], curArchetype->elementCount);
+                freeAlloc(blocks[i]);
+            }
+        }
+
+        // Entities baked as deactivated are still in the active archetype's blocks, so move them out
+        syncArchetypeActiveStates(curArchetype->archetype);
+    }
+
+    return true;
+}
@@ -6,6 +6,8 @@
 #include <mem.h>
 #include <ecs.h>
 
+#include <algorithm>
+
 // Seems like the best option because it doesn't require a lookup table (slow ram performance)
 // or multiplication (delay slots)
 // https://stackoverflow.com/questions/757059/position-of-least-significant-bit-that-is-set
@@ -28,24 +30,36 @@ int lowest_bit(size_t value)
     return i16 + i8 + i4 + i2 + i1;
 }
 
-inline void clear_block(MultiArrayListBlock* block)
+inline void clear_block(MultiArrayListBlock* block, size_t size)
 {
+#ifdef __mips__
     uint64_t* cur_ptr = reinterpret_cast<uint64_t*>(block);
-    // bzero(block, mem_block_size);
+    // bzero(block, size);
     __asm__ __volatile__(".set gp=64");
-    for (size_t i = 0; i < mem_block_size / 8; i++)
+    for (size_t i = 0; i < size / 8; i++)
     {
         // *cur_ptr = 0;
         __asm__ __volatile__("sd $zero, 0(%0)" : : "r"(cur_ptr));
         cur_ptr++;
     }
     __asm__ __volatile__(".set gp=32");
+#else
+    // Host builds (e.g. tools/ecsbench) don't have 64-bit stores hidden behind a 32-bit ABI, so a plain memset is fine
+    memset(block, 0, size);
+#endif
+}
+
+// Gets the number of elements that fit in a block made of the given number of pool chunks
+static inline size_t multiarraylist_block_element_count(size_t blockChunks, size_t totalElementSize)
+{
+    return ROUND_DOWN((blockChunks * mem_block_size - sizeof(MultiArrayListBlock)) / totalElementSize, 4);
 }
 
 void multiarraylist_init(MultiArrayList *arr, archetype_t archetype)
 {
     // Every entity's components has a pointer back to the entity itself
     size_t totalElementSize = sizeof(Entity*);
+    size_t blockChunks;
     archetype_t archetypeShifted;
     int i;
 
@@ -60,18 +74,107 @@ void multiarraylist_init(MultiArrayList *arr, archetype_t archetype)
         archetypeShifted >>= 1;
     }
 
+    // Use the smallest block that holds the target number of elements, so archetypes with large components
+    // don't end up as a long chain of nearly empty blocks
+    for (blockChunks = 1; blockChunks < multiarraylist_max_block_chunks; blockChunks++)
+    {
+        if (multiarraylist_block_element_count(blockChunks, totalElementSize) >= multiarraylist_target_element_count)
+        {
+            break;
+        }
+    }
+
     arr->archetype = archetype;
     arr->totalElementSize = totalElementSize;
-    arr->elementCount = ROUND_DOWN((mem_block_size - sizeof(MultiArrayListBlock)) / totalElementSize, 4);
-    arr->end = arr->start = (MultiArrayListBlock*) allocChunks(1, ALLOC_ECS);
-    clear_block(arr->start);
+    arr->blockChunks = blockChunks;
+    arr->elementCount = multiarraylist_block_element_count(blockChunks, totalElementSize);
+    arr->blocks = arr->inlineBlocks;
+    arr->blockCapacity = multiarraylist_inline_blocks;
+    arr->numBlocks = 1;
+    arr->spare = nullptr;
+    arr->end = arr->start = arr->blocks[0] = (MultiArrayListBlock*) allocChunks(blockChunks, ALLOC_ECS);
+    clear_block(arr->start, multiarraylist_block_size(arr));
     // memset(arr->start, 0, mem_block_size);
+    multiarraylist_mark_changed(arr->start, archetype);
+}
+
+void multiarraylist_free(MultiArrayList *arr)
+{
+    for (size_t i = 0; i < arr->numBlocks; i++)
+    {
+        freeAlloc(arr->blocks[i]);
+    }
+    if (arr->spare != nullptr)
+    {
+        freeAlloc(arr->spare);
+    }
+    if (arr->blocks != arr->inlineBlocks)
+    {
+        freeAlloc(arr->blocks);
+    }
+    arr->start = arr->end = arr->spare = nullptr;
+    arr->blocks = arr->inlineBlocks;
+    arr->blockCapacity = multiarraylist_inline_blocks;
+    arr->numBlocks = 0;
+}
+
+// Adds the given block to the end of the arraylist's chain and block table, growing the table if it's full
+static void multiarraylist_push_block(MultiArrayList *arr, MultiArrayListBlock *block)
+{
+    // Grow the block table if it's full, moving it out of the inline storage the first time
+    if (arr->numBlocks == arr->blockCapacity)
+    {
+        size_t newCapacity = MAX(arr->blockCapacity * 2, mem_block_size / sizeof(MultiArrayListBlock*));
+        MultiArrayListBlock **newBlocks = static_cast<MultiArrayListBlock**>(allocRegion(newCapacity * sizeof(MultiArrayListBlock*), ALLOC_ECS));
+        memcpy(newBlocks, arr->blocks, arr->numBlocks * sizeof(MultiArrayListBlock*));
+        if (arr->blocks != arr->inlineBlocks)
+        {
+            freeAlloc(arr->blocks);
+        }
+        arr->blocks = newBlocks;
+        arr->blockCapacity = newCapacity;
+    }
+
+    arr->blocks[arr->numBlocks++] = block;
+    block->next = nullptr;
+    if (arr->numBlocks == 1)
+    {
+        arr->start = block;
+    }
+    else
+    {
+        arr->end->next = block;
+    }
+    arr->end = block;
+}
+
+// Adds a new empty block to the end of the arraylist, reusing the spare block if there is one
+static MultiArrayListBlock *multiarraylist_append_block(MultiArrayList *arr)
+{
+    MultiArrayListBlock *newSeg = arr->spare;
+    if (newSeg != nullptr)
+    {
+        arr->spare = nullptr;
+    }
+    else
+    {
+        newSeg = (MultiArrayListBlock*) allocChunks(arr->blockChunks, ALLOC_ECS);
+    }
+    clear_block(newSeg, multiarraylist_block_size(arr));
+    // memset(newSeg, 0, mem_block_size);
+    // Clearing the block counts as writing it, and keeps it from looking unchanged to anything that saw a block at the same address
+    multiarraylist_mark_changed(newSeg, arr->archetype);
+
+    multiarraylist_push_block(arr, newSeg);
+    return newSeg;
 }
 
 void multiarraylist_alloccount(MultiArrayList *arr, size_t count)
 {
     size_t elementCount = arr->elementCount;
     size_t remainingInCurrentBlock = elementCount - arr->end->numElements;
+    // Every block that gets new elements counts as having all of its components written
+    multiarraylist_mark_changed(arr->end, arr->archetype);
     if (count < remainingInCurrentBlock)
     {
         arr->end->numElements += count;
@@ -82,13 +185,8 @@ void multiarraylist_alloccount(MultiArrayList *arr, size_t count)
         count -= remainingInCurrentBlock;
         while (count > 0)
         {
-            MultiArrayListBlock *newSeg = (MultiArrayListBlock*) allocChunks(1, ALLOC_ECS);
-            clear_block(newSeg);
-            // memset(newSeg, 0, mem_block_size);
+            MultiArrayListBlock *newSeg = multiarraylist_append_block(arr);
 
-            arr->end->next = newSeg;
-            arr->end = newSeg;
-            
             newSeg->numElements = MIN(count, elementCount);
             count -= newSeg->numElements;
         }
@@ -122,16 +220,9 @@ void multiarraylist_delete(MultiArrayList *arr, size_t arrayIndex)
 {
     archetype_t archetype = arr->archetype;
     size_t elementCount = arr->elementCount;
-    MultiArrayListBlock *block = arr->start;
     MultiArrayListBlock *end = arr->end;
-    size_t block_array_index = arrayIndex;
-
-    // Find the block
-    while (block_array_index >= elementCount)
-    {
-        block = block->next;
-        block_array_index -= elementCount;
-    }
+    size_t block_array_index;
+    MultiArrayListBlock *block = multiarraylist_get_block(arr, arrayIndex, &block_array_index);
 
     // Copy the components of the last element in the array to the position of the deleted one, but only
     // if the deleted entity is not the last in the multi array list
@@ -166,21 +257,259 @@ void multiarraylist_delete(MultiArrayList *arr, size_t arrayIndex)
             // Clear the current component from the component bits
             component_bits &= ~(1 << cur_component_type);
         }
+        multiarraylist_mark_changed(block, archetype);
     }
 
     // Decrement the number of elements in the last block
     end->numElements--;
 
-    // If the last block has no more elements in it, make the previous node the new end
-    if (end->numElements == 0 && arr->start != arr->end)
+    // If the last block has no more elements in it, make the previous block the new end and keep the emptied one as the spare
+    if (end->numElements == 0 && arr->numBlocks > 1)
     {
-        MultiArrayListBlock *newEnd = arr->start;
-        while (newEnd->next != end)
+        if (arr->spare != nullptr)
         {
-            newEnd = newEnd->next;
+            freeAlloc(arr->spare);
         }
+        arr->spare = end;
+        arr->numBlocks--;
+        MultiArrayListBlock *newEnd = arr->blocks[arr->numBlocks - 1];
         arr->end = newEnd;
         newEnd->next = nullptr;
-        end = newEnd;
+    }
+}
+
+void multiarraylist_swap(MultiArrayList *arr, size_t indexA, size_t indexB)
+{
+    archetype_t component_bits = arr->archetype;
+    size_t elementCount = arr->elementCount;
+    size_t blockIndexA, blockIndexB;
+    MultiArrayListBlock *blockA = multiarraylist_get_block(arr, indexA, &blockIndexA);
+    MultiArrayListBlock *blockB = multiarraylist_get_block(arr, indexB, &blockIndexB);
+    Entity **entityA = &multiarraylist_get_block_entity_pointers(blockA)[blockIndexA];
+    Entity **entityB = &multiarraylist_get_block_entity_pointers(blockB)[blockIndexB];
+
+    // Swap the entity pointers and point each entity at its new index
+    std::swap(*entityA, *entityB);
+    (*entityA)->archetypeArrayIndex = indexA;
+    (*entityB)->archetypeArrayIndex = indexB;
+
+    size_t current_array_offset = sizeof(MultiArrayListBlock) + elementCount * sizeof(Entity*);
+    while (component_bits != 0)
+    {
+        size_t cur_component_type = lowest_bit(component_bits);
+        size_t cur_component_size = g_componentSizes[cur_component_type];
+        uint8_t *componentA = (uint8_t *)((uintptr_t)blockA + current_array_offset + cur_component_size * blockIndexA);
+        uint8_t *componentB = (uint8_t *)((uintptr_t)blockB + current_array_offset + cur_component_size * blockIndexB);
+        std::swap_ranges(componentA, componentA + cur_component_size, componentB);
+        current_array_offset += cur_component_size * elementCount;
+        component_bits &= ~(1 << cur_component_type);
+    }
+
+    multiarraylist_mark_changed(blockA, arr->archetype);
+    multiarraylist_mark_changed(blockB, arr->archetype);
+}
+
+// Removes blocks from the end of the arraylist until it has the given number (at least one), keeping the last one removed as the spare
+static void multiarraylist_trim_blocks(MultiArrayList *arr, size_t numBlocks)
+{
+    while (arr->numBlocks > numBlocks)
+    {
+        arr->numBlocks--;
+        if (arr->spare != nullptr)
+        {
+            freeAlloc(arr->spare);
+        }
+        arr->spare = arr->blocks[arr->numBlocks];
+    }
+    arr->end = arr->blocks[numBlocks - 1];
+    arr->end->next = nullptr;
+}
+
+// Calls func(src, dst) for every surviving element that has to be moved into a hole left by the deleted elements
+// Survivors are taken from the tail, skipping any elements there that are being deleted as well
+template <typename Func>
+static inline void multiarraylist_for_each_move(const uint32_t *indices, size_t count, size_t length, Func&& func)
+{
+    size_t newLength = length - count;
+    size_t hole = 0;
+    size_t tailDeleted = count;
+    size_t src = length;
+
+    while (hole < count && indices[hole] < newLength)
+    {
+        src--;
+        if (tailDeleted > hole && indices[tailDeleted - 1] == src)
+        {
+            tailDeleted--;
+            continue;
+        }
+        func(src, indices[hole]);
+        hole++;
+    }
+}
+
+void multiarraylist_delete_sorted(MultiArrayList *arr, const uint32_t *indices, size_t count)
+{
+    size_t elementCount = arr->elementCount;
+    size_t length = multiarraylist_length(arr);
+    size_t newLength = length - count;
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    // Move the entity pointers first, repointing each moved entity at its new index
+    multiarraylist_for_each_move(indices, count, length,
+        [arr](size_t src, size_t dst)
+        {
+            size_t srcIndex, dstIndex;
+            MultiArrayListBlock *dstBlock = multiarraylist_get_block(arr, dst, &dstIndex);
+            Entity **srcEntities = multiarraylist_get_block_entity_pointers(multiarraylist_get_block(arr, src, &srcIndex));
+            Entity **dstEntities = multiarraylist_get_block_entity_pointers(dstBlock);
+            Entity *moved = srcEntities[srcIndex];
+            dstEntities[dstIndex] = moved;
+            moved->archetypeArrayIndex = dst;
+            multiarraylist_mark_changed(dstBlock, arr->archetype);
+        });
+
+    // Then move each component array in turn
+    size_t current_array_offset = sizeof(MultiArrayListBlock) + elementCount * sizeof(Entity*);
+    archetype_t component_bits = arr->archetype;
+    while (component_bits != 0)
+    {
+        size_t cur_component_type = lowest_bit(component_bits);
+        size_t cur_component_size = g_componentSizes[cur_component_type];
+
+        multiarraylist_for_each_move(indices, count, length,
+            [arr, current_array_offset, cur_component_size](size_t src, size_t dst)
+            {
+                size_t srcIndex, dstIndex;
+                MultiArrayListBlock *srcBlock = multiarraylist_get_block(arr, src, &srcIndex);
+                MultiArrayListBlock *dstBlock = multiarraylist_get_block(arr, dst, &dstIndex);
+                memcpy((void *)((uintptr_t)dstBlock + current_array_offset + cur_component_size * dstIndex),
+                       (void *)((uintptr_t)srcBlock + current_array_offset + cur_component_size * srcIndex),
+                       cur_component_size);
+            });
+
+        current_array_offset += cur_component_size * elementCount;
+        component_bits &= ~(1 << cur_component_type);
+    }
+
+    // Trim the list down to the blocks still in use, always keeping at least one
+    size_t newNumBlocks = MAX((newLength + elementCount - 1) / elementCount, 1);
+    multiarraylist_trim_blocks(arr, newNumBlocks);
+    arr->end->numElements = newLength - (newNumBlocks - 1) * elementCount;
+}
+
+void multiarraylist_set_block_count(MultiArrayList *arr, size_t numBlocks)
+{
+    numBlocks = MAX(numBlocks, 1);
+    while (arr->numBlocks < numBlocks)
+    {
+        multiarraylist_append_block(arr);
+    }
+    multiarraylist_trim_blocks(arr, numBlocks);
+}
+
+void multiarraylist_adopt_blocks(MultiArrayList *arr, MultiArrayListBlock **blocks, size_t count)
+{
+    // The list's empty block gets replaced, keep it as the spare if there isn't one already
+    if (arr->spare == nullptr)
+    {
+        arr->spare = arr->start;
+    }
+    else
+    {
+        freeAlloc(arr->start);
+    }
+    arr->numBlocks = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        multiarraylist_push_block(arr, blocks[i]);
+        multiarraylist_mark_changed(blocks[i], arr->archetype);
+    }
+}
+
+void multiarraylist_rebase_versions(MultiArrayList *arr)
+{
+    uint16_t oldest = static_cast<uint16_t>(g_changeVersion - multiarraylist_max_version_age);
+    for (size_t blockIndex = 0; blockIndex < arr->numBlocks; blockIndex++)
+    {
+        MultiArrayListBlock *block = arr->blocks[blockIndex];
+        archetype_t archetypeBits = arr->archetype;
+        while (archetypeBits)
+        {
+            uint16_t *stamp = &block->componentVersions[lowest_bit(archetypeBits)];
+            if (static_cast<uint16_t>(g_changeVersion - *stamp) > multiarraylist_max_version_age)
+            {
+                *stamp = oldest;
+            }
+            archetypeBits &= archetypeBits - 1;
+        }
+    }
+}
+
+void multiarraylist_copy_elements(MultiArrayList *dst, size_t dstStart, MultiArrayList *src, const uint32_t *srcIndices, size_t count)
+{
+    size_t srcElementCount = src->elementCount;
+    size_t dstElementCount = dst->elementCount;
+    size_t element = 0;
+
+    while (element < count)
+    {
+        size_t srcBlockIndex, dstBlockIndex;
+        MultiArrayListBlock *srcBlock = multiarraylist_get_block(src, srcIndices[element], &srcBlockIndex);
+        MultiArrayListBlock *dstBlock = multiarraylist_get_block(dst, dstStart + element, &dstBlockIndex);
+        size_t runLength = 1;
+
+        // Extend the run while the source indices are consecutive and neither side crosses into its next block
+        while (element + runLength < count &&
+               srcIndices[element + runLength] == srcIndices[element] + runLength &&
+               srcBlockIndex + runLength < srcElementCount &&
+               dstBlockIndex + runLength < dstElementCount)
+        {
+            runLength++;
+        }
+
+        multiarraylist_mark_changed(dstBlock, dst->archetype);
+
+        // Copy the entity pointers for the run
+        memcpy(multiarraylist_get_block_entity_pointers(dstBlock) + dstBlockIndex,
+               multiarraylist_get_block_entity_pointers(srcBlock) + srcBlockIndex,
+               runLength * sizeof(Entity*));
+
+        // Walk both archetypes' component arrays together, copying the ones they share
+        size_t src_array_offset = sizeof(MultiArrayListBlock) + srcElementCount * sizeof(Entity*);
+        size_t dst_array_offset = sizeof(MultiArrayListBlock) + dstElementCount * sizeof(Entity*);
+        archetype_t component_bits = src->archetype | dst->archetype;
+        while (component_bits != 0)
+        {
+            size_t cur_component_type = lowest_bit(component_bits);
+            size_t cur_component_size = g_componentSizes[cur_component_type];
+            archetype_t cur_component_bit = 1 << cur_component_type;
+
+            if (dst->archetype & cur_component_bit)
+            {
+                void *dstComponents = (void *)((uintptr_t)dstBlock + dst_array_offset + cur_component_size * dstBlockIndex);
+                if (src->archetype & cur_component_bit)
+                {
+                    memcpy(dstComponents, (void *)((uintptr_t)srcBlock + src_array_offset + cur_component_size * srcBlockIndex), cur_component_size * runLength);
+                }
+                else
+                {
+                    memset(dstComponents, 0, cur_component_size * runLength);
+                }
+                dst_array_offset += cur_component_size * dstElementCount;
+            }
+            if (src->archetype & cur_component_bit)
+            {
+                src_array_offset += cur_component_size * srcElementCount;
+            }
+            component_bits &= ~cur_component_bit;
+        }
+
+        element += runLength;
     }
 }
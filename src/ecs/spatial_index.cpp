@@ -0,0 +1,396 @@
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <spatial_index.h>
+#include <mathutils.h>
+#include <mem.h>
+
+#include <algorithm>
+#include <bit>
+
+SpatialIndex::~SpatialIndex()
+{
+    clear();
+}
+
+void SpatialIndex::clear()
+{
+    if (nodes_ != nullptr)
+    {
+        freeAlloc(nodes_);
+        freeAlloc(lookup_);
+    }
+    nodes_ = nullptr;
+    numNodes_ = 0;
+    nodeCapacity_ = 0;
+    firstFreeNode_ = 0;
+    lookup_ = nullptr;
+    lookupBits_ = 0;
+    numEntries_ = 0;
+    version_ = 0;
+    std::fill_n(buckets_, spatial_index_buckets, 0);
+}
+
+int SpatialIndex::cellCoord(float coord) const
+{
+    // Clamp to what a node can hold, which also keeps huge search ranges from overflowing
+    float cell = std::floor(coord * invCellSize_);
+    return static_cast<int>(std::clamp(cell, static_cast<float>(INT16_MIN), static_cast<float>(INT16_MAX)));
+}
+
+// Grows the node array and the lookup table to fit at least the given number of nodes
+// Nodes refer to each other by index so they can just be copied, but the lookup table has to be rebuilt
+void SpatialIndex::reserveNodes(size_t count)
+{
+    if (count <= nodeCapacity_)
+    {
+        return;
+    }
+    size_t newCapacity = std::max(ROUND_UP(count * sizeof(Node), mem_block_size) / sizeof(Node), 2 * nodeCapacity_);
+    Node *newNodes = static_cast<Node*>(allocRegion(newCapacity * sizeof(Node), ALLOC_ECS));
+    if (nodes_ != nullptr)
+    {
+        memcpy(newNodes, nodes_, numNodes_ * sizeof(Node));
+        freeAlloc(nodes_);
+        freeAlloc(lookup_);
+    }
+    nodes_ = newNodes;
+    nodeCapacity_ = newCapacity;
+
+    // Keep the table at most half full
+    lookupBits_ = std::bit_width(2 * newCapacity - 1);
+    lookup_ = static_cast<uint32_t*>(allocRegion(sizeof(uint32_t) << lookupBits_, ALLOC_ECS));
+    memset(lookup_, 0, sizeof(uint32_t) << lookupBits_);
+    for (size_t nodeIndex = 0; nodeIndex < numNodes_; nodeIndex++)
+    {
+        if (nodes_[nodeIndex].entity != null_entity_handle)
+        {
+            *findLookup(nodes_[nodeIndex].entity & 0xFFFF) = nodeIndex + 1;
+        }
+    }
+}
+
+uint32_t *SpatialIndex::findLookup(uint32_t slot)
+{
+    size_t mask = (static_cast<size_t>(1) << lookupBits_) - 1;
+    size_t entry = lookupHome(slot);
+    // Linear probing, wrapping around at the end of the table
+    while (lookup_[entry] != 0 && (nodes_[lookup_[entry] - 1].entity & 0xFFFF) != slot)
+    {
+        entry = (entry + 1) & mask;
+    }
+    return &lookup_[entry];
+}
+
+void SpatialIndex::removeLookup(uint32_t slot)
+{
+    size_t mask = (static_cast<size_t>(1) << lookupBits_) - 1;
+    size_t hole = findLookup(slot) - lookup_;
+    size_t entry = hole;
+    // Shift back every following entry in the run that can move into the hole, so probes never stop early at it
+    while (true)
+    {
+        entry = (entry + 1) & mask;
+        if (lookup_[entry] == 0)
+        {
+            break;
+        }
+        // The entry can move if the hole is between the entry's home and where it is now
+        size_t home = lookupHome(nodes_[lookup_[entry] - 1].entity & 0xFFFF);
+        if (((entry - home) & mask) >= ((entry - hole) & mask))
+        {
+            lookup_[hole] = lookup_[entry];
+            hole = entry;
+        }
+    }
+    lookup_[hole] = 0;
+}
+
+void SpatialIndex::link(uint32_t nodeIndex, int cellX, int cellZ)
+{
+    Node *node = &nodes_[nodeIndex];
+    uint32_t *head = &buckets_[bucketIndex(cellX, cellZ)];
+    node->cellX = cellX;
+    node->cellZ = cellZ;
+    node->prev = 0;
+    node->next = *head;
+    if (*head != 0)
+    {
+        nodes_[*head - 1].prev = nodeIndex + 1;
+    }
+    *head = nodeIndex + 1;
+}
+
+void SpatialIndex::unlink(uint32_t nodeIndex)
+{
+    Node *node = &nodes_[nodeIndex];
+    if (node->prev != 0)
+    {
+        nodes_[node->prev - 1].next = node->next;
+    }
+    else
+    {
+        buckets_[bucketIndex(node->cellX, node->cellZ)] = node->next;
+    }
+    if (node->next != 0)
+    {
+        nodes_[node->next - 1].prev = node->prev;
+    }
+}
+
+void SpatialIndex::remove(uint32_t nodeIndex)
+{
+    Node *node = &nodes_[nodeIndex];
+    unlink(nodeIndex);
+    removeLookup(node->entity & 0xFFFF);
+    node->entity = null_entity_handle;
+    node->next = firstFreeNode_;
+    firstFreeNode_ = nodeIndex + 1;
+    numEntries_--;
+}
+
+Entity *SpatialIndex::resolve(uint32_t nodeIndex)
+{
+    Entity *e = resolveEntityHandle(nodes_[nodeIndex].entity);
+    if (e == nullptr || (e->archetype & query_.componentMask()) != query_.componentMask() || (e->archetype & query_.rejectMask()))
+    {
+        remove(nodeIndex);
+        return nullptr;
+    }
+    return e;
+}
+
+void SpatialIndex::update()
+{
+    // Entities may have been replaced wholesale since the last update, so start over rather than trust any nodes
+    if (worldResets_ != getWorldResets())
+    {
+        clear();
+        worldResets_ = getWorldResets();
+    }
+    query_.update();
+
+    for (const EntityQueryMatch& match : query_)
+    {
+        for (MultiArrayListBlock *curBlock = match.arr->start; curBlock != nullptr; curBlock = curBlock->next)
+        {
+            if (!multiarraylist_changed_since(curBlock, Bit_Position, version_))
+            {
+                continue;
+            }
+            // Make sure every entity in the block can get a node up front, so lookup entries don't move while they're used
+            reserveNodes(numEntries_ + curBlock->numElements);
+            Entity **entities = multiarraylist_get_block_entity_pointers(curBlock);
+            Vec3 *positions = ecs::block_array<ecs::Position>(match, curBlock);
+            for (size_t i = 0; i < curBlock->numElements; i++)
+            {
+                uint32_t slot = getEntityIndex(entities[i]);
+                EntityHandle handle = getEntityHandle(entities[i]);
+                int cellX = cellCoord(positions[i][0]);
+                int cellZ = cellCoord(positions[i][2]);
+                uint32_t *entry = findLookup(slot);
+                Node *node;
+
+                if (*entry == 0)
+                {
+                    // New to the index, take a free node if there is one
+                    uint32_t nodeIndex;
+                    if (firstFreeNode_ != 0)
+                    {
+                        nodeIndex = firstFreeNode_ - 1;
+                        firstFreeNode_ = nodes_[nodeIndex].next;
+                    }
+                    else
+                    {
+                        nodeIndex = numNodes_++;
+                    }
+                    *entry = nodeIndex + 1;
+                    node = &nodes_[nodeIndex];
+                    node->entity = handle;
+                    link(nodeIndex, cellX, cellZ);
+                    numEntries_++;
+                }
+                else
+                {
+                    // The slot may have been handed to a new entity since, which just takes over the node
+                    node = &nodes_[*entry - 1];
+                    node->entity = handle;
+                    // Only relink entities that have changed cells
+                    if (node->cellX != cellX || node->cellZ != cellZ)
+                    {
+                        unlink(*entry - 1);
+                        link(*entry - 1, cellX, cellZ);
+                    }
+                }
+                VEC3_COPY(node->pos, positions[i]);
+            }
+        }
+    }
+
+    version_ = takeChangeVersion();
+}
+
+template <typename Func>
+void SpatialIndex::forEachInCell(int cellX, int cellZ, Func&& func)
+{
+    uint32_t cur = buckets_[bucketIndex(cellX, cellZ)];
+    while (cur != 0)
+    {
+        uint32_t nodeIndex = cur - 1;
+        Node *node = &nodes_[nodeIndex];
+        // Grab the next node first in case this one gets unlinked
+        cur = node->next;
+        // Other cells can hash to the same bucket
+        if (node->cellX != cellX || node->cellZ != cellZ)
+        {
+            continue;
+        }
+        func(nodeIndex, *node);
+    }
+}
+
+template <typename Func>
+void SpatialIndex::forEachInCells(float minX, float minZ, float maxX, float maxZ, Func&& func)
+{
+    int minCellX = cellCoord(minX);
+    int minCellZ = cellCoord(minZ);
+    int maxCellX = cellCoord(maxX);
+    int maxCellZ = cellCoord(maxZ);
+    int cellX, cellZ;
+
+    // A range covering more cells than there are buckets visits every bucket more than once, so just walk every bucket instead
+    size_t cellsX = maxCellX - minCellX + 1;
+    size_t cellsZ = maxCellZ - minCellZ + 1;
+    if (cellsX > spatial_index_buckets || cellsX * cellsZ > spatial_index_buckets)
+    {
+        for (size_t bucket = 0; bucket < spatial_index_buckets; bucket++)
+        {
+            uint32_t cur = buckets_[bucket];
+            while (cur != 0)
+            {
+                uint32_t nodeIndex = cur - 1;
+                Node *node = &nodes_[nodeIndex];
+                cur = node->next;
+                if (node->cellX < minCellX || node->cellX > maxCellX || node->cellZ < minCellZ || node->cellZ > maxCellZ)
+                {
+                    continue;
+                }
+                func(nodeIndex, *node);
+            }
+        }
+        return;
+    }
+
+    for (cellZ = minCellZ; cellZ <= maxCellZ; cellZ++)
+    {
+        for (cellX = minCellX; cellX <= maxCellX; cellX++)
+        {
+            forEachInCell(cellX, cellZ, func);
+        }
+    }
+}
+
+Entity *SpatialIndex::findNearest(const Vec3 pos, float maxDist, float *foundDist, Vec3 foundPos)
+{
+    float closestDistSq = maxDist * maxDist;
+    Entity *closestEntity = nullptr;
+    const Vec3 *closestPos = nullptr;
+    int centerX = cellCoord(pos[0]);
+    int centerZ = cellCoord(pos[2]);
+    int ring;
+
+    auto check = [&](uint32_t nodeIndex, const Node& node)
+    {
+        Vec3 posDiff;
+        VEC3_DIFF(posDiff, node.pos, pos);
+        float curDistSq = VEC3_DOT(posDiff, posDiff);
+        // Only look up entities that would be the new closest, since that's the expensive part
+        Entity *e;
+        if (curDistSq < closestDistSq && (e = resolve(nodeIndex)) != nullptr)
+        {
+            closestDistSq = curDistSq;
+            closestEntity = e;
+            closestPos = &node.pos;
+        }
+    };
+
+    // Distance from the query point to the closest edge of its cell
+    float edgeDist = std::min(std::min(pos[0] - centerX * cellSize_, (centerX + 1) * cellSize_ - pos[0]),
+                              std::min(pos[2] - centerZ * cellSize_, (centerZ + 1) * cellSize_ - pos[2]));
+
+    // Check rings of cells around the query point, stopping once the next ring is too far away to hold anything closer
+    // Everything in ring n is at least (n - 1) cells plus the distance to the edge of the center cell away along X or Z
+    for (ring = 0; ring <= spatial_index_max_rings; ring++)
+    {
+        float ringDist = (ring - 1) * cellSize_ + edgeDist;
+        if (ring > 0 && ringDist * ringDist >= closestDistSq)
+        {
+            break;
+        }
+        if (ring == 0)
+        {
+            forEachInCell(centerX, centerZ, check);
+            continue;
+        }
+        for (int offset = -ring; offset <= ring; offset++)
+        {
+            forEachInCell(centerX + offset, centerZ - ring, check);
+            forEachInCell(centerX + offset, centerZ + ring, check);
+        }
+        for (int offset = -ring + 1; offset <= ring - 1; offset++)
+        {
+            forEachInCell(centerX - ring, centerZ + offset, check);
+            forEachInCell(centerX + ring, centerZ + offset, check);
+        }
+    }
+
+    // If the rings ran out before the search radius did, fall back to checking everything past them
+    if (ring > spatial_index_max_rings)
+    {
+        forEachInCells(pos[0] - maxDist, pos[2] - maxDist, pos[0] + maxDist, pos[2] + maxDist, check);
+    }
+
+    if (closestEntity != nullptr)
+    {
+        *foundDist = std::sqrt(closestDistSq);
+        VEC3_COPY(foundPos, *closestPos);
+    }
+    return closestEntity;
+}
+
+int SpatialIndex::findInRadius(const Vec3 pos, float radius, Entity **entitiesOut, int maxCount)
+{
+    float radiusSq = radius * radius;
+    int count = 0;
+    forEachInCells(pos[0] - radius, pos[2] - radius, pos[0] + radius, pos[2] + radius,
+        [&](uint32_t nodeIndex, const Node& node)
+        {
+            Vec3 posDiff;
+            VEC3_DIFF(posDiff, node.pos, pos);
+            Entity *e;
+            if (count < maxCount && VEC3_DOT(posDiff, posDiff) <= radiusSq && (e = resolve(nodeIndex)) != nullptr)
+            {
+                entitiesOut[count++] = e;
+            }
+        });
+    return count;
+}
+
+int SpatialIndex::findInBox(const Vec3 boxMin, const Vec3 boxMax, Entity **entitiesOut, int maxCount)
+{
+    int count = 0;
+    forEachInCells(boxMin[0], boxMin[2], boxMax[0], boxMax[2],
+        [&](uint32_t nodeIndex, const Node& node)
+        {
+            Entity *e;
+            if (count < maxCount &&
+                node.pos[0] >= boxMin[0] && node.pos[1] >= boxMin[1] && node.pos[2] >= boxMin[2] &&
+                node.pos[0] <= boxMax[0] && node.pos[1] <= boxMax[1] && node.pos[2] <= boxMax[2] &&
+                (e = resolve(nodeIndex)) != nullptr)
+            {
+                entitiesOut[count++] = e;
+            }
+        });
+    return count;
+}
@@ -0,0 +1,317 @@
+#include <cstdint>
+#include <cstring>
+
+#include <ecs.h>
+#include <systems.h>
+
+#include <algorithm>
+
+#ifdef ECS_THREADED
+#include <atomic>
+#include <thread>
+#include <vector>
+#endif
+
+struct System {
+    EntityQuery *query;
+    archetype_t reads;
+    archetype_t writes;
+    SystemBlockCallback callback;
+    void *arg;
+    uint32_t flags;
+    // Systems in the same level don't conflict with each other and can run at the same time
+    // Every system is placed one level after the last earlier system it conflicts with
+    int level;
+};
+
+System systems[MAX_SYSTEMS];
+int numSystems = 0;
+int numSystemLevels = 0;
+int systemThreadCount = 1;
+
+// Checks if two systems can't run at the same time
+bool systemsConflict(const System& a, const System& b)
+{
+    // Queries where one rejects a component the other requires never match the same archetype, so they can't touch the same entities
+    if ((a.query->componentMask() & b.query->rejectMask()) || (b.query->componentMask() & a.query->rejectMask()))
+    {
+        return false;
+    }
+    return (a.writes & (b.reads | b.writes)) || (b.writes & a.reads);
+}
+
+int registerSystem(EntityQuery& query, archetype_t reads, archetype_t writes, SystemBlockCallback callback, void *arg, uint32_t flags)
+{
+    if (numSystems == MAX_SYSTEMS)
+    {
+        return -1;
+    }
+
+    System *system = &systems[numSystems];
+    system->query = &query;
+    system->reads = reads;
+    system->writes = writes;
+    system->callback = callback;
+    system->arg = arg;
+    system->flags = flags;
+    system->level = 0;
+
+    for (int i = 0; i < numSystems; i++)
+    {
+        if (systemsConflict(systems[i], *system))
+        {
+            system->level = std::max(system->level, systems[i].level + 1);
+        }
+    }
+    numSystemLevels = std::max(numSystemLevels, system->level + 1);
+
+    return numSystems++;
+}
+
+void clearSystems(void)
+{
+    numSystems = 0;
+    numSystemLevels = 0;
+}
+
+void setSystemThreadCount(int count)
+{
+    systemThreadCount = std::clamp(count, 1, MAX_SYSTEM_THREADS);
+}
+
+// Runs every block of a system on the calling thread
+void runSystemSerial(const System& system)
+{
+    for (const EntityQueryMatch& match : *system.query)
+    {
+        for (MultiArrayListBlock *block = match.arr->start; block != nullptr; block = block->next)
+        {
+            system.callback(match, block, system.arg);
+            multiarraylist_mark_changed(block, system.writes & match.archetype);
+        }
+    }
+}
+
+#ifdef ECS_THREADED
+
+// A single block of entities for a system to process
+struct SystemTask {
+    const System *system;
+    const EntityQueryMatch *match;
+    MultiArrayListBlock *block;
+};
+
+// Fewest entities worth handing to each thread, a level with less work than this per thread runs on fewer threads
+// Running this many entities takes a few microseconds, around what it costs to wake a sleeping worker
+constexpr size_t system_min_thread_elements = 4096;
+
+// Pool of worker threads that sleep until run gives them a range of tasks
+// Every thread gets one contiguous range of the task list with about the same number of entities in it, so the
+// threads never contend over tasks and neighboring blocks stay on the same thread
+// The thread calling run works through the first range itself, then sleeps until the workers are done with theirs
+// This static split is used instead of work stealing on purpose: a system's blocks all cost about the same, so stealing
+// has little imbalance to fix, and its per-block synchronization made every thread count slower than one thread
+class SystemThreadPool
+{
+public:
+    ~SystemThreadPool() { stop(); }
+
+    // Runs the given tasks, which hold numElements entities between them, on up to threadCount threads
+    void run(size_t threadCount, const SystemTask *tasks, size_t numTasks, size_t numElements)
+    {
+        size_t numWorkers = threadCount > 1 ? threadCount - 1 : 0;
+        if (numWorkers != workers_.size())
+        {
+            stop();
+            start(numWorkers);
+        }
+
+        // Split the tasks where the running total of entities passes each thread's share
+        size_t numThreads = std::min(numWorkers + 1, std::max<size_t>(numElements / system_min_thread_elements, 1));
+        size_t rangeStarts[MAX_SYSTEM_THREADS + 1];
+        size_t thread = 1;
+        size_t elementsSoFar = 0;
+        rangeStarts[0] = 0;
+        for (size_t i = 0; i < numTasks && thread < numThreads; i++)
+        {
+            elementsSoFar += tasks[i].block->numElements;
+            if (elementsSoFar * numThreads >= thread * numElements)
+            {
+                rangeStarts[thread++] = i + 1;
+            }
+        }
+        // Rounding can leave the last threads without a range, in which case they just aren't woken
+        numThreads = thread;
+        rangeStarts[numThreads] = numTasks;
+
+        busyWorkers_.store(static_cast<uint32_t>(numThreads - 1));
+        for (size_t i = 1; i < numThreads; i++)
+        {
+            Worker& worker = workers_[i - 1];
+            worker.tasks = tasks + rangeStarts[i];
+            worker.numTasks = rangeStarts[i + 1] - rangeStarts[i];
+            worker.wake.fetch_add(1);
+            worker.wake.notify_one();
+        }
+
+        runTasks(tasks, rangeStarts[1]);
+
+        for (uint32_t busy = busyWorkers_.load(); busy != 0; busy = busyWorkers_.load())
+        {
+            busyWorkers_.wait(busy);
+        }
+    }
+
+private:
+    // A worker thread and the range of tasks it was last given, which it's woken for by incrementing wake
+    struct Worker {
+        std::thread thread;
+        std::atomic<uint32_t> wake{0};
+        const SystemTask *tasks = nullptr;
+        size_t numTasks = 0;
+    };
+
+    void start(size_t numWorkers)
+    {
+        workers_ = std::vector<Worker>(numWorkers);
+        stopping_.store(false);
+        for (size_t i = 0; i < numWorkers; i++)
+        {
+            workers_[i].thread = std::thread([this, i]() { workerLoop(workers_[i]); });
+        }
+    }
+
+    void stop()
+    {
+        stopping_.store(true);
+        for (Worker& worker : workers_)
+        {
+            worker.wake.fetch_add(1);
+            worker.wake.notify_one();
+            worker.thread.join();
+        }
+        workers_.clear();
+    }
+
+    static void runTasks(const SystemTask *tasks, size_t numTasks)
+    {
+        for (size_t i = 0; i < numTasks; i++)
+        {
+            const SystemTask& task = tasks[i];
+            task.system->callback(*task.match, task.block, task.system->arg);
+            multiarraylist_mark_changed(task.block, task.system->writes & task.match->archetype);
+        }
+    }
+
+    void workerLoop(Worker& worker)
+    {
+        uint32_t seenWake = 0;
+        while (true)
+        {
+            worker.wake.wait(seenWake);
+            seenWake = worker.wake.load();
+            if (stopping_.load())
+            {
+                return;
+            }
+            runTasks(worker.tasks, worker.numTasks);
+            if (busyWorkers_.fetch_sub(1) == 1)
+            {
+                busyWorkers_.notify_one();
+            }
+        }
+    }
+
+    std::vector<Worker> workers_;
+    std::atomic<uint32_t> busyWorkers_{0};
+    std::atomic<bool> stopping_{false};
+};
+
+SystemThreadPool systemThreadPool;
+
+// Blocks of the level being run, kept between levels and frames so the list only allocates when it grows
+std::vector<SystemTask> systemTasks;
+
+// Runs every system in the given level, spreading their blocks over the thread pool
+void runSystemLevel(int level)
+{
+    int i;
+
+    // Count the level's entities first, so a level too small to be worth splitting runs without building a task list
+    size_t numElements = 0;
+    for (i = 0; i < numSystems && systemThreadCount > 1; i++)
+    {
+        if (systems[i].level == level && !(systems[i].flags & SYSTEM_SERIAL))
+        {
+            for (const EntityQueryMatch& match : *systems[i].query)
+            {
+                numElements += multiarraylist_length(match.arr);
+            }
+        }
+    }
+    bool threaded = numElements >= 2 * system_min_thread_elements;
+
+    systemTasks.clear();
+    for (i = 0; i < numSystems; i++)
+    {
+        const System& system = systems[i];
+        if (system.level != level)
+        {
+            continue;
+        }
+        if ((system.flags & SYSTEM_SERIAL) || !threaded)
+        {
+            runSystemSerial(system);
+            continue;
+        }
+        for (const EntityQueryMatch& match : *system.query)
+        {
+            for (MultiArrayListBlock *block = match.arr->start; block != nullptr; block = block->next)
+            {
+                systemTasks.push_back({&system, &match, block});
+            }
+        }
+    }
+
+    if (!systemTasks.empty())
+    {
+        systemThreadPool.run(systemThreadCount, systemTasks.data(), systemTasks.size(), numElements);
+    }
+}
+
+#else
+
+// Without threads every system in the level just runs on the calling thread in registration order
+void runSystemLevel(int level)
+{
+    for (int i = 0; i < numSystems; i++)
+    {
+        if (systems[i].level == level)
+        {
+            runSystemSerial(systems[i]);
+        }
+    }
+}
+
+#endif
+
+void runSystems(void)
+{
+    int level, i;
+    for (level = 0; level < numSystemLevels; level++)
+    {
+        // Bring the queries up to date before any blocks run, since updating them isn't thread safe
+        for (i = 0; i < numSystems; i++)
+        {
+            if (systems[i].level == level)
+            {
+                systems[i].query->update();
+            }
+        }
+
+        runSystemLevel(level);
+    }
+
+    // Structural changes only happen once every system has run, so every level sees the same set of entities
+    process_entity_queues();
+}
@@ -210,18 +210,33 @@ void mtxf_align_camera(MtxF dest, MtxF mtx, Vec3 position, int16_t angle) {
     mtxfMul(dest, dest, scaleMat);
 }
 
+EntityQuery modelsNoRotationQuery{ARCHETYPE_MODEL_NO_ROTATION, Bit_Rotation | Bit_AnimState | Bit_Scale};
+EntityQuery modelsQuery{ARCHETYPE_MODEL, Bit_AnimState | Bit_Scale};
+EntityQuery animatedModelsQuery{ARCHETYPE_ANIM_MODEL, Bit_Scale};
+EntityQuery resizableModelsQuery{ARCHETYPE_SCALED_MODEL, Bit_AnimState};
+EntityQuery resizableAnimatedModelsQuery{ARCHETYPE_SCALED_ANIM_MODEL, 0};
+
+// Drawing only writes animation state, so the draws don't stamp the other components as changed
+constexpr archetype_t drawReadOnlyMask = Bit_Position | Bit_Rotation | Bit_Model | Bit_Scale;
+
+// Every entity with a model, which gets grouped by model a bit each frame so that consecutive draws share material state
+EntityQuery modelGroupingQuery{Bit_Model, 0};
+// Number of model comparisons to spend on grouping per frame
+constexpr int model_grouping_budget = 256;
+
 void drawAllEntities()
 {
+    ecs::group_by<ecs::Model>(modelGroupingQuery, model_grouping_budget);
     // Draw all non-resizable entities that have a model and no rotation or animation
-    iterateOverEntities(drawModelsNoRotation, nullptr, ARCHETYPE_MODEL_NO_ROTATION, Bit_Rotation | Bit_AnimState | Bit_Scale);
+    iterateOverEntities(drawModelsNoRotation, nullptr, modelsNoRotationQuery, drawReadOnlyMask);
     // Draw all non-resizable entities that have a model and no animation
-    iterateOverEntities(drawModels, nullptr, ARCHETYPE_MODEL, Bit_AnimState | Bit_Scale);
+    iterateOverEntities(drawModels, nullptr, modelsQuery, drawReadOnlyMask);
     // Draw all non-resizable entities that have a model and an animation
-    iterateOverEntities(drawAnimatedModels, nullptr, ARCHETYPE_ANIM_MODEL, Bit_Scale);
+    iterateOverEntities(drawAnimatedModels, nullptr, animatedModelsQuery, drawReadOnlyMask);
     // Draw all resizable entities that have a model and no animation
-    iterateOverEntities(drawResizableModels, nullptr, ARCHETYPE_SCALED_MODEL, Bit_AnimState);
+    iterateOverEntities(drawResizableModels, nullptr, resizableModelsQuery, drawReadOnlyMask);
     // Draw all resizable entities that have a model and an animation
-    iterateOverEntities(drawResizableAnimatedModels, nullptr, ARCHETYPE_SCALED_ANIM_MODEL, 0);
+    iterateOverEntities(drawResizableAnimatedModels, nullptr, resizableAnimatedModelsQuery, drawReadOnlyMask);
 }
 
 Model* head_model = nullptr;
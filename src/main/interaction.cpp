@@ -66,7 +66,7 @@ Entity *findClosestEntity(Vec3 pos, archetype_t archetype, float maxDist, float
     };
     // Entities need a position component to be "close" to something, so only look for ones that have it
     archetype |= Bit_Position;
-    iterateOverEntitiesAllComponents(findClosestCallback, &findData, archetype, 0);
+    iterateOverEntitiesAllComponents(findClosestCallback, &findData, archetype, 0, ~static_cast<archetype_t>(0));
 
     if (findData.entity != nullptr)
     {
@@ -2,8 +2,10 @@
 #include <cstdint>
 #include <cstring>
 
+#include <algorithm>
 #include <iterator>
 #include <array>
+#include <bit>
 // #include <span>
 
 extern "C" {
@@ -82,6 +84,55 @@ void MemoryBlock::insert_link(MemoryBlock *newPrev)
     _prevFree = newPrev;
 }
 
+// Sizes of the slab size classes, each one twice the last and the largest being mem_small_block_size
+constexpr size_t slab_min_size = 16;
+constexpr size_t slab_num_classes = std::bit_width(mem_small_block_size / slab_min_size);
+static_assert(slab_min_size << (slab_num_classes - 1) == mem_small_block_size, "Small block size must be a power of two multiple of the smallest slab size");
+
+/**
+ * Header at the start of a slab page, which is a single pool block split into equal sized slots for one size class
+ * Pages with free slots are kept in a list per size class, full pages aren't in any list until a slot is freed
+ * Slots are handed out in order until every one has been used once, after that freed slots are reused through a free list
+ * which is chained through the slots themselves. Offsets are from the start of the page, so 0 means none.
+ * A bit per slot tracks which ones are handed out, so that freeing a slot twice can't corrupt the page.
+ */
+struct SlabPage {
+    SlabPage *prevPartial;
+    SlabPage *nextPartial;
+    // Offset of the first freed slot, each freed slot holds the offset of the next one
+    uint16_t firstFree;
+    // Offset of the first slot that hasn't been handed out yet
+    uint16_t firstUnused;
+    uint16_t numUsed;
+    uint8_t sizeClass;
+    // One bit per slot, set while the slot is handed out
+    uint32_t usedSlots[2];
+};
+
+// Offset of the first slot in a slab page, keeps the slots aligned to the smallest slab size
+constexpr size_t slab_header_size = ROUND_UP(sizeof(SlabPage), slab_min_size);
+
+// Gets the size class for an allocation of the given size, which must be at most mem_small_block_size
+constexpr size_t slab_class_from_size(size_t size)
+{
+    return std::bit_width((std::max<size_t>(size, 1) - 1) / slab_min_size);
+}
+
+constexpr size_t slab_class_size(size_t sizeClass)
+{
+    return slab_min_size << sizeClass;
+}
+
+constexpr size_t slab_class_capacity(size_t sizeClass)
+{
+    return (mem_block_size - slab_header_size) / slab_class_size(sizeClass);
+}
+
+static_assert(slab_class_capacity(0) <= sizeof(SlabPage::usedSlots) * 8, "Slab page used slot bits can't cover every slot of the smallest size class");
+
+// Number of blocks covered by each word of the free block bitmap
+constexpr size_t mem_bitmap_word_bits = 32;
+
 class MemoryPool {
 private:
     // Pointer to the start of an array with an owner_t for each chunk representing
@@ -93,6 +144,15 @@ private:
     size_t _totalBlocks;
     // First free chunk in the free chunk chain
     MemoryBlock *_firstFree;
+    // Bit for each chunk that's set if the chunk is free, so runs of free chunks can be found a word at a time
+    // Bits past the last chunk are always clear
+    uint32_t *_freeBitmap;
+    // First slab page with a free slot for each size class
+    SlabPage *_partialSlabs[slab_num_classes];
+    void free_blocks(size_t index) noexcept;
+    void free_small(void *mem, size_t index) noexcept;
+    void set_free_bits(size_t start, size_t count, bool free) noexcept;
+    size_t find_best_fit(size_t num_blocks);
 public:
     MemoryPool() = default;
     MemoryPool(void *start, void *end);
@@ -100,6 +160,7 @@ public:
     MemoryBlock *block_from_index(size_t index);
     void *alloc(int num_blocks, owner_t owner);
     void free(void *mem) noexcept;
+    void *alloc_small(size_t size);
 };
 
 MemoryPool::MemoryPool(void *start, void *end)
@@ -108,8 +169,16 @@ MemoryPool::MemoryPool(void *start, void *end)
     // This is equal to the available memory divided by the chunk size plus the size of an owner, since
     // an extra owner value is needed for each chunk in the chunk table
     _totalBlocks = ((uintptr_t)end - (uintptr_t)start) / (mem_block_size + sizeof(owner_t));
+    // The free chunk bitmap goes after the chunk table, so give up chunks until both fit before the first chunk
+    size_t bitmapOffset = ROUND_UP(_totalBlocks * sizeof(owner_t), sizeof(uint32_t));
+    while ((uintptr_t)start + bitmapOffset + ROUND_UP(_totalBlocks, mem_bitmap_word_bits) / 8 > (uintptr_t)end - (_totalBlocks * mem_block_size))
+    {
+        _totalBlocks--;
+        bitmapOffset = ROUND_UP(_totalBlocks * sizeof(owner_t), sizeof(uint32_t));
+    }
     _blocksStart = (uintptr_t)end - (_totalBlocks * mem_block_size);
     _blockTable = static_cast<owner_t*>(start);
+    _freeBitmap = reinterpret_cast<uint32_t*>((uintptr_t)start + bitmapOffset);
 
     MemoryBlock *lastBlock = nullptr;
     MemoryBlock *curBlock = block_from_index(0);
@@ -129,6 +198,11 @@ MemoryPool::MemoryPool(void *start, void *end)
     new (curBlock) MemoryBlock(lastBlock, nullptr, _totalBlocks - 1);
     // Clear the block ownership table
     memset(_blockTable, ALLOC_FREE, _totalBlocks);
+    // Mark every chunk as free in the bitmap
+    memset(_freeBitmap, 0, ROUND_UP(_totalBlocks, mem_bitmap_word_bits) / 8);
+    set_free_bits(0, _totalBlocks, true);
+    // No slab pages yet, they get taken from the pool as they're needed
+    std::fill(std::begin(_partialSlabs), std::end(_partialSlabs), nullptr);
 }
 
 // Calculates a block's index from its address
@@ -145,6 +219,106 @@ MemoryBlock *MemoryPool::block_from_index(size_t index)
     return (MemoryBlock *)blockAddr;
 }
 
+// Sets or clears the free bits of a range of chunks, filling whole words at once where it can
+void MemoryPool::set_free_bits(size_t start, size_t count, bool free) noexcept
+{
+    size_t end = start + count;
+    while (start < end)
+    {
+        size_t bit = start % mem_bitmap_word_bits;
+        size_t numBits = std::min(end - start, mem_bitmap_word_bits - bit);
+        uint32_t mask = (numBits == mem_bitmap_word_bits ? ~0U : ((1U << numBits) - 1)) << bit;
+        uint32_t *word = &_freeBitmap[start / mem_bitmap_word_bits];
+        *word = free ? (*word | mask) : (*word & ~mask);
+        start += numBits;
+    }
+}
+
+// Checks if a word of the bitmap has at least the given number of consecutive set bits
+// Each step ands the word with itself shifted down, so a bit stays set only if the bits above it were set as well,
+// and the shift doubles every step to cover the run in log2(length) steps
+static bool has_bit_run(uint32_t word, size_t length)
+{
+    size_t shift = 1;
+    size_t remaining = length - 1;
+    while (remaining != 0 && word != 0)
+    {
+        size_t step = std::min(shift, remaining);
+        word &= word >> step;
+        remaining -= step;
+        shift *= 2;
+    }
+    return word != 0;
+}
+
+// Finds the start of the smallest run of free chunks that can hold the given number of chunks, or returns the total
+// chunk count if there isn't one. Taking the best fit leaves the larger runs intact for later large allocations.
+// Freed chunks are marked in the bitmap right away, so neighbouring free chunks always show up as one run.
+// The bitmap is scanned a word at a time: full and empty words extend or end the current run, and the runs inside
+// a word are only looked at bit by bit if one of them is long enough to hold the allocation.
+size_t MemoryPool::find_best_fit(size_t num_blocks)
+{
+    size_t numWords = ROUND_UP(_totalBlocks, mem_bitmap_word_bits) / mem_bitmap_word_bits;
+    size_t bestStart = _totalBlocks;
+    size_t bestLength = SIZE_MAX;
+    size_t runStart = 0;
+    size_t runLength = 0;
+    auto checkRun = [&](size_t start, size_t length)
+    {
+        if (length >= num_blocks && length < bestLength)
+        {
+            bestStart = start;
+            bestLength = length;
+        }
+    };
+
+    for (size_t wordIndex = 0; wordIndex < numWords; wordIndex++)
+    {
+        uint32_t word = _freeBitmap[wordIndex];
+        size_t wordStart = wordIndex * mem_bitmap_word_bits;
+        if (word == ~0U)
+        {
+            if (runLength == 0)
+                runStart = wordStart;
+            runLength += mem_bitmap_word_bits;
+            continue;
+        }
+
+        // The current run carries on into the low bits of the word and ends there
+        size_t lowLength = std::countr_one(word);
+        if (runLength == 0)
+            runStart = wordStart;
+        checkRun(runStart, runLength + lowLength);
+        // Can't do any better than an exact fit
+        if (bestLength == num_blocks)
+            break;
+        word &= ~0U << lowLength;
+
+        // A run in the high bits might carry on into the next word, so it becomes the current run
+        size_t highLength = std::countl_one(word);
+        if (highLength != 0)
+            word &= ~(~0U << (mem_bitmap_word_bits - highLength));
+
+        // Check the runs that start and end inside the word
+        if (num_blocks < mem_bitmap_word_bits && has_bit_run(word, num_blocks))
+        {
+            while (word != 0)
+            {
+                size_t bit = std::countr_zero(word);
+                size_t length = std::countr_one(word >> bit);
+                checkRun(wordStart + bit, length);
+                word &= ~(((1U << length) - 1) << bit);
+            }
+        }
+
+        runStart = wordStart + mem_bitmap_word_bits - highLength;
+        runLength = highLength;
+    }
+    if (bestLength != num_blocks)
+        checkRun(runStart, runLength);
+    return bestStart;
+}
+
 // std::mutex mem_mutex{};
 
 // Allocates a contiguous number of blocks with the given owner
@@ -168,57 +342,41 @@ void *MemoryPool::alloc(int num_blocks, owner_t owner)
             "Double alloc at %08X\nAlready claimed by owner %d", retBlock, prev_owner);
         _firstFree = _firstFree->unlink();
         _blockTable[retBlock->index()] = owner;
+        set_free_bits(retBlock->index(), 1, false);
         
         // debug_printf("Allocated %08X\n", retBlock);
         return retBlock;
     }
     else
     {
-        // Iterate over every free block to find a large enough contiguous region of free blocks
-        for (auto &freeBlock : *_firstFree)
+        // Find a large enough contiguous region of free blocks
+        size_t freeBlockIndex = find_best_fit(num_blocks);
+        if (freeBlockIndex < _totalBlocks)
         {
-            // Get the index of the current free block to check if the blocks directly after it are free
-            size_t freeBlockIndex = freeBlock.index();
-            // Determine the end of the current required contiguous blocks
+            // Determine the end of the region
             size_t endBlockIndex = freeBlockIndex + num_blocks;
-            // Record if the blocks were all free
-            int allocSuccessful = true;
-            for (size_t checkedBlockIndex = freeBlockIndex + 1; checkedBlockIndex < endBlockIndex; checkedBlockIndex++)
-            {
-                // At the end of available memory, not enough room to allocate the given number of blocks
-                // or
-                // A long enough contiguous region of free blocks is not available starting at the current free block
-                if (checkedBlockIndex >= _totalBlocks || _blockTable[checkedBlockIndex] != ALLOC_FREE)
-                {
-                    allocSuccessful = false;
-                    break;
-                }
-            }
-            // If we found a valid region to allocate, allocate it
-            if (allocSuccessful)
+            owner_t updatedOwner = owner;
+
+            // Allocate the region
+            for (size_t curBlockIndex = freeBlockIndex; curBlockIndex < endBlockIndex; curBlockIndex++)
             {
-                owner_t updatedOwner = owner;
-
-                // Allocate the region
-                for (size_t curBlockIndex = freeBlockIndex; curBlockIndex < endBlockIndex; curBlockIndex++)
-                {
-                    // Get the current block from its index
-                    MemoryBlock *curBlock = block_from_index(curBlockIndex);
-                    // Unlink the current block from the free block chain
-                    MemoryBlock *newLink = curBlock->unlink();
-                    // Update the owner of the current block
-                    _blockTable[curBlockIndex] = updatedOwner;
-                    // Make every block besides the first one owned by a contiguous allocation,
-                    // since only the first block in a contiguous allocation has the actual owner
-                    updatedOwner = ALLOC_CONTIGUOUS;
-                    // If we allocated the first free block, find a new first free block
-                    if (curBlock == _firstFree)
-                        _firstFree = newLink;
-                }
-
-                // debug_printf("Allocated %08X\n", freeBlock);
-                return &freeBlock;
+                // Get the current block from its index
+                MemoryBlock *curBlock = block_from_index(curBlockIndex);
+                // Unlink the current block from the free block chain
+                MemoryBlock *newLink = curBlock->unlink();
+                // Update the owner of the current block
+                _blockTable[curBlockIndex] = updatedOwner;
+                // Make every block besides the first one owned by a contiguous allocation,
+                // since only the first block in a contiguous allocation has the actual owner
+                updatedOwner = ALLOC_CONTIGUOUS;
+                // If we allocated the first free block, find a new first free block
+                if (curBlock == _firstFree)
+                    _firstFree = newLink;
             }
+            set_free_bits(freeBlockIndex, num_blocks, false);
+
+            // debug_printf("Allocated %08X\n", block_from_index(freeBlockIndex));
+            return block_from_index(freeBlockIndex);
         }
     }
     return nullptr;
@@ -233,7 +391,12 @@ void MemoryPool::free(void *mem) noexcept
     MemoryBlock *toFree = static_cast<MemoryBlock*>(mem);
     // Get the index of the block being freed
     size_t toFreeIndex = index_from_block(toFree);
-    // Free any blocks that are part of the start block's allocation
+    // Small allocations point somewhere inside a slab page rather than at the start of a block
+    if (_blockTable[toFreeIndex] == ALLOC_SLAB)
+    {
+        free_small(mem, toFreeIndex);
+        return;
+    }
     if (_blockTable[toFreeIndex] == ALLOC_FREE)
     {
         // Double free
@@ -241,6 +404,14 @@ void MemoryPool::free(void *mem) noexcept
         return;
         // *(volatile uint8_t*)toFreeIndex = 0;
     }
+    free_blocks(toFreeIndex);
+}
+
+// Frees the allocation starting at the given block index, along with any blocks that are part of it
+void MemoryPool::free_blocks(size_t toFreeIndex) noexcept
+{
+    size_t startIndex = toFreeIndex;
+    MemoryBlock *toFree = block_from_index(toFreeIndex);
     do 
     {
         // Reinitialize the MemoryBlock with its index and no linked blocks
@@ -260,7 +431,107 @@ void MemoryPool::free(void *mem) noexcept
         // Get the next block to be freed
         toFree = block_from_index(toFreeIndex);
     // Continue freeing blocks that are marked as being from a contiguous allocation
-    } while (_blockTable[toFreeIndex] == ALLOC_CONTIGUOUS);
+    } while (toFreeIndex < _totalBlocks && _blockTable[toFreeIndex] == ALLOC_CONTIGUOUS);
+    set_free_bits(startIndex, toFreeIndex - startIndex, true);
+}
+
+// Allocates a slot from a slab page of the size class for the given size, taking a new page from the pool if no page has a free slot
+void *MemoryPool::alloc_small(size_t size)
+{
+    size_t sizeClass = slab_class_from_size(size);
+    SlabPage *page = _partialSlabs[sizeClass];
+    if (page == nullptr)
+    {
+        page = static_cast<SlabPage*>(alloc(1, ALLOC_SLAB));
+        if (page == nullptr)
+            return nullptr;
+        page->prevPartial = nullptr;
+        page->nextPartial = nullptr;
+        page->firstFree = 0;
+        page->firstUnused = slab_header_size;
+        page->numUsed = 0;
+        page->sizeClass = sizeClass;
+        page->usedSlots[0] = 0;
+        page->usedSlots[1] = 0;
+        _partialSlabs[sizeClass] = page;
+    }
+
+    uint8_t *pageStart = reinterpret_cast<uint8_t*>(page);
+    void *ret;
+    if (page->firstFree != 0)
+    {
+        ret = pageStart + page->firstFree;
+        page->firstFree = *static_cast<uint16_t*>(ret);
+    }
+    else
+    {
+        ret = pageStart + page->firstUnused;
+        page->firstUnused += slab_class_size(sizeClass);
+    }
+    size_t slot = (static_cast<uint8_t*>(ret) - pageStart - slab_header_size) / slab_class_size(sizeClass);
+    page->usedSlots[slot / 32] |= 1U << (slot % 32);
+    page->numUsed++;
+    // The page is full, so take it out of the list until one of its slots gets freed
+    if (page->numUsed == slab_class_capacity(sizeClass))
+    {
+        _partialSlabs[sizeClass] = page->nextPartial;
+        if (page->nextPartial != nullptr)
+            page->nextPartial->prevPartial = nullptr;
+    }
+    return ret;
+}
+
+// Returns a slot to its slab page, giving the page back to the pool once none of its slots are in use
+void MemoryPool::free_small(void *mem, size_t index) noexcept
+{
+    SlabPage *page = reinterpret_cast<SlabPage*>(block_from_index(index));
+    size_t sizeClass = page->sizeClass;
+    uint16_t offset = uintptr_t(mem) - uintptr_t(page);
+
+    // Pointers into the page header were never handed out, and neither were slots whose used bit is clear (a double free)
+    // Both are ignored the same way free ignores freeing a free block, letting a double free through would chain a live
+    // slot into the free list, and could give the whole page back while it's in use
+    if (offset < slab_header_size)
+    {
+        return;
+    }
+    size_t slot = (offset - slab_header_size) / slab_class_size(sizeClass);
+    uint32_t slotBit = 1U << (slot % 32);
+    if (!(page->usedSlots[slot / 32] & slotBit))
+    {
+        return;
+    }
+    vassert((offset - slab_header_size) % slab_class_size(sizeClass) == 0,
+        "Freed %08X which isn't the start of a slab slot", mem);
+    page->usedSlots[slot / 32] &= ~slotBit;
+
+    // The page was full, so it isn't in the list yet
+    if (page->numUsed == slab_class_capacity(sizeClass))
+    {
+        page->prevPartial = nullptr;
+        page->nextPartial = _partialSlabs[sizeClass];
+        if (page->nextPartial != nullptr)
+            page->nextPartial->prevPartial = page;
+        _partialSlabs[sizeClass] = page;
+    }
+    page->numUsed--;
+
+    // Empty pages go straight back to the pool so they don't fragment it, starting a new page later is cheap since
+    // its slots don't need to be chained together up front
+    if (page->numUsed == 0)
+    {
+        if (page->prevPartial != nullptr)
+            page->prevPartial->nextPartial = page->nextPartial;
+        else
+            _partialSlabs[sizeClass] = page->nextPartial;
+        if (page->nextPartial != nullptr)
+            page->nextPartial->prevPartial = page->prevPartial;
+        free_blocks(index);
+        return;
+    }
+
+    *static_cast<uint16_t*>(mem) = page->firstFree;
+    page->firstFree = offset;
 }
 
 // Global MemoryPool object
@@ -284,6 +555,11 @@ void *allocRegion(int length, owner_t owner)
     return g_memoryPool.alloc((length + (mem_block_size - 1)) / mem_block_size, owner);
 }
 
+void *allocSmall(size_t length)
+{
+    return g_memoryPool.alloc_small(length);
+}
+
 void freeAlloc(void *start) noexcept
 {
     g_memoryPool.free(start);
@@ -291,7 +567,8 @@ void freeAlloc(void *start) noexcept
 
 void* operator new(size_t sz)
 {
-    void *ret = allocRegion(sz, ALLOC_NEW);
+    // Small objects share slab pages instead of each taking up a whole block
+    void *ret = sz <= mem_small_block_size ? allocSmall(sz) : allocRegion(sz, ALLOC_NEW);
     if (ret == nullptr)
     {
 #if __cpp_exceptions
@@ -305,7 +582,7 @@ void* operator new(size_t sz)
 
 void *operator new[](size_t sz)
 {
-    void *ret = allocRegion(sz, ALLOC_NEW_ARR);
+    void *ret = sz <= mem_small_block_size ? allocSmall(sz) : allocRegion(sz, ALLOC_NEW_ARR);
     if (ret == nullptr)
     {
 #if __cpp_exceptions
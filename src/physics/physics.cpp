@@ -2,6 +2,7 @@
 #include <config.h>
 #include <mathutils.h>
 #include <ecs.h>
+#include <systems.h>
 #include <collision.h>
 
 #include <n64_mathutils.h>
@@ -17,91 +18,85 @@ extern "C" {
 #define ARCHETYPE_VEL_COLLIDER  (Bit_Position | Bit_Velocity | Bit_Collider)
 #define ARCHETYPE_DEACTIVATABLE (Bit_Position | Bit_Deactivatable)
 
-void applyGravityImpl(size_t count, Vec3* cur_vel, GravityParams* gravity, ActiveState* active_state)
+FORCEINLINE void applyGravity(Vec3& vel, const GravityParams& gravity)
 {
-    while (count)
-    {
-        if (active_state == nullptr || !active_state->deactivated)
-        {
-            (*cur_vel)[1] += gravity->accel;
-
-            if ((*cur_vel)[1] < gravity->terminalVelocity)
-            {
-                (*cur_vel)[1] = gravity->terminalVelocity;
-            }
-            
-        }
+    vel[1] += gravity.accel;
 
-        if (active_state != nullptr)
-        {
-            active_state++;
-        }
-        
-        cur_vel++;
-        gravity++;
-        count--;
+    if (vel[1] < gravity.terminalVelocity)
+    {
+        vel[1] = gravity.terminalVelocity;
     }
 }
 
-void applyGravityCallback(size_t count, UNUSED void *arg, void **componentArrays)
-{
-    // Components: Velocity, Gravity
-    Vec3 *cur_vel = get_component<Bit_Velocity, Vec3>(componentArrays, ARCHETYPE_GRAVITY);
-    GravityParams *gravity =  get_component<Bit_Gravity, GravityParams>(componentArrays, ARCHETYPE_GRAVITY);
-    applyGravityImpl(count, cur_vel, gravity, nullptr);
-}
+// Deactivated entities are in their own archetypes, so rejecting the Inactive tag skips them without a per-entity check
+// The deactivatable variants still check the flag, since it can be set without the entity being moved (e.g. by level data
+// or a behavior writing its ActiveState) until something syncs it with activateEntities or deactivateEntities
+EntityQuery gravityQuery{ARCHETYPE_GRAVITY, Bit_Deactivatable | Bit_Inactive};
+EntityQuery gravityDeactivatableQuery{ARCHETYPE_GRAVITY | Bit_Deactivatable, Bit_Inactive};
+EntityQuery velocityQuery{ARCHETYPE_POSVEL, Bit_Deactivatable | Bit_Inactive};
+EntityQuery velocityDeactivatableQuery{ARCHETYPE_POSVEL | Bit_Deactivatable, Bit_Inactive};
 
-void applyGravityDeactivatableCallback(size_t count, UNUSED void *arg, void **componentArrays)
-{
-    Vec3 *cur_vel = get_component<Bit_Velocity, Vec3>(componentArrays, ARCHETYPE_GRAVITY | Bit_Deactivatable);
-    GravityParams *gravity =  get_component<Bit_Gravity, GravityParams>(componentArrays, ARCHETYPE_GRAVITY | Bit_Deactivatable);
-    ActiveState *active_state = get_component<Bit_Deactivatable, ActiveState>(componentArrays, ARCHETYPE_GRAVITY | Bit_Deactivatable);
-    applyGravityImpl(count, cur_vel, gravity, active_state);
-}
-
-void applyVelocityImpl(size_t count, Vec3* cur_pos, Vec3* cur_vel, ActiveState* active_state)
+void physicsTick()
 {
-    while (count)
-    {
-        if (active_state == nullptr || !active_state->deactivated)
+    // Apply gravity to all objects that cannot be deactivated and are affected by it
+    ecs::each<ecs::Velocity, const ecs::Gravity>(gravityQuery,
+        [](Vec3& vel, const GravityParams& gravity)
         {
-            VEC3_ADD(*cur_pos, *cur_pos, *cur_vel);
-        }
-
-        if (active_state)
+            applyGravity(vel, gravity);
+        });
+    // Apply gravity to all active objects that can be deactivated and are affected by it
+    ecs::each<ecs::Velocity, const ecs::Gravity, const ecs::Deactivatable>(gravityDeactivatableQuery,
+        [](Vec3& vel, const GravityParams& gravity, const ActiveState& active_state)
         {
-            active_state++;
-        }
-
-        cur_pos++;
-        cur_vel++;
-        count--;
-    }
-}
-
-void applyVelocityCallback(size_t count, UNUSED void *arg, void **componentArrays)
-{
-    Vec3 *cur_pos = get_component<Bit_Position, Vec3>(componentArrays, ARCHETYPE_POSVEL);
-    Vec3 *cur_vel = get_component<Bit_Velocity, Vec3>(componentArrays, ARCHETYPE_POSVEL);
-    applyVelocityImpl(count, cur_pos, cur_vel, nullptr);
-}
-
-void applyVelocityDeactivatableCallback(size_t count, UNUSED void *arg, void **componentArrays)
-{
-    Vec3 *cur_pos = get_component<Bit_Position, Vec3>(componentArrays, ARCHETYPE_POSVEL | Bit_Deactivatable);
-    Vec3 *cur_vel = get_component<Bit_Velocity, Vec3>(componentArrays, ARCHETYPE_POSVEL | Bit_Deactivatable);
-    ActiveState *active_state = get_component<Bit_Deactivatable, ActiveState>(componentArrays, ARCHETYPE_POSVEL | Bit_Deactivatable);
-    applyVelocityImpl(count, cur_pos, cur_vel, active_state);
+            if (!active_state.deactivated)
+            {
+                applyGravity(vel, gravity);
+            }
+        });
+    // Apply every non-deactivatable object's velocity to their position
+    ecs::each<ecs::Position, const ecs::Velocity>(velocityQuery,
+        [](Vec3& pos, const Vec3& vel)
+        {
+            VEC3_ADD(pos, pos, vel);
+        });
+    // Apply every active deactivatable object's velocity to their position
+    ecs::each<ecs::Position, const ecs::Velocity, const ecs::Deactivatable>(velocityDeactivatableQuery,
+        [](Vec3& pos, const Vec3& vel, const ActiveState& active_state)
+        {
+            if (!active_state.deactivated)
+            {
+                VEC3_ADD(pos, pos, vel);
+            }
+        });
 }
 
-void physicsTick()
+void registerPhysicsSystems()
 {
-    // Apply gravity to all objects that cannot be deactivated and are affected by it
-    iterateOverEntities(applyGravityCallback, nullptr, ARCHETYPE_GRAVITY, Bit_Deactivatable);
-    // Apply gravity to all objects that can be deactivated and are affected by it
-    iterateOverEntities(applyGravityDeactivatableCallback, nullptr, ARCHETYPE_GRAVITY | Bit_Deactivatable, 0);
-    // Apply every non-deactivatable object's velocity to their position
-    iterateOverEntities(applyVelocityCallback, nullptr, ARCHETYPE_POSVEL, Bit_Deactivatable);
-    // Apply every deactivatable object's velocity to their position
-    iterateOverEntities(applyVelocityDeactivatableCallback, nullptr, ARCHETYPE_POSVEL | Bit_Deactivatable, 0);
+    // The deactivatable and non-deactivatable variants never match the same entities, so each pair can run side by side
+    registerSystem(gravityQuery, Bit_Gravity, Bit_Velocity,
+        ecs::system_callback<ecs::Velocity, const ecs::Gravity>([](Vec3& vel, const GravityParams& gravity)
+        {
+            applyGravity(vel, gravity);
+        }), nullptr);
+    registerSystem(gravityDeactivatableQuery, Bit_Gravity | Bit_Deactivatable, Bit_Velocity,
+        ecs::system_callback<ecs::Velocity, const ecs::Gravity, const ecs::Deactivatable>([](Vec3& vel, const GravityParams& gravity, const ActiveState& active_state)
+        {
+            if (!active_state.deactivated)
+            {
+                applyGravity(vel, gravity);
+            }
+        }), nullptr);
+    registerSystem(velocityQuery, Bit_Velocity, Bit_Position,
+        ecs::system_callback<ecs::Position, const ecs::Velocity>([](Vec3& pos, const Vec3& vel)
+        {
+            VEC3_ADD(pos, pos, vel);
+        }), nullptr);
+    registerSystem(velocityDeactivatableQuery, Bit_Velocity | Bit_Deactivatable, Bit_Position,
+        ecs::system_callback<ecs::Position, const ecs::Velocity, const ecs::Deactivatable>([](Vec3& pos, const Vec3& vel, const ActiveState& active_state)
+        {
+            if (!active_state.deactivated)
+            {
+                VEC3_ADD(pos, pos, vel);
+            }
+        }), nullptr);
 }
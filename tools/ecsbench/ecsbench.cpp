@@ -0,0 +1,1083 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ecs.h>
+#include <interaction.h>
+#include <mathutils.h>
+#include <physics.h>
+#include <spatial_index.h>
+#include <systems.h>
+
+using bench_clock = std::chrono::steady_clock;
+
+// Number of entities created and then deleted in each timed pass
+constexpr int entities_per_pass = 16384;
+// Number of timed passes per archetype count
+constexpr int passes = 16;
+// Number of delete + create pairs in the churn benchmark
+constexpr int churn_iterations = 65536;
+
+// Registers the given number of distinct archetypes, the order mirrors a level registering them as it loads
+std::vector<archetype_t> make_archetypes(int count)
+{
+    std::vector<archetype_t> ret;
+    ret.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        // Every nonzero combination of component bits is a valid archetype, so just count upwards
+        archetype_t archetype = i + 1;
+        registerArchetype(archetype);
+        ret.push_back(archetype);
+    }
+    return ret;
+}
+
+double elapsed_ns(bench_clock::time_point start, bench_clock::time_point end)
+{
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// File given with --stats, which gets a line of JSON with the ECS's stats every time dump_stats is called
+FILE *stats_file = nullptr;
+
+// Writes the current ecs::stats to the stats file, labelled with the benchmark that's running
+void dump_stats(const std::string& label)
+{
+    if (stats_file == nullptr)
+    {
+        return;
+    }
+    ecs::ArchetypeStats archetypes[MAX_ARCHETYPES];
+    ecs::Stats stats = ecs::stats(archetypes, MAX_ARCHETYPES);
+    fprintf(stats_file, "{\"label\":\"%s\",\"archetypes\":%d,\"occupied_archetypes\":%d,\"entities\":%u,\"blocks\":%u,"
+        "\"bytes_allocated\":%u,\"bytes_wasted\":%u,\"entity_slots\":%u,\"entity_gaps\":%u,\"entity_table_bytes\":%u,"
+        "\"queued_creations\":%u,\"queued_deletions\":%u,\"queued_other\":%u,\"command_bytes\":%u,\"command_buffer_bytes\":%u,"
+        "\"archetype_stats\":[",
+        label.c_str(), stats.numArchetypes, stats.numOccupiedArchetypes, stats.numEntities, stats.numBlocks,
+        stats.bytesAllocated, stats.bytesWasted, stats.entitySlots, stats.entityGaps, stats.entityTableBytes,
+        stats.queuedCreations, stats.queuedDeletions, stats.queuedOther, stats.commandBytes, stats.commandBufferBytes);
+    for (int i = 0; i < stats.numArchetypes; i++)
+    {
+        const ecs::ArchetypeStats& cur = archetypes[i];
+        fprintf(stats_file, "%s{\"archetype\":%u,\"entities\":%u,\"blocks\":%u,\"rows_per_block\":%u,\"bytes_per_row\":%u,"
+            "\"fill_ratio\":%.4f,\"bytes_wasted\":%u}",
+            i == 0 ? "" : ",", cur.archetype, cur.numEntities, cur.numBlocks, cur.elementCount, cur.bytesPerRow,
+            static_cast<double>(cur.fillRatio), cur.bytesWasted);
+    }
+    fprintf(stats_file, "]}\n");
+}
+
+// Measures createEntity and deleteEntity throughput with entities spread evenly over the given number of archetypes
+void bench_create_delete(int archetype_count)
+{
+    deleteAllEntities();
+    std::vector<archetype_t> archetypes = make_archetypes(archetype_count);
+    std::vector<Entity*> entities(entities_per_pass);
+    double create_ns = 0.0;
+    double delete_ns = 0.0;
+
+    for (int pass = 0; pass < passes; pass++)
+    {
+        auto create_start = bench_clock::now();
+        for (int i = 0; i < entities_per_pass; i++)
+        {
+            entities[i] = createEntity(archetypes[i % archetype_count]);
+        }
+        auto create_end = bench_clock::now();
+
+        for (int i = 0; i < entities_per_pass; i++)
+        {
+            deleteEntity(entities[i]);
+        }
+        auto delete_end = bench_clock::now();
+
+        create_ns += elapsed_ns(create_start, create_end);
+        delete_ns += elapsed_ns(create_end, delete_end);
+    }
+
+    printf("%10d %14.2f %14.2f\n", archetype_count,
+        create_ns / (passes * entities_per_pass),
+        delete_ns / (passes * entities_per_pass));
+}
+
+// Measures spawn cost once allEntities is fragmented, by repeatedly killing a random live entity and spawning a new one
+void bench_churn(int live_count)
+{
+    constexpr archetype_t churn_archetype = Bit_Position | Bit_Velocity;
+    deleteAllEntities();
+    std::vector<Entity*> entities(live_count);
+    // Fixed seed so runs are comparable
+    srand(1);
+
+    for (int i = 0; i < live_count; i++)
+    {
+        entities[i] = createEntity(churn_archetype);
+    }
+
+    auto start = bench_clock::now();
+    for (int i = 0; i < churn_iterations; i++)
+    {
+        Entity*& victim = entities[rand() % live_count];
+        deleteEntity(victim);
+        victim = createEntity(churn_archetype);
+    }
+    auto end = bench_clock::now();
+
+    printf("%10d %14.2f\n", live_count, elapsed_ns(start, end) / churn_iterations);
+    dump_stats("churn " + std::to_string(live_count));
+}
+
+void count_entities_callback(size_t count, void *arg, UNUSED void **componentArrays)
+{
+    *static_cast<size_t*>(arg) += count;
+}
+
+// Measures the per-call overhead of iterating with a component mask versus a cached query, with the given number of archetypes registered
+// Only a quarter of the archetypes match, which mirrors the draw and physics passes
+void bench_iterate(int archetype_count)
+{
+    constexpr int iterations = 4096;
+    constexpr archetype_t query_mask = Bit_Position | Bit_Velocity;
+    deleteAllEntities();
+    std::vector<archetype_t> archetypes = make_archetypes(archetype_count);
+    EntityQuery query{query_mask, 0};
+    size_t visited = 0;
+
+    for (archetype_t archetype : archetypes)
+    {
+        createEntities(archetype, 16);
+    }
+
+    auto mask_start = bench_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        iterateOverEntities(count_entities_callback, &visited, query_mask, 0);
+    }
+    auto mask_end = bench_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        iterateOverEntities(count_entities_callback, &visited, query);
+    }
+    auto query_end = bench_clock::now();
+
+    printf("%10d %14.2f %14.2f\n", archetype_count,
+        elapsed_ns(mask_start, mask_end) / iterations,
+        elapsed_ns(mask_end, query_end) / iterations);
+}
+
+// Spawns entities with a handful of components set the way the game's spawn sites do, by filling them in from the createEntitiesCallback callback
+void init_bullets_callback(size_t count, UNUSED void *arg, void **componentArrays)
+{
+    Vec3 *vel = static_cast<Vec3*>(componentArrays[2]);
+    Vec3s *rot = static_cast<Vec3s*>(componentArrays[3]);
+    float *scale = static_cast<float*>(componentArrays[4]);
+    uint16_t *timer = static_cast<uint16_t*>(componentArrays[5]);
+    for (size_t i = 0; i < count; i++)
+    {
+        vel[i][0] = 0.0f; vel[i][1] = 0.0f; vel[i][2] = 40.0f;
+        rot[i][0] = 0; rot[i][1] = 0x4000; rot[i][2] = 0;
+        scale[i] = 0.5f;
+        timer[i] = 90;
+    }
+}
+
+// Compares spawning initialized entities with a per-entity callback versus copying them from a prefab
+void bench_spawn(int spawn_count)
+{
+    constexpr archetype_t bullet_archetype = Bit_Position | Bit_Velocity | Bit_Rotation | Bit_Scale | Bit_DestroyTimer;
+    constexpr int iterations = 64;
+    ecs::Prefab prefab{bullet_archetype};
+    prefab.get<ecs::Velocity>()[2] = 40.0f;
+    prefab.get<ecs::Rotation>()[1] = 0x4000;
+    prefab.get<ecs::Scale>() = 0.5f;
+    prefab.get<ecs::DestroyTimer>() = 90;
+    double callback_ns = 0.0;
+    double prefab_ns = 0.0;
+
+    deleteAllEntities();
+    for (int i = 0; i < iterations; i++)
+    {
+        auto callback_start = bench_clock::now();
+        createEntitiesCallback(bullet_archetype, nullptr, spawn_count, init_bullets_callback);
+        auto callback_end = bench_clock::now();
+        deleteAllEntities();
+
+        auto prefab_start = bench_clock::now();
+        ecs::spawn(prefab, spawn_count);
+        auto prefab_end = bench_clock::now();
+        deleteAllEntities();
+
+        callback_ns += elapsed_ns(callback_start, callback_end);
+        prefab_ns += elapsed_ns(prefab_start, prefab_end);
+    }
+
+    printf("%10d %14.2f %14.2f\n", spawn_count,
+        callback_ns / (static_cast<double>(iterations) * spawn_count),
+        prefab_ns / (static_cast<double>(iterations) * spawn_count));
+}
+
+// Measures ecs::snapshot and ecs::restore over a world of the given size, spread over archetypes shaped like a level's
+void bench_snapshot(int entity_count)
+{
+    constexpr archetype_t snapshot_archetypes[] = {
+        ARCHETYPE_MODEL,
+        ARCHETYPE_SCALED_MODEL,
+        Bit_Position | Bit_Velocity | Bit_Rotation | Bit_Model | Bit_Gravity,
+        Bit_Position | Bit_Velocity | Bit_Scale | Bit_DestroyTimer,
+    };
+    constexpr int iterations = 32;
+    ecs::Snapshot snapshot;
+    EntityQuery moving_query{Bit_Position | Bit_Velocity, 0};
+    double full_ns = 0.0, unchanged_ns = 0.0, moved_ns = 0.0, restore_ns = 0.0;
+    size_t moved_bytes = 0;
+
+    deleteAllEntities();
+    for (int i = 0; i < entity_count; i++)
+    {
+        createEntity(snapshot_archetypes[i % std::size(snapshot_archetypes)]);
+    }
+
+    for (int i = 0; i < iterations; i++)
+    {
+        snapshot.clear();
+        auto full_start = bench_clock::now();
+        ecs::snapshot(snapshot);
+        auto full_end = bench_clock::now();
+        ecs::snapshot(snapshot);
+        auto unchanged_end = bench_clock::now();
+
+        // Move everything with a velocity, which is half of the world
+        ecs::each<ecs::Position, const ecs::Velocity>(moving_query, [](Vec3& pos, const Vec3& vel)
+            {
+                pos[0] += vel[0] + 1.0f;
+            });
+        auto moved_start = bench_clock::now();
+        ecs::snapshot(snapshot);
+        auto moved_end = bench_clock::now();
+        moved_bytes = snapshot.bytesCopied();
+
+        ecs::each<ecs::Position, const ecs::Velocity>(moving_query, [](Vec3& pos, const Vec3& vel)
+            {
+                pos[1] += vel[1] + 1.0f;
+            });
+        auto restore_start = bench_clock::now();
+        ecs::restore(snapshot);
+        auto restore_end = bench_clock::now();
+
+        full_ns += elapsed_ns(full_start, full_end);
+        unchanged_ns += elapsed_ns(full_end, unchanged_end);
+        moved_ns += elapsed_ns(moved_start, moved_end);
+        restore_ns += elapsed_ns(restore_start, restore_end);
+    }
+
+    printf("%10d %10zu %10zu %10.1f %10.1f %10.1f %10.1f\n", entity_count, snapshot.size(), moved_bytes,
+        full_ns / iterations / 1000.0, unchanged_ns / iterations / 1000.0, moved_ns / iterations / 1000.0, restore_ns / iterations / 1000.0);
+    deleteAllEntities();
+}
+
+// Random coordinate within an area of the given size centered on the origin
+float random_coord(float size)
+{
+    return (static_cast<float>(rand()) / static_cast<float>(RAND_MAX) - 0.5f) * size;
+}
+
+// Compares the spatial index against the linear scans it replaces, with the given number of entities scattered over a level sized area
+void bench_spatial(int entity_count)
+{
+    constexpr float area_size = 16384.0f;
+    constexpr float search_radius = 512.0f;
+    constexpr int queries = 256;
+    constexpr int max_found = 1024;
+    static Entity *found[max_found];
+    SpatialIndex index{Bit_Velocity, 0, 512.0f};
+    Vec3 query_points[queries];
+    double linear_nearest_ns = 0.0, index_nearest_ns = 0.0, linear_radius_ns = 0.0, index_radius_ns = 0.0;
+    int linear_found = 0, index_found = 0;
+
+    deleteAllEntities();
+    srand(1);
+    createEntitiesCallback(Bit_Position | Bit_Velocity, nullptr, entity_count,
+        [](size_t count, void *, void **componentArrays)
+        {
+            Vec3 *positions = static_cast<Vec3*>(componentArrays[COMPONENT_INDEX(Position, Bit_Position | Bit_Velocity)]);
+            for (size_t i = 0; i < count; i++)
+            {
+                positions[i][0] = random_coord(area_size);
+                positions[i][1] = 0.0f;
+                positions[i][2] = random_coord(area_size);
+            }
+        });
+    for (Vec3& point : query_points)
+    {
+        point[0] = random_coord(area_size);
+        point[1] = 0.0f;
+        point[2] = random_coord(area_size);
+    }
+
+    auto build_start = bench_clock::now();
+    index.update();
+    auto build_end = bench_clock::now();
+
+    for (Vec3& point : query_points)
+    {
+        float dist;
+        Vec3 found_pos;
+        auto linear_start = bench_clock::now();
+        findClosestEntity(point, Bit_Velocity, search_radius, &dist, found_pos);
+        auto index_start = bench_clock::now();
+        index.findNearest(point, search_radius, &dist, found_pos);
+        auto index_end = bench_clock::now();
+        linear_nearest_ns += elapsed_ns(linear_start, index_start);
+        index_nearest_ns += elapsed_ns(index_start, index_end);
+
+        struct RadiusData {
+            float *point;
+            int count;
+        } radius_data{point, 0};
+        linear_start = bench_clock::now();
+        iterateOverEntitiesAllComponents([](size_t count, void *arg, int, archetype_t archetype, void **componentArrays, size_t *)
+            {
+                RadiusData *data = static_cast<RadiusData*>(arg);
+                Vec3 *positions = static_cast<Vec3*>(componentArrays[COMPONENT_INDEX(Position, archetype)]);
+                Entity **entities = static_cast<Entity**>(componentArrays[0]);
+                for (size_t i = 0; i < count; i++)
+                {
+                    Vec3 diff;
+                    VEC3_DIFF(diff, positions[i], data->point);
+                    if (data->count < max_found && VEC3_DOT(diff, diff) <= search_radius * search_radius)
+                    {
+                        found[data->count++] = entities[i];
+                    }
+                }
+            }, &radius_data, Bit_Position | Bit_Velocity, 0);
+        index_start = bench_clock::now();
+        index_found += index.findInRadius(point, search_radius, found, max_found);
+        index_end = bench_clock::now();
+        linear_found += radius_data.count;
+        linear_radius_ns += elapsed_ns(linear_start, index_start);
+        index_radius_ns += elapsed_ns(index_start, index_end);
+    }
+
+    // Move a tenth of the entities, which only touches the blocks they're in
+    EntityQuery move_query{Bit_Position | Bit_Velocity, 0};
+    int moved = 0;
+    ecs::each<ecs::Position>(move_query, [&moved, entity_count](Vec3& pos)
+        {
+            if (moved++ < entity_count / 10)
+            {
+                pos[0] += 300.0f;
+            }
+        });
+    auto update_start = bench_clock::now();
+    index.update();
+    auto update_end = bench_clock::now();
+
+    printf("%10d %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10s\n", entity_count,
+        linear_nearest_ns / queries / 1000.0, index_nearest_ns / queries / 1000.0,
+        linear_radius_ns / queries / 1000.0, index_radius_ns / queries / 1000.0,
+        elapsed_ns(build_start, build_end) / 1000.0, elapsed_ns(update_start, update_end) / 1000.0,
+        linear_found == index_found ? "yes" : "NO");
+    deleteAllEntities();
+}
+
+// Per-entity and batch forms of the same behavior, which moves an entity along its velocity scaled by its data
+void bench_move_behavior(void **components, void *data)
+{
+    Vec3 *pos = get_component<Bit_Position, Vec3>(components, Bit_Position | Bit_Velocity | Bit_Behavior);
+    Vec3 *vel = get_component<Bit_Velocity, Vec3>(components, Bit_Position | Bit_Velocity | Bit_Behavior);
+    float scale = static_cast<uint8_t*>(data)[0];
+    (*pos)[0] += (*vel)[0] * scale;
+    (*pos)[1] += (*vel)[1] * scale;
+    (*pos)[2] += (*vel)[2] * scale;
+}
+
+void bench_spin_behavior(void **components, void *data)
+{
+    Vec3 *vel = get_component<Bit_Velocity, Vec3>(components, Bit_Position | Bit_Velocity | Bit_Behavior);
+    float scale = static_cast<uint8_t*>(data)[0];
+    (*vel)[0] += scale;
+}
+
+auto bench_move_batch = ecs::batch_behavior<ecs::Position, const ecs::Velocity>(
+    [](std::span<BehaviorState> behaviors, std::span<Vec3> positions, std::span<const Vec3> velocities)
+    {
+        for (size_t i = 0; i < positions.size(); i++)
+        {
+            float scale = behaviors[i].data[0];
+            positions[i][0] += velocities[i][0] * scale;
+            positions[i][1] += velocities[i][1] * scale;
+            positions[i][2] += velocities[i][2] * scale;
+        }
+    });
+
+auto bench_spin_batch = ecs::batch_behavior<ecs::Velocity>(
+    [](std::span<BehaviorState> behaviors, std::span<Vec3> velocities)
+    {
+        for (size_t i = 0; i < velocities.size(); i++)
+        {
+            velocities[i][0] += behaviors[i].data[0];
+        }
+    });
+
+// Measures iterateBehaviorEntities with per-entity callbacks and with batch functions, with the two behaviors
+// either alternating in runs of the given length or shuffled
+void bench_behaviors(int entity_count, int run_length)
+{
+    constexpr int frames = 64;
+    double per_entity_ns, batch_ns;
+
+    deleteAllEntities();
+    clearBatchBehaviors();
+    srand(1);
+    struct SpawnState {
+        int run_length;
+        int spawned;
+    } spawn_state{run_length, 0};
+    createEntitiesCallback(Bit_Position | Bit_Velocity | Bit_Behavior, &spawn_state, entity_count,
+        [](size_t count, void *arg, void **componentArrays)
+        {
+            SpawnState *state = static_cast<SpawnState*>(arg);
+            BehaviorState *behaviors = static_cast<BehaviorState*>(componentArrays[COMPONENT_INDEX(Behavior, Bit_Position | Bit_Velocity | Bit_Behavior)]);
+            for (size_t i = 0; i < count; i++, state->spawned++)
+            {
+                bool move = state->run_length == 0 ? (rand() & 1) : ((state->spawned / state->run_length) & 1);
+                behaviors[i].callback = move ? bench_move_behavior : bench_spin_behavior;
+                behaviors[i].data[0] = 1 + state->spawned % 3;
+            }
+        });
+
+    iterateBehaviorEntities();
+    auto per_entity_start = bench_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        iterateBehaviorEntities();
+    }
+    auto per_entity_end = bench_clock::now();
+    per_entity_ns = elapsed_ns(per_entity_start, per_entity_end);
+
+    registerBatchBehavior(bench_move_behavior, bench_move_batch);
+    registerBatchBehavior(bench_spin_behavior, bench_spin_batch);
+    iterateBehaviorEntities();
+    auto batch_start = bench_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        iterateBehaviorEntities();
+    }
+    auto batch_end = bench_clock::now();
+    batch_ns = elapsed_ns(batch_start, batch_end);
+
+    printf("%10d %10s %14.2f %14.2f\n", entity_count, run_length == 0 ? "shuffled" : std::to_string(run_length).c_str(),
+        per_entity_ns / frames / entity_count, batch_ns / frames / entity_count);
+
+    clearBatchBehaviors();
+    deleteAllEntities();
+}
+
+EntityQuery benchDeactivatableQuery{Bit_Position | Bit_Velocity | Bit_Deactivatable, 0};
+EntityQuery benchActiveQuery{Bit_Position | Bit_Velocity | Bit_Deactivatable, Bit_Inactive};
+
+// Measures moving entities when the given percentage of them are deactivated, first by checking each entity's flag and
+// then by rejecting the Inactive archetypes, followed by the cost of toggling an entity with deactivateEntities
+void bench_deactivation(int entity_count, int inactive_percent)
+{
+    constexpr int frames = 64;
+    constexpr archetype_t archetype = Bit_Position | Bit_Velocity | Bit_Deactivatable;
+    std::vector<Entity*> inactive;
+
+    deleteAllEntities();
+    srand(1);
+    std::vector<Entity*> entities(entity_count);
+    for (Entity*& e : entities)
+    {
+        e = createEntity(archetype);
+    }
+    for (Entity *e : entities)
+    {
+        if (rand() % 100 < inactive_percent)
+        {
+            inactive.push_back(e);
+        }
+    }
+
+    // Flag only, the entities all stay in one archetype
+    for (Entity *e : inactive)
+    {
+        void *components[NUM_COMPONENT_TYPES + 1];
+        getEntityComponents(e, components);
+        get_component<Bit_Deactivatable, ActiveState>(components, archetype)->deactivated = 1;
+    }
+    auto flag_start = bench_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        ecs::each<ecs::Position, const ecs::Velocity, const ecs::Deactivatable>(benchDeactivatableQuery,
+            [](Vec3& pos, const Vec3& vel, const ActiveState& active_state)
+            {
+                if (!active_state.deactivated)
+                {
+                    VEC3_ADD(pos, pos, vel);
+                }
+            });
+    }
+    auto flag_end = bench_clock::now();
+
+    // Partitioned, the inactive entities are moved out of the archetype the query matches
+    auto toggle_start = bench_clock::now();
+    deactivateEntities(inactive.data(), inactive.size());
+    auto toggle_end = bench_clock::now();
+    auto partition_start = bench_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        ecs::each<ecs::Position, const ecs::Velocity>(benchActiveQuery,
+            [](Vec3& pos, const Vec3& vel)
+            {
+                VEC3_ADD(pos, pos, vel);
+            });
+    }
+    auto partition_end = bench_clock::now();
+
+    printf("%10d %9d%% %14.2f %14.2f %14.2f\n", entity_count, inactive_percent,
+        elapsed_ns(flag_start, flag_end) / frames / 1000.0, elapsed_ns(partition_start, partition_end) / frames / 1000.0,
+        inactive.empty() ? 0.0 : elapsed_ns(toggle_start, toggle_end) / inactive.size());
+    dump_stats("deactivation " + std::to_string(inactive_percent));
+
+    deleteAllEntities();
+}
+
+// Measures ticking destroy timers, with timers between 10 and 100 seconds long so only a few expire each tick
+void bench_destroy_timers(int entity_count)
+{
+    constexpr int ticks = 1024;
+
+    deleteAllEntities();
+    srand(1);
+    createEntitiesCallback(Bit_Position | Bit_DestroyTimer, nullptr, entity_count,
+        [](size_t count, UNUSED void *arg, void **componentArrays)
+        {
+            uint16_t *timers = get_component<Bit_DestroyTimer, uint16_t>(componentArrays, Bit_Position | Bit_DestroyTimer);
+            for (size_t i = 0; i < count; i++)
+            {
+                timers[i] = 600 + rand() % 5400;
+            }
+        });
+
+    auto tick_start = bench_clock::now();
+    for (int tick = 0; tick < ticks; tick++)
+    {
+        tickDestroyTimers();
+    }
+    auto tick_end = bench_clock::now();
+    // Taken before the queued deletions are dropped so they show up in the stats
+    dump_stats("destroy timers " + std::to_string(entity_count));
+    clear_entity_queues();
+
+    printf("%10d %14.2f\n", entity_count, elapsed_ns(tick_start, tick_end) / ticks / 1000.0);
+
+    deleteAllEntities();
+}
+
+EntityQuery benchVelocityQuery{Bit_Position | Bit_Velocity, 0};
+EntityQuery benchGravityQuery{Bit_Velocity | Bit_Gravity, 0};
+EntityQuery benchTimerQuery{Bit_DestroyTimer, 0};
+
+// Measures runSystems with the given number of threads over a set of systems shaped like the game's physics
+void bench_systems(int entity_count, int thread_count)
+{
+    constexpr int frames = 64;
+
+    deleteAllEntities();
+    clearSystems();
+    createEntities(Bit_Position | Bit_Velocity | Bit_Gravity, entity_count / 2);
+    createEntities(Bit_Position | Bit_Velocity | Bit_DestroyTimer, entity_count / 2);
+
+    // Gravity and the timers don't conflict, so they share a level and velocity runs after gravity
+    registerSystem(benchGravityQuery, Bit_Gravity, Bit_Velocity,
+        ecs::system_callback<ecs::Velocity, ecs::Gravity>([](Vec3& vel, GravityParams& gravity)
+        {
+            vel[1] = std::max(vel[1] + gravity.accel, gravity.terminalVelocity);
+        }), nullptr);
+    registerSystem(benchTimerQuery, 0, Bit_DestroyTimer,
+        ecs::system_callback<ecs::DestroyTimer>([](uint16_t& timer)
+        {
+            timer++;
+        }), nullptr);
+    registerSystem(benchVelocityQuery, Bit_Velocity, Bit_Position,
+        ecs::system_callback<ecs::Position, ecs::Velocity>([](Vec3& pos, Vec3& vel)
+        {
+            pos[0] += vel[0];
+            pos[1] += vel[1];
+            pos[2] += vel[2];
+        }), nullptr);
+    setSystemThreadCount(thread_count);
+
+    // Warm up the queries and the thread pool
+    runSystems();
+
+    auto start = bench_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        runSystems();
+    }
+    auto end = bench_clock::now();
+
+    printf("%10d %8d %14.2f\n", entity_count, thread_count, elapsed_ns(start, end) / frames / 1000.0);
+
+    clearSystems();
+    setSystemThreadCount(1);
+}
+
+// Prints the block layout and wasted bytes of a set of archetypes with a realistic number of entities in each
+void report_memory()
+{
+    constexpr archetype_t archetypes[] = {
+        Bit_Position | Bit_Velocity,
+        ARCHETYPE_MODEL,
+        ARCHETYPE_SCALED_MODEL,
+        ARCHETYPE_ANIM_MODEL | Bit_Behavior,
+        ARCHETYPE_SCALED_ANIM_MODEL | Bit_Behavior | Bit_Velocity | Bit_Gravity | Bit_Deactivatable,
+    };
+    ArchetypeMemoryInfo info[std::size(archetypes)];
+
+    deleteAllEntities();
+    for (archetype_t archetype : archetypes)
+    {
+        createEntities(archetype, 100);
+    }
+    int count = getArchetypeMemoryInfo(info, std::size(info));
+    for (int i = 0; i < count; i++)
+    {
+        printf("%08X %8u %10u %10u %7u %10u %8u %8u\n", info[i].archetype, info[i].numEntities, info[i].elementCount, info[i].blockSize,
+            info[i].numBlocks, info[i].bytesAllocated, info[i].bytesPadding, info[i].bytesUnused);
+    }
+    dump_stats("memory");
+}
+
+// Regression suite
+// Times the core ECS operations at a spread of entity and archetype counts and reports each as ns per entity, taking the
+// fastest of several runs since noise only ever makes a run slower. The results can be written out as a baseline, and checked against one
+// so that CI fails when an operation gets slower than the tolerance allows. Baselines only mean anything on the machine
+// (and build) they were recorded with, so record one on the machine that runs the checks (make baseline, then make check).
+
+// Number of times each suite measurement is repeated, the fastest is what gets reported
+constexpr int suite_repeats = 9;
+// Default allowed slowdown over the baseline in percent
+constexpr double suite_default_tolerance = 25.0;
+// Results are never considered regressed by less than this many ns per entity, which keeps timer noise on the
+// cheapest operations from failing the check
+constexpr double suite_slack_ns = 1.0;
+// Number of times a case with a regressed result gets rerun before the regression counts
+constexpr int suite_retries = 2;
+
+struct suite_result {
+    std::string name;
+    double ns_per_entity;
+};
+
+// Entities are spread round robin over the archetypes, which all have a Position so one query can iterate all of them
+std::vector<archetype_t> make_suite_archetypes(int count)
+{
+    std::vector<archetype_t> ret;
+    for (int i = 0; i < count; i++)
+    {
+        archetype_t archetype = (static_cast<archetype_t>(i) << 1) | Bit_Position;
+        registerArchetype(archetype);
+        ret.push_back(archetype);
+    }
+    return ret;
+}
+
+std::vector<Entity*> create_suite_entities(const std::vector<archetype_t>& archetypes, int entity_count)
+{
+    std::vector<Entity*> ret(entity_count);
+    for (int i = 0; i < entity_count; i++)
+    {
+        ret[i] = createEntity(archetypes[i % archetypes.size()]);
+    }
+    return ret;
+}
+
+// Runs setup and then times body suite_repeats times, returning the fastest time divided over the given entity count
+template <typename Setup, typename Body>
+double suite_measure(int entity_count, Setup&& setup, Body&& body)
+{
+    double best = std::numeric_limits<double>::max();
+    for (int i = 0; i < suite_repeats; i++)
+    {
+        setup();
+        auto start = bench_clock::now();
+        body();
+        auto end = bench_clock::now();
+        best = std::min(best, elapsed_ns(start, end) / entity_count);
+    }
+    return best;
+}
+
+EntityQuery suiteQuery{Bit_Position, 0};
+
+void run_suite_case(int entity_count, int archetype_count, std::vector<suite_result>& results)
+{
+    std::vector<archetype_t> archetypes;
+    std::vector<Entity*> entities;
+    std::string suffix = "/" + std::to_string(entity_count) + "x" + std::to_string(archetype_count);
+    srand(1);
+
+    auto reset = [&]()
+    {
+        deleteAllEntities();
+        archetypes = make_suite_archetypes(archetype_count);
+    };
+    auto populate = [&]()
+    {
+        reset();
+        entities = create_suite_entities(archetypes, entity_count);
+    };
+    // Visit the entities in a random order so lookups don't just walk memory in order
+    auto shuffled = [&]()
+    {
+        populate();
+        for (int i = entity_count - 1; i > 0; i--)
+        {
+            std::swap(entities[i], entities[rand() % (i + 1)]);
+        }
+    };
+
+    results.push_back({"create" + suffix, suite_measure(entity_count, reset,
+        [&]()
+        {
+            entities = create_suite_entities(archetypes, entity_count);
+        })});
+
+    results.push_back({"delete" + suffix, suite_measure(entity_count, shuffled,
+        [&]()
+        {
+            for (Entity *e : entities)
+            {
+                deleteEntity(e);
+            }
+        })});
+
+    populate();
+    results.push_back({"iterate" + suffix, suite_measure(entity_count, []() {},
+        []()
+        {
+            ecs::each<ecs::Position>(suiteQuery, [](Vec3& pos) { pos[0] += 1.0f; });
+        })});
+
+    results.push_back({"getEntityComponents" + suffix, suite_measure(entity_count, shuffled,
+        [&]()
+        {
+            void *components[NUM_COMPONENT_TYPES + 1];
+            for (Entity *e : entities)
+            {
+                getEntityComponents(e, components);
+                (*static_cast<Vec3*>(components[1]))[0] += 1.0f;
+            }
+        })});
+
+    results.push_back({"findEntity" + suffix, suite_measure(entity_count, shuffled,
+        [&]()
+        {
+            for (Entity *e : entities)
+            {
+                if (findEntity(e->archetype, e->archetypeArrayIndex) != e)
+                {
+                    fprintf(stderr, "findEntity returned the wrong entity\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        })});
+
+    // Half the entities get queued for deletion and as many get queued for creation, spread over the archetypes
+    results.push_back({"process_entity_queues" + suffix, suite_measure(entity_count, [&]()
+        {
+            shuffled();
+            for (int i = 0; i < entity_count / 2; i++)
+            {
+                queue_entity_deletion(entities[i]);
+            }
+            for (archetype_t archetype : archetypes)
+            {
+                queue_entity_creation(archetype, nullptr, entity_count / 2 / archetype_count, nullptr);
+            }
+        },
+        []()
+        {
+            process_entity_queues();
+        })});
+
+    deleteAllEntities();
+}
+
+// Reads a baseline written by write_baseline, each line is a result name and its ns per entity
+std::vector<suite_result> read_baseline(const char *path)
+{
+    std::vector<suite_result> ret;
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Failed to open baseline %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    char name[128];
+    double ns_per_entity;
+    while (fscanf(file, "%127s %lf", name, &ns_per_entity) == 2)
+    {
+        ret.push_back({name, ns_per_entity});
+    }
+    fclose(file);
+    return ret;
+}
+
+void write_baseline(const char *path, const std::vector<suite_result>& results)
+{
+    FILE *file = fopen(path, "w");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Failed to open baseline %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    for (const suite_result& result : results)
+    {
+        fprintf(file, "%s %.3f\n", result.name.c_str(), result.ns_per_entity);
+    }
+    fclose(file);
+}
+
+// Finds the baseline's result for the given name, or nullptr if the baseline doesn't have it
+const suite_result *find_baseline(const std::vector<suite_result>& baseline, const std::string& name)
+{
+    auto found = std::find_if(baseline.begin(), baseline.end(), [&name](const suite_result& cur) { return cur.name == name; });
+    return found == baseline.end() ? nullptr : &*found;
+}
+
+bool is_regressed(const suite_result& result, const suite_result *baseline, double tolerance)
+{
+    if (baseline == nullptr)
+    {
+        return false;
+    }
+    double limit = std::max(baseline->ns_per_entity * (1.0 + tolerance / 100.0), baseline->ns_per_entity + suite_slack_ns);
+    return result.ns_per_entity > limit;
+}
+
+// Runs the regression suite, checking it against the baseline if one is given
+// Cases with a regressed result get rerun up to suite_retries times, keeping the fastest result, so a single noisy run
+// doesn't fail the check. Returns false if any result is still slower than its baseline by more than the tolerance.
+bool run_suite(const char *baseline_path, const char *write_baseline_path, double tolerance)
+{
+    struct suite_case {
+        int entity_count;
+        int archetype_count;
+        std::vector<suite_result> results;
+    };
+    std::vector<suite_case> cases;
+    std::vector<suite_result> baseline;
+    bool passed = true;
+
+    if (baseline_path != nullptr)
+    {
+        baseline = read_baseline(baseline_path);
+    }
+
+    for (int entity_count : { 1024, 16384, 60000 })
+    {
+        for (int archetype_count : { 1, 16, 128 })
+        {
+            suite_case& cur = cases.emplace_back(suite_case{entity_count, archetype_count, {}});
+            run_suite_case(entity_count, archetype_count, cur.results);
+        }
+    }
+
+    for (suite_case& cur : cases)
+    {
+        for (int retry = 0; retry < suite_retries; retry++)
+        {
+            bool any_regressed = std::any_of(cur.results.begin(), cur.results.end(),
+                [&](const suite_result& result) { return is_regressed(result, find_baseline(baseline, result.name), tolerance); });
+            if (!any_regressed)
+            {
+                break;
+            }
+            std::vector<suite_result> rerun;
+            run_suite_case(cur.entity_count, cur.archetype_count, rerun);
+            for (size_t i = 0; i < cur.results.size(); i++)
+            {
+                cur.results[i].ns_per_entity = std::min(cur.results[i].ns_per_entity, rerun[i].ns_per_entity);
+            }
+        }
+    }
+
+    printf("Regression suite (fastest of %d runs, %.0f%% tolerance)\n", suite_repeats, tolerance);
+    printf("%-36s %12s %12s %8s\n", "operation/entities x archetypes", "ns/entity", "baseline", "change");
+    std::vector<suite_result> results;
+    for (const suite_case& cur : cases)
+    {
+        for (const suite_result& result : cur.results)
+        {
+            const suite_result *found = find_baseline(baseline, result.name);
+            results.push_back(result);
+            if (found == nullptr)
+            {
+                printf("%-36s %12.2f %12s %8s\n", result.name.c_str(), result.ns_per_entity, "-", "-");
+                continue;
+            }
+            bool regressed = is_regressed(result, found, tolerance);
+            printf("%-36s %12.2f %12.2f %+7.1f%%%s\n", result.name.c_str(), result.ns_per_entity, found->ns_per_entity,
+                (result.ns_per_entity / found->ns_per_entity - 1.0) * 100.0, regressed ? " REGRESSED" : "");
+            passed = passed && !regressed;
+        }
+    }
+
+    if (write_baseline_path != nullptr)
+    {
+        write_baseline(write_baseline_path, results);
+        printf("Wrote baseline to %s\n", write_baseline_path);
+    }
+    return passed;
+}
+
+int main(int argc, char** argv)
+{
+    constexpr int archetype_counts[] = { 1, 8, 32, 64, 128, 192, MAX_ARCHETYPES - 1 };
+
+    bool suite_only = false;
+    const char *baseline_path = nullptr;
+    const char *write_baseline_path = nullptr;
+    double tolerance = suite_default_tolerance;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--suite")
+        {
+            suite_only = true;
+        }
+        else if (arg == "--stats" && has_value)
+        {
+            stats_file = fopen(argv[++i], "w");
+            if (stats_file == nullptr)
+            {
+                fprintf(stderr, "Failed to open stats file %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (arg == "--baseline" && has_value)
+        {
+            baseline_path = argv[++i];
+        }
+        else if (arg == "--write-baseline" && has_value)
+        {
+            write_baseline_path = argv[++i];
+        }
+        else if (arg == "--tolerance" && has_value)
+        {
+            tolerance = strtod(argv[++i], nullptr);
+        }
+        else
+        {
+            printf("Usage: %s [--stats stats file] [--suite] [--baseline baseline file] [--write-baseline baseline file] [--tolerance percent]\n", argv[0]);
+            printf("  --suite only runs the regression suite, --baseline fails the run if the suite is slower than the baseline\n");
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (suite_only || baseline_path != nullptr || write_baseline_path != nullptr)
+    {
+        bool passed = run_suite(baseline_path, write_baseline_path, tolerance);
+        deleteAllEntities();
+        return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    printf("createEntity/deleteEntity throughput (%d entities x %d passes)\n", entities_per_pass, passes);
+    printf("%10s %14s %14s\n", "archetypes", "create ns/op", "delete ns/op");
+    for (int archetype_count : archetype_counts)
+    {
+        bench_create_delete(archetype_count);
+    }
+
+    printf("\nDelete + create churn (%d iterations)\n", churn_iterations);
+    printf("%10s %14s\n", "entities", "ns/iteration");
+    for (int live_count : { 1024, 8192, 32768, 60000 })
+    {
+        bench_churn(live_count);
+    }
+
+    printf("\nIteration overhead (16 entities per archetype)\n");
+    printf("%10s %14s %14s\n", "archetypes", "mask ns/call", "query ns/call");
+    for (int archetype_count : archetype_counts)
+    {
+        bench_iterate(archetype_count);
+    }
+
+    printf("\nSpawning initialized entities (4 components set)\n");
+    printf("%10s %14s %14s\n", "entities", "callback ns", "prefab ns");
+    for (int spawn_count : { 16, 256, 4096 })
+    {
+        bench_spawn(spawn_count);
+    }
+
+    printf("\nWorld snapshots (first, unchanged, half moved, restore after moving)\n");
+    printf("%10s %10s %10s %10s %10s %10s %10s\n", "entities", "bytes", "moved copy", "first us", "same us", "moved us", "restore us");
+    bench_snapshot(10000);
+
+    printf("\nSpatial index vs linear scans (%d queries, 512 unit radius)\n", 256);
+    printf("%10s %10s %10s %10s %10s %10s %10s %10s\n", "entities", "scan near", "index near", "scan rad", "index rad", "build us", "update us", "match");
+    for (int entity_count : { 1000, 10000, 50000 })
+    {
+        bench_spatial(entity_count);
+    }
+
+    printf("\nBehavior dispatch (2 behaviors)\n");
+    printf("%10s %10s %14s %14s\n", "entities", "run length", "callback ns", "batch ns");
+    for (int run_length : { 0, 4, 32, 1024 })
+    {
+        bench_behaviors(16384, run_length);
+    }
+
+    printf("\nDeactivated entities (flag checked per entity vs Inactive archetypes rejected)\n");
+    printf("%10s %10s %14s %14s %14s\n", "entities", "inactive", "flag us/frame", "split us/frame", "toggle ns/op");
+    for (int inactive_percent : { 0, 50, 80, 95 })
+    {
+        bench_deactivation(16384, inactive_percent);
+    }
+
+    printf("\nDestroy timers (%d ticks, timers of 600 to 6000 ticks)\n", 1024);
+    printf("%10s %14s\n", "entities", "us/tick");
+    for (int entity_count : { 1024, 16384, 60000 })
+    {
+        bench_destroy_timers(entity_count);
+    }
+
+    printf("\nScheduled systems (3 systems, 2 levels)\n");
+    printf("%10s %8s %14s\n", "entities", "threads", "us/frame");
+    for (int entity_count : { 4096, 32768 })
+    {
+#ifdef ECS_THREADED
+        for (int thread_count : { 1, 2, 4, static_cast<int>(std::thread::hardware_concurrency()) })
+        {
+            bench_systems(entity_count, thread_count);
+        }
+#else
+        // Without THREADED=1 there are no worker threads, so every thread count would just run serially
+        bench_systems(entity_count, 1);
+#endif
+    }
+
+    printf("\nArchetype memory (100 entities each)\n");
+    printf("%8s %8s %10s %10s %7s %10s %8s %8s\n", "archetype", "entities", "per block", "block size", "blocks", "allocated", "padding", "unused");
+    report_memory();
+
+    deleteAllEntities();
+    if (stats_file != nullptr)
+    {
+        fclose(stats_file);
+    }
+    return EXIT_SUCCESS;
+}
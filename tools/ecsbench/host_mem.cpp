@@ -0,0 +1,32 @@
+#include <cstdlib>
+
+#include <mem.h>
+
+// Host replacement for the engine's memory pool (src/main/mem.cpp), which assumes it owns all of RDRAM
+// Chunks keep the same size and alignment as on console so the ECS sees identical block layouts
+
+void *allocChunks(int numChunks, UNUSED owner_t owner)
+{
+    return std::aligned_alloc(mem_block_size, numChunks * mem_block_size);
+}
+
+void *allocRegion(int length, owner_t owner)
+{
+    // Rounded up integer division: (x + (y - 1)) / y
+    return allocChunks((length + (mem_block_size - 1)) / mem_block_size, owner);
+}
+
+void freeAlloc(void *start) noexcept
+{
+    std::free(start);
+}
+
+uint32_t isSegmented(UNUSED void* segmented)
+{
+    return false;
+}
+
+void* segmentedToVirtual(void* segmented)
+{
+    return segmented;
+}
@@ -0,0 +1,8 @@
+#ifndef UNFL_DEBUG_H
+#define UNFL_DEBUG_H
+
+// Host stand-in for the USB debug library, all output is compiled out like in a non-debug ROM
+#define debug_printf(...)
+#define debug_assert(a)
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __GFX_H__
+#define __GFX_H__
+
+// Host stand-in for the engine graphics header, which depends on the platform's graphics microcode and glm
+// Nothing levelbake needs from it goes beyond the types already declared in types.h
+
+#include <types.h>
+
+#endif
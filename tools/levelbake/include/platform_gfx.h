@@ -0,0 +1,8 @@
+#ifndef __PLATFORM_GFX_H__
+#define __PLATFORM_GFX_H__
+
+// Host stand-in for the platform graphics header
+// The engine headers levelbake includes only rely on it for the standard library headers the N64 one pulls in
+#include <array>
+
+#endif
@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include <ecs.h>
+#include <level.h>
+#include <model.h>
+#include <multiarraylist.h>
+#include <physics.h>
+
+// Bakes the entities of a level segment into the prebaked block format that loadLevelBlocks reads (see level.h)
+// The segment is a raw image of the level data as it sits in ROM, starting with a LevelHeader whose pointers are
+// segmented addresses into the segment itself. Component data is copied byte for byte, so it stays big endian.
+
+constexpr size_t target_pointer_size = 4;
+
+// Size of a component type on console, which is the host's size for anything that doesn't hold a pointer
+// Pointers are 4 bytes there, so every component type holding one needs its console layout spelled out here
+template <typename T>
+constexpr size_t target_component_size = component_storage_size<T>;
+template <typename T>
+constexpr size_t target_component_size<T*> = target_pointer_size;
+template <>
+constexpr size_t target_component_size<BehaviorState> = target_pointer_size + sizeof(BehaviorState::data);
+template <>
+constexpr size_t target_component_size<AnimState> =
+    target_pointer_size + sizeof(AnimState::counter) + sizeof(AnimState::speed) + sizeof(AnimState::triggerIndex);
+
+// Sizes of every component on console, in component order
+#define COMPONENT(Name, Type) static_cast<uint16_t>(target_component_size<Type>),
+constexpr uint16_t target_component_sizes[] = {
+#include "components.inc.h"
+};
+#undef COMPONENT
+
+// Next pointer, element count and a 16 bit change version per component, padded out to the pointer alignment
+constexpr size_t target_block_header_size = ROUND_UP(target_pointer_size + sizeof(uint32_t) + sizeof(uint16_t) * multiarraylist_num_component_types, target_pointer_size);
+
+// Layout of one archetype's blocks, worked out the same way multiarraylist_init does
+struct block_layout_t
+{
+    size_t element_count;
+    size_t block_chunks;
+    // Offset of each component's array in the block, by component type
+    size_t component_offsets[multiarraylist_num_component_types];
+};
+
+block_layout_t get_block_layout(archetype_t archetype)
+{
+    block_layout_t ret{};
+    size_t element_size = target_pointer_size;
+    for (size_t i = 0; i < multiarraylist_num_component_types; i++)
+    {
+        if (archetype & (1 << i))
+        {
+            element_size += target_component_sizes[i];
+        }
+    }
+
+    auto element_count = [element_size](size_t block_chunks)
+    {
+        return ROUND_DOWN((block_chunks * mem_block_size - target_block_header_size) / element_size, 4);
+    };
+    for (ret.block_chunks = 1; ret.block_chunks < multiarraylist_max_block_chunks; ret.block_chunks++)
+    {
+        if (element_count(ret.block_chunks) >= multiarraylist_target_element_count)
+        {
+            break;
+        }
+    }
+    ret.element_count = element_count(ret.block_chunks);
+
+    size_t offset = target_block_header_size + ret.element_count * target_pointer_size;
+    for (size_t i = 0; i < multiarraylist_num_component_types; i++)
+    {
+        if (archetype & (1 << i))
+        {
+            ret.component_offsets[i] = offset;
+            offset += target_component_sizes[i] * ret.element_count;
+        }
+    }
+    return ret;
+}
+
+// Reads and writes big endian values in a byte buffer
+uint32_t read_u32(const std::vector<uint8_t>& buf, size_t offset)
+{
+    return (static_cast<uint32_t>(buf[offset]) << 24) | (buf[offset + 1] << 16) | (buf[offset + 2] << 8) | buf[offset + 3];
+}
+
+void write_u32(std::vector<uint8_t>& buf, size_t offset, uint32_t value)
+{
+    buf[offset + 0] = static_cast<uint8_t>(value >> 24);
+    buf[offset + 1] = static_cast<uint8_t>(value >> 16);
+    buf[offset + 2] = static_cast<uint8_t>(value >> 8);
+    buf[offset + 3] = static_cast<uint8_t>(value);
+}
+
+void write_u16(std::vector<uint8_t>& buf, size_t offset, uint16_t value)
+{
+    buf[offset + 0] = static_cast<uint8_t>(value >> 8);
+    buf[offset + 1] = static_cast<uint8_t>(value);
+}
+
+// Converts a segmented address into an offset into the level segment, exiting if it points anywhere else
+size_t segment_offset(uint32_t segmented, uint32_t segment, size_t length, size_t segment_size)
+{
+    size_t offset = segmented & 0xFFFFFF;
+    if ((segmented >> 24) != segment || offset + length > segment_size)
+    {
+        fprintf(stderr, "Pointer 0x%08X is outside of the level segment\n", segmented);
+        exit(EXIT_FAILURE);
+    }
+    return offset;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4)
+    {
+        printf("Usage: %s [level segment] [segment number] [baked level file]\n", argv[0]);
+        return EXIT_SUCCESS;
+    }
+
+    std::ifstream input_file(argv[1], std::ios_base::binary);
+    if (!input_file.good())
+    {
+        fprintf(stderr, "Failed to open level segment %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    std::vector<uint8_t> input{std::istreambuf_iterator<char>(input_file), std::istreambuf_iterator<char>()};
+    uint32_t segment = strtoul(argv[2], nullptr, 0);
+
+    // LevelHeader on console: archetype count, then segmented pointers to the archetypes, their counts and their component arrays
+    constexpr size_t level_header_size = 4 * sizeof(uint32_t);
+    if (input.size() < level_header_size)
+    {
+        fprintf(stderr, "Level segment is too small to hold a level header\n");
+        return EXIT_FAILURE;
+    }
+    uint32_t archetype_count = read_u32(input, 0);
+    size_t archetypes_offset = segment_offset(read_u32(input, 4), segment, archetype_count * sizeof(uint32_t), input.size());
+    size_t counts_offset = segment_offset(read_u32(input, 8), segment, archetype_count * sizeof(uint32_t), input.size());
+    size_t component_data_offset = segment_offset(read_u32(input, 12), segment, archetype_count * target_pointer_size, input.size());
+
+    size_t header_size = ROUND_UP(sizeof(LevelBlocksHeader) + archetype_count * sizeof(LevelBlocksArchetype), mem_block_size);
+    std::vector<uint8_t> output(header_size);
+
+    write_u32(output, offsetof(LevelBlocksHeader, magic), level_blocks_magic);
+    write_u32(output, offsetof(LevelBlocksHeader, archetypeCount), archetype_count);
+    write_u32(output, offsetof(LevelBlocksHeader, headerSize), header_size);
+    write_u16(output, offsetof(LevelBlocksHeader, blockHeaderSize), target_block_header_size);
+    output[offsetof(LevelBlocksHeader, entityPointerSize)] = target_pointer_size;
+    output[offsetof(LevelBlocksHeader, componentCount)] = multiarraylist_num_component_types;
+    for (size_t i = 0; i < multiarraylist_num_component_types; i++)
+    {
+        write_u16(output, offsetof(LevelBlocksHeader, componentSizes) + i * sizeof(uint16_t), target_component_sizes[i]);
+    }
+
+    size_t total_entities = 0;
+    for (uint32_t archetype_index = 0; archetype_index < archetype_count; archetype_index++)
+    {
+        archetype_t archetype = read_u32(input, archetypes_offset + archetype_index * sizeof(uint32_t));
+        uint32_t entity_count = read_u32(input, counts_offset + archetype_index * sizeof(uint32_t));
+        block_layout_t layout = get_block_layout(archetype);
+        if (layout.element_count == 0)
+        {
+            fprintf(stderr, "Archetype %08X is too large to fit in a block\n", archetype);
+            return EXIT_FAILURE;
+        }
+        size_t entry_offset = sizeof(LevelBlocksHeader) + archetype_index * sizeof(LevelBlocksArchetype);
+        size_t block_size = layout.block_chunks * mem_block_size;
+        size_t num_blocks = (entity_count + layout.element_count - 1) / layout.element_count;
+        size_t data_offset = output.size();
+
+        write_u32(output, entry_offset + offsetof(LevelBlocksArchetype, archetype), archetype);
+        write_u32(output, entry_offset + offsetof(LevelBlocksArchetype, entityCount), entity_count);
+        write_u32(output, entry_offset + offsetof(LevelBlocksArchetype, dataOffset), data_offset);
+        write_u16(output, entry_offset + offsetof(LevelBlocksArchetype, elementCount), layout.element_count);
+        output[entry_offset + offsetof(LevelBlocksArchetype, blockChunks)] = layout.block_chunks;
+
+        // Blocks start out zeroed, which leaves the next pointers, change versions and entity pointers for the loader to fill in
+        output.resize(data_offset + num_blocks * block_size);
+        for (size_t block = 0; block < num_blocks; block++)
+        {
+            size_t block_offset = data_offset + block * block_size;
+            size_t first_element = block * layout.element_count;
+            size_t block_elements = std::min<size_t>(entity_count - first_element, layout.element_count);
+            write_u32(output, block_offset + target_pointer_size, block_elements);
+        }
+
+        // Copy each component array into the matching array of every block, components without an array are left zeroed
+        size_t component_arrays_offset = segment_offset(read_u32(input, component_data_offset + archetype_index * target_pointer_size),
+            segment, std::popcount(archetype) * target_pointer_size, input.size());
+        size_t component_slot = 0;
+        for (size_t component = 0; component < multiarraylist_num_component_types; component++)
+        {
+            if (!(archetype & (1 << component)))
+            {
+                continue;
+            }
+            uint32_t array_address = read_u32(input, component_arrays_offset + component_slot * target_pointer_size);
+            component_slot++;
+            if (array_address == 0)
+            {
+                continue;
+            }
+
+            size_t component_size = target_component_sizes[component];
+            size_t array_offset = segment_offset(array_address, segment, entity_count * component_size, input.size());
+            for (size_t block = 0; block < num_blocks; block++)
+            {
+                size_t first_element = block * layout.element_count;
+                size_t block_elements = std::min<size_t>(entity_count - first_element, layout.element_count);
+                std::copy_n(input.begin() + array_offset + first_element * component_size, block_elements * component_size,
+                    output.begin() + data_offset + block * block_size + layout.component_offsets[component]);
+            }
+        }
+
+        printf("Archetype %08X: %u entities in %zu blocks of %zu (%zu chunks each)\n",
+            archetype, entity_count, num_blocks, layout.element_count, layout.block_chunks);
+        total_entities += entity_count;
+    }
+
+    std::ofstream output_file(argv[3], std::ios_base::binary);
+    output_file.write(reinterpret_cast<const char*>(output.data()), output.size());
+    if (!output_file.good())
+    {
+        fprintf(stderr, "Failed to write baked level file %s\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+    printf("Baked %zu entities into %zu bytes\n", total_entities, output.size());
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,8 @@
+#ifndef __PLATFORM_H__
+#define __PLATFORM_H__
+
+#include <cstdint>
+
+// Host stand-in for the console platform header, the memory pool doesn't use anything from it
+
+#endif
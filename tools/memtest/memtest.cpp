@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#include <mem.h>
+
+// Number of chunks in the pool under test, kept small so the brute force reference stays fast
+constexpr size_t heap_chunks = 1024;
+// Number of random operations each randomized test runs
+constexpr int random_iterations = 200000;
+// Most allocations each randomized test keeps live at once
+constexpr int max_live_allocations = 300;
+constexpr int max_live_small_allocations = 1500;
+
+alignas(mem_block_size) uint8_t heap[heap_chunks * mem_block_size];
+
+// The pool also backs operator new, so it has to be set up before any static initializer can allocate from it
+__attribute__((constructor(101))) void init_heap()
+{
+    initMemAllocator(heap, heap + sizeof(heap));
+}
+
+// Checks are used instead of assert so they still run in release builds, which are what get tested
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+// Every chunk the pool can hand out, filled in by count_free_chunks
+void *all_chunks[heap_chunks];
+
+// Lowest chunk address the pool hands out, chunk indices in the tests are relative to it
+uint8_t *pool_start = nullptr;
+
+// Counts the free chunks in the pool by allocating single chunks until it runs out, then frees them all again
+size_t count_free_chunks()
+{
+    size_t count = 0;
+    void *chunk;
+    while (count < heap_chunks && (chunk = allocChunks(1, ALLOC_ECS)) != nullptr)
+    {
+        all_chunks[count++] = chunk;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        freeAlloc(all_chunks[i]);
+    }
+    return count;
+}
+
+size_t chunk_index(void *chunk)
+{
+    return (static_cast<uint8_t*>(chunk) - pool_start) / mem_block_size;
+}
+
+// Checks that everything allocated so far was given back, and that the whole pool coalesced back into one free region
+void check_pool_empty(size_t totalChunks)
+{
+    CHECK(count_free_chunks() == totalChunks);
+    void *whole = allocRegion(totalChunks * mem_block_size, ALLOC_ECS);
+    CHECK(whole != nullptr);
+    freeAlloc(whole);
+}
+
+// Randomly allocates and frees runs of chunks, checking every multi chunk allocation against a brute force best fit
+// Single chunks come from the front of the free list instead of the best fit, so they're only checked for overlap
+void test_best_fit(size_t totalChunks)
+{
+    struct Allocation {
+        void *start;
+        size_t numChunks;
+    };
+    static bool usedChunks[heap_chunks];
+    static Allocation live[max_live_allocations];
+    int numLive = 0;
+    long fitsChecked = 0;
+
+    std::mt19937 rng(5);
+    for (int i = 0; i < random_iterations; i++)
+    {
+        if (numLive < max_live_allocations && rng() % 2 == 0)
+        {
+            size_t numChunks = rng() % 5 == 0 ? 1 + rng() % 100 : 2 + rng() % 12;
+
+            // Find the smallest run of free chunks that fits, the lowest one if there's a tie
+            size_t bestStart = heap_chunks;
+            size_t bestLength = heap_chunks + 1;
+            for (size_t runStart = 0; runStart < totalChunks;)
+            {
+                if (usedChunks[runStart])
+                {
+                    runStart++;
+                    continue;
+                }
+                size_t runEnd = runStart;
+                while (runEnd < totalChunks && !usedChunks[runEnd])
+                {
+                    runEnd++;
+                }
+                size_t runLength = runEnd - runStart;
+                if (runLength >= numChunks && runLength < bestLength)
+                {
+                    bestStart = runStart;
+                    bestLength = runLength;
+                }
+                runStart = runEnd;
+            }
+
+            void *start = allocChunks(numChunks, ALLOC_ECS);
+            if (start == nullptr)
+            {
+                CHECK(bestStart == heap_chunks);
+                continue;
+            }
+            size_t startIndex = chunk_index(start);
+            if (numChunks > 1)
+            {
+                CHECK(startIndex == bestStart);
+                fitsChecked++;
+            }
+            for (size_t chunk = startIndex; chunk < startIndex + numChunks; chunk++)
+            {
+                CHECK(chunk < totalChunks && !usedChunks[chunk]);
+                usedChunks[chunk] = true;
+            }
+            live[numLive++] = {start, numChunks};
+        }
+        else if (numLive > 0)
+        {
+            int freed = rng() % numLive;
+            size_t startIndex = chunk_index(live[freed].start);
+            std::fill_n(usedChunks + startIndex, live[freed].numChunks, false);
+            freeAlloc(live[freed].start);
+            live[freed] = live[--numLive];
+        }
+    }
+
+    for (int i = 0; i < numLive; i++)
+    {
+        freeAlloc(live[i].start);
+    }
+    check_pool_empty(totalChunks);
+    printf("best fit: %ld fits checked\n", fitsChecked);
+}
+
+// Randomly allocates and frees small objects through operator new, checking alignment and that no two live objects overlap
+void test_small_allocations(size_t totalChunks)
+{
+    struct Allocation {
+        uint8_t *start;
+        size_t length;
+        uint8_t fill;
+    };
+    static Allocation live[max_live_small_allocations];
+    int numLive = 0;
+
+    std::mt19937 rng(1);
+    for (int i = 0; i < random_iterations; i++)
+    {
+        if (numLive < max_live_small_allocations && rng() % 3 != 0)
+        {
+            size_t length = 1 + rng() % mem_small_block_size;
+            uint8_t fill = static_cast<uint8_t>(rng());
+            uint8_t *start = static_cast<uint8_t*>(::operator new(length));
+            CHECK(reinterpret_cast<uintptr_t>(start) % 16 == 0);
+            memset(start, fill, length);
+            live[numLive++] = {start, length, fill};
+        }
+        else if (numLive > 0)
+        {
+            int freed = rng() % numLive;
+            // Anything handed out twice would have been overwritten with another object's fill
+            for (size_t byte = 0; byte < live[freed].length; byte++)
+            {
+                CHECK(live[freed].start[byte] == live[freed].fill);
+            }
+            ::operator delete(live[freed].start);
+            live[freed] = live[--numLive];
+        }
+    }
+
+    for (int i = 0; i < numLive; i++)
+    {
+        ::operator delete(live[i].start);
+    }
+    // Emptied slab pages go back to the pool
+    check_pool_empty(totalChunks);
+    printf("small allocations: ok\n");
+}
+
+// Freeing a small object twice, or a pointer into a slab page's header, is ignored instead of corrupting the page
+void test_small_double_free(size_t totalChunks)
+{
+    void *kept = ::operator new(24);
+    void *freedTwice = ::operator new(24);
+    ::operator delete(freedTwice);
+    ::operator delete(freedTwice);
+    uintptr_t pageStart = reinterpret_cast<uintptr_t>(kept) & ~static_cast<uintptr_t>(mem_block_size - 1);
+    freeAlloc(reinterpret_cast<void*>(pageStart + 8));
+
+    void *first = ::operator new(24);
+    void *second = ::operator new(24);
+    CHECK(first != kept && second != kept);
+    CHECK(first != second);
+
+    ::operator delete(first);
+    ::operator delete(second);
+    ::operator delete(kept);
+    check_pool_empty(totalChunks);
+    printf("small double free: ok\n");
+}
+
+int main()
+{
+    // Find the pool's start and size, every test leaves the pool as empty as it found it
+    size_t totalChunks = count_free_chunks();
+    CHECK(totalChunks > 0);
+    pool_start = static_cast<uint8_t*>(all_chunks[0]);
+    for (size_t i = 1; i < totalChunks; i++)
+    {
+        if (static_cast<uint8_t*>(all_chunks[i]) < pool_start)
+        {
+            pool_start = static_cast<uint8_t*>(all_chunks[i]);
+        }
+    }
+    printf("pool: %zu chunks\n", totalChunks);
+
+    test_best_fit(totalChunks);
+    test_small_allocations(totalChunks);
+    test_small_double_free(totalChunks);
+    printf("All tests passed\n");
+    return EXIT_SUCCESS;
+}